@@ -1,636 +1,3596 @@
-
-// aud2wav
-
-// The main difference between AUD and IMA-ADPCM-WAV is that AUD contains a continuous stream of ADPCM data,
-// decoder is never reinitialized, while WAV is divided into independently decodable blocks,
-// each block starts with a header containing one decoded sample and decoder state
-
-#include <stdio.h>
-#include <stdlib.h> // errno
-#include <unistd.h> // optarg, optind
-#include <string.h>
-
-
-
-/******************************** AUD headers ********************************/
-
-// NEW AUD format header (bytes 0..11)
-struct {
-	unsigned short samplerate;
-	unsigned short encsize_lo;
-	unsigned short encsize_hi;
-	unsigned short decsize_lo;
-	unsigned short decsize_hi;
-	unsigned char flags; // bit0=stereo, bit1=16bit
-	unsigned char codec; // 1=Westwood ADPCM, 99=IMA ADPCM
-} AUD_HEADER_NEW;
-
-// OLD AUD format header (bytes 0..7)
-struct {
-	unsigned short samplerate;
-	unsigned short encsize_lo;
-	unsigned short encsize_hi;
-	unsigned char flags; // bit0=stereo, bit1=16bit
-	unsigned char codec; // 1=Westwood ADPCM, 99=IMA ADPCM
-} AUD_HEADER_OLD;
-
-// Version-independent pseudo header, used in this app only
-struct {
-	unsigned short samplerate;
-	unsigned long encsize;
-	unsigned long decsize; // not used
-	unsigned char flags;
-	unsigned char codec;
-	// Additional file info
-	unsigned int filesize;
-	unsigned int first_block_offset;
-	unsigned int first_block_size;
-	unsigned int blocks;
-	unsigned int adpcm_bytes;
-	unsigned int num_samples;
-} AUD_HEADER; // pseudo header
-
-// Block header, follows file header (NEW bytes 12..19, OLD bytes 8..15)
-struct {
-	unsigned short encsize;
-	unsigned short decsize;
-	unsigned short deaf; // 0xDEAF
-	unsigned short zero; // 0x0000
-} AUD_BLOCK_HEADER;
-
-
-
-/******************************** WAV headers ********************************/
-
-// Full header of a PCM .wav file
-struct {
-	unsigned long RIFF;
-	unsigned long riffsize;
-	unsigned long WAVE;
-	unsigned long fmt;
-	unsigned long fmtlen;
-	unsigned short wFormatTag; // 1=PCM
-	unsigned short nChannels;
-	unsigned long nSamplesPerSec;
-	unsigned long nAvgBytesPerSec;
-	unsigned short nBlockAlign;
-	unsigned short wBitsPerSample;
-	//unsigned short cbSize; // 0
-	unsigned long data;
-	unsigned long datalen;
-} WAV_HEADER_PCM;
-
-// Full header of an IMA ADPCM .wav file
-struct {
-	unsigned long RIFF;
-	unsigned long riffsize;
-	unsigned long WAVE;
-	unsigned long fmt;
-	unsigned long fmtlen;
-	unsigned short wFormatTag; // 0x11=IMA ADPCM
-	unsigned short nChannels;
-	unsigned long nSamplesPerSec;
-	unsigned long nAvgBytesPerSec;
-	unsigned short nBlockAlign;
-	unsigned short wBitsPerSample;
-	unsigned short cbSize; // 2
-	unsigned short samplesPerBlock;
-	unsigned long fact;
-	unsigned long factlen;
-	unsigned long nSamples;
-	unsigned long data;
-	unsigned long datalen;
-} WAV_HEADER_ADPCM;
-
-// Header of each ADPCM block
-struct {
-	short sample; // PCM decoded sample
-	unsigned char index; // decoder state initialization
-	unsigned char zero;
-} WAV_BLOCK_HEADER;
-
-
-
-/******************************** ADPCM decoding ********************************/
-
-// Lookup tables for algorithm #0
-
-// Original code from EA 2025 source code release
-// https://github.com/electronicarts/CnC_Remastered_Collection
-// #include "ADPCM.CPP" // not used, included only for reference
-#include "DTABLE.CPP" // long DiffTable[89 * 16]
-#include "ITABLE.CPP" // unsigned short IndexTable[89 * 16]
-
-// Lookup tables for algorithms #1, #2, #3
-
-unsigned short ADPCM_STEP_TABLE[89] = {
-	7,     8,     9,     10,    11,    12,     13,    14,    16,
-	17,    19,    21,    23,    25,    28,     31,    34,    37,
-	41,    45,    50,    55,    60,    66,     73,    80,    88,
-	97,    107,   118,   130,   143,   157,    173,   190,   209,
-	230,   253,   279,   307,   337,   371,    408,   449,   494,
-	544,   598,   658,   724,   796,   876,    963,   1060,  1166,
-	1282,  1411,  1552,  1707,  1878,  2066,   2272,  2499,  2749,
-	3024,  3327,  3660,  4026,  4428,  4871,   5358,  5894,  6484,
-	7132,  7845,  8630,  9493,  10442, 11487,  12635, 13899, 15289,
-	16818, 18500, 20350, 22385, 24623, 27086,  29794, 32767
-};
-char ADPCM_INDEX_ADJUST[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
-
-int use_algorithm = 0;
-
-void ADPCM_decode_sample(char *index, long *sample, unsigned char nibble) {
-	
-	int diff;
-	
-	if (use_algorithm == 0) { // Algorithm #0: original Westwood, uses large pre-calculated lookup tables
-		
-		int fastindex = (*index << 4) + nibble;
-		diff = DiffTable[fastindex];         // DTABLE.CPP
-		*index = IndexTable[fastindex] >> 4; // ITABLE.CPP
-
-	} else {
-		
-		// Code common to algorithms #1, #2, #3
-		
-		int sign = nibble & 8;
-		int delta = nibble & 7;
-		
-		unsigned short step = ADPCM_STEP_TABLE[*index];
-		
-		switch (use_algorithm) {
-			case 2:  // Algorithm #2: slightly optimized, not sample-accurate, error accumulates
-				diff = ((delta * step) >> 2) + (step >> 3);
-				break;
-			
-			case 3:  // Algorithm #3: fully optimized, even worse
-				diff = ((delta * 2 + 1) * step) >> 3;
-				break;
-			
-			default: // Algorithm #1: using small lookup tables, result is identical to the original
-				diff = 0;
-				if (delta & 4) diff += step; step >>= 1;
-				if (delta & 2) diff += step; step >>= 1;
-				if (delta & 1) diff += step; step >>= 1;
-				diff += step;
-		}
-		
-		if (sign) diff = -diff;
-		
-		*index += ADPCM_INDEX_ADJUST[delta];
-		if (*index < 0) *index = 0;
-		if (*index > 88) *index = 88;
-		
-	} // algorithms #1, #2, #3
-	
-	*sample += diff;
-	if (*sample > 32767) *sample = 32767;
-	if (*sample < -32768) *sample = -32768;
-}
-
-
-
-/******************************** THE PROGRAM ********************************/
-
-void usage(char *argv0) {
-	// Extract filename from the command line
-	char *exe = strrchr(argv0, '/');      // Full path (unix)
-	if (!exe) exe = strrchr(argv0, '\\'); // Full path (windows)
-	exe = exe ? ++exe : argv0;            // Filename only
-	
-	fprintf(stderr, "Remuxes a Westwood AUD file into an IMA ADPCM WAV file\n", exe);
-	fprintf(stderr, "Usage: %s [-o out1.wav] [-b <blocksize> | -d | -4] <input1.aud> [input2.aud ...]\n", exe);
-	fprintf(stderr, "\t-o <filename>: specify first output filename, ignored if -4 is used\n");
-	fprintf(stderr, "\t-b <blocksize>: specify WAV ADPCM block size (including header), possible values:\n");
-	fprintf(stderr, "\t              512 - most compatible [default]\n");
-	fprintf(stderr, "\t    8..2760 mod 4 - Windows ACM compatible\n");
-	fprintf(stderr, "\t         4..32771 - all possible\n");
-	fprintf(stderr, "\t               -1 - choose the smallest file out of ACM-compatible\n");
-	fprintf(stderr, "\t               -2 - choose the smallest file out of all possible\n");
-	fprintf(stderr, "\t-d: decode to PCM instead of remuxing\n");
-	fprintf(stderr, "\t-4: decode to 4 PCM files using 4 different algorithms: (implies -d)\n");
-	fprintf(stderr, "\t            algo0 - large LUT based, original Westwood [default]\n");
-	fprintf(stderr, "\t            algo1 - small LUT based\n");
-	fprintf(stderr, "\t            algo2 - small LUT based, slightly optimized\n");
-	fprintf(stderr, "\t            algo3 - small LUT based, fully optimized\n");
-	exit(0);
-}
-
-int main(int argc, char *argv[]) {
-	
-	// Default values for command-line input
-	char *ofilename = 0;
-	int blocksize = 512; // ADPCM bytes per block: 0..32767 -> Total bytes per block: 4..32771
-	char decode = 0;
-	int algo_last = 0; // set to 3 when decoding to 4 different algorithms
-	
-	// Parse command-line arguments
-	int c;
-	while ((c = getopt(argc, argv, "ho:b:d4")) != -1)
-		switch (c) {
-			case 'o': // output filename
-				ofilename = optarg;
-				break;
-			
-			case 'b': // blocksize
-				c = atoi(optarg);
-				if (((c >= 4) && (c <= 32771)) || (c == -1) || (c == -2)) {
-					blocksize = c;
-				} else
-					fprintf(stderr, "Invalid blocksize specified: %d. Parameter ignored.\n", c);
-				break;
-			
-			case 'd': // decode
-				decode = 1;
-				break;
-			
-			case '4': // decode x4
-				decode = 1;
-				algo_last = 3;
-				break;
-			
-			default: // 'h', '?'
-				usage(argv[0]);
-		}
-	
-	if (argc == 1) // zero arguments passed
-		usage(argv[0]);
-	
-	int arg;
-	FILE *aud;
-	FILE *wav;
-	unsigned int b, i, o; // loop indexes: input block, input index, otput index
-	unsigned int reat;
-	unsigned char in_buffer[65535]; // absolute theoretical maximum
-	unsigned char in_odd, out_odd, nibble;
-	unsigned char out_buffer[sizeof(in_buffer) * 4];
-	short *out_pcm = (short *)&out_buffer;
-	char adpcm_index;
-	long adpcm_sample;
-	unsigned int wav_blocksize; // unlike "blocksize" this one does NOT include 4-byte header
-	unsigned int wav_blocks;
-	unsigned int wav_datalen;
-	// These are used for finding optimal blocksize
-	unsigned int test_blocks;
-	unsigned int test_samples_per_block;
-	unsigned int test_datalen;
-	char *str;
-	
-	// Loop through all input files
-	
-	for (arg = optind; arg < argc; arg++) {
-		aud = fopen(argv[arg], "rb"); 
-		if (!aud) {
-			fprintf(stderr, "Error opening %s: %s\n", argv[arg], strerror(errno));
-		} else {
-			fprintf(stderr, "\n%s: successfully opened\n", argv[arg]);
-			
-			fseek(aud, 0, SEEK_END);
-			AUD_HEADER.filesize = ftell(aud);
-			
-			// Try to read block header at position after NEW format header
-			
-			fseek(aud, sizeof(AUD_HEADER_NEW), SEEK_SET);
-			fread(&AUD_BLOCK_HEADER, 1, sizeof(AUD_BLOCK_HEADER), aud); // read block (bytes 12..19)
-			if ((AUD_BLOCK_HEADER.deaf == 0xDEAF) && (AUD_BLOCK_HEADER.zero == 0)) {
-				
-				// Matched NEW format AUD
-				
-				fprintf(stderr, "New AUD format detected\n");
-				AUD_HEADER.first_block_offset = sizeof(AUD_HEADER_NEW);
-				fseek(aud, 0, SEEK_SET);
-				fread(&AUD_HEADER_NEW, 1, sizeof(AUD_HEADER_NEW), aud);
-				AUD_HEADER.samplerate = AUD_HEADER_NEW.samplerate;
-				AUD_HEADER.encsize = AUD_HEADER_NEW.encsize_lo + (AUD_HEADER_NEW.encsize_hi << 16);
-				AUD_HEADER.decsize = AUD_HEADER_NEW.decsize_lo + (AUD_HEADER_NEW.decsize_hi << 16);
-				AUD_HEADER.flags = AUD_HEADER_NEW.flags;
-				AUD_HEADER.codec = AUD_HEADER_NEW.codec;
-			} else {
-				
-				// Try to read block header at position after OLD format header
-				
-				fseek(aud, sizeof(AUD_HEADER_OLD), SEEK_SET);
-				fread(&AUD_BLOCK_HEADER, 1, sizeof(AUD_BLOCK_HEADER), aud);
-				if ((AUD_BLOCK_HEADER.deaf == 0xDEAF) && (AUD_BLOCK_HEADER.zero == 0)) {
-					
-					// Matched OLD format AUD
-					
-					fprintf(stderr, "Old AUD format detected\n");
-					AUD_HEADER.first_block_offset = sizeof(AUD_HEADER_OLD);
-					fseek(aud, 0, SEEK_SET);
-					fread(&AUD_HEADER_OLD, 1, sizeof(AUD_HEADER_OLD), aud);
-					AUD_HEADER.samplerate = AUD_HEADER_OLD.samplerate;
-					AUD_HEADER.encsize = AUD_HEADER_OLD.encsize_lo + (AUD_HEADER_OLD.encsize_hi << 16);
-					AUD_HEADER.decsize = 0;
-					AUD_HEADER.flags = AUD_HEADER_OLD.flags;
-					AUD_HEADER.codec = AUD_HEADER_OLD.codec;
-				} else {
-					fprintf(stderr, "%s: unknown AUD format\n", argv[arg]);
-					fclose(aud);
-					continue;
-				}
-			}
-			fprintf(stderr, "File size: %u\n", AUD_HEADER.filesize);
-			fprintf(stderr, "Sample rate: %u\n", AUD_HEADER.samplerate);
-			fprintf(stderr, "Encoded stream size: %u bytes\n", AUD_HEADER.encsize);
-			if (AUD_HEADER.decsize)
-				fprintf(stderr, "Decoded data size: %u bytes\n", AUD_HEADER.decsize);
-			fprintf(stderr, "Flags: %s, %u-bit\n", (AUD_HEADER.flags & 1) ? "stereo" : "mono", (AUD_HEADER.flags & 2) ? 16 : 8);
-			fprintf(stderr, "Codec: %u (%s)\n", AUD_HEADER.codec, (AUD_HEADER.codec == 1) ? "Westwood ADPCM" : (AUD_HEADER.codec == 99) ? "IMA ADPCM" : "Unknown");
-			
-			if (((AUD_HEADER.flags & 3) != 2) || (AUD_HEADER.codec != 99)) {
-				fprintf(stderr, "Sorry, only mono 16-bit IMA ADPCM files are supported\n");
-				fclose(aud);
-				continue;
-			}
-			
-			// Analyze AUD stream (first read-through), want to count blocks and samples in advance
-			
-			AUD_HEADER.blocks = 0;
-			AUD_HEADER.adpcm_bytes = 0;
-			while (1) {
-				reat = fread(&AUD_BLOCK_HEADER, 1, sizeof(AUD_BLOCK_HEADER), aud);
-				if (reat == 0) break; // end of file, OK
-				if (reat != sizeof(AUD_BLOCK_HEADER)) {
-					fprintf(stderr, "%s: error while analyzing file, read %u bytes of header instead of %u\n", argv[arg], reat, sizeof(AUD_BLOCK_HEADER));
-					break;
-				}
-				if ((AUD_BLOCK_HEADER.deaf != 0xDEAF) || (AUD_BLOCK_HEADER.zero != 0)) {
-					fprintf(stderr, "%s: error while analyzing file, invalid header @ offset %u\n", argv[arg], ftell(aud) - sizeof(AUD_BLOCK_HEADER));
-					break;
-				}
-				reat = fread(in_buffer, 1, AUD_BLOCK_HEADER.encsize, aud);
-				if (reat != AUD_BLOCK_HEADER.encsize) {
-					fprintf(stderr, "%s: error while analyzing file, read %u bytes instead of %u\n", argv[arg], reat, AUD_BLOCK_HEADER.encsize);
-					break;
-				}
-				if (AUD_HEADER.blocks == 0)
-					AUD_HEADER.first_block_size = AUD_BLOCK_HEADER.encsize;
-				
-				AUD_HEADER.blocks++;
-				AUD_HEADER.adpcm_bytes += AUD_BLOCK_HEADER.encsize;
-			}
-			AUD_HEADER.num_samples = AUD_HEADER.adpcm_bytes * 2;
-			
-			fprintf(stderr, "Scanned %u blocks, first block %u bytes, last block %u bytes\n", AUD_HEADER.blocks, AUD_HEADER.first_block_size, AUD_BLOCK_HEADER.encsize);
-			i = AUD_HEADER.adpcm_bytes + sizeof(AUD_BLOCK_HEADER) * AUD_HEADER.blocks;
-			fprintf(stderr, "Total ADPCM bytes with block headers: %u, diff with header: %d\n", i, i - AUD_HEADER.encsize);
-			if (AUD_HEADER.decsize)
-				fprintf(stderr, "Decoded PCM size: %u bytes, diff with header: %d\n", AUD_HEADER.num_samples * 2, AUD_HEADER.num_samples * 2 - AUD_HEADER.decsize);
-			i = AUD_HEADER.num_samples * 1000 / AUD_HEADER.samplerate; // duration in milliseconds
-			fprintf(stderr, "Duration: %u:%02u.%03u (%u samples)\n", i / 60000, (i / 1000) % 60, i % 1000, AUD_HEADER.num_samples);
-			
-			if (decode) {
-				
-				// -------------------------------- Mode 1: Decode AUD to PCM WAV --------------------------------
-				
-				for (use_algorithm = 0; use_algorithm <= algo_last; use_algorithm++) { // normally algo_last = 0 (if not -4)
-					
-					// Choose output filename if -o is not specified, if -4, or for second, third etc. input files
-					
-					if (!ofilename || algo_last || (arg != optind)) {
-						ofilename = (char*)&out_buffer; // temporarily use wav output buffer
-						strncpy(ofilename, argv[arg], sizeof(out_buffer) - 11); // leave space for ".algoX.wav\0"
-						if (str = strrchr(ofilename, '.'))                 // if input filename has extension
-							if (stricmp(str, ".aud") == 0)                 // and it is .aud
-								str[0] = 0;                                // strip it
-						str = &ofilename[strlen(ofilename)];               // find end of filename
-						if (algo_last)                                     // if -4
-							str += sprintf(str, ".algo%u", use_algorithm); // append .algoX
-						strcpy(str, ".wav");                               // append .wav
-					}
-					
-					wav = fopen(ofilename, "wb");
-					if (!wav) {
-						fprintf(stderr, "Error creating %s: %s\n", ofilename, strerror(errno));
-					} else {
-						
-						fprintf(stderr, "Decoding AUD to %s\n", ofilename);
-						
-						WAV_HEADER_PCM.RIFF = 0x46464952;
-						WAV_HEADER_PCM.riffsize = AUD_HEADER.num_samples * 2 + sizeof(WAV_HEADER_PCM) - 8;
-						WAV_HEADER_PCM.WAVE = 0x45564157;
-						WAV_HEADER_PCM.fmt = 0x20746D66;
-						WAV_HEADER_PCM.fmtlen = 16;
-						WAV_HEADER_PCM.wFormatTag = 1;
-						WAV_HEADER_PCM.nChannels = 1;
-						WAV_HEADER_PCM.nSamplesPerSec = AUD_HEADER.samplerate;
-						WAV_HEADER_PCM.nAvgBytesPerSec = WAV_HEADER_PCM.nSamplesPerSec * 2;
-						WAV_HEADER_PCM.nBlockAlign = 2;
-						WAV_HEADER_PCM.wBitsPerSample = 16;
-						WAV_HEADER_PCM.data = 0x61746164;
-						WAV_HEADER_PCM.datalen = AUD_HEADER.num_samples * 2;
-						
-						reat = fwrite(&WAV_HEADER_PCM, 1, sizeof(WAV_HEADER_PCM), wav);
-						if (reat != sizeof(WAV_HEADER_PCM)) {
-							fprintf(stderr, "Error: wrote %d bytes of PCM WAV header instead of %d: %s\n", reat, sizeof(WAV_HEADER_PCM), strerror(errno));
-							break;
-						}
-						
-						// Initialize decoder
-						adpcm_index = 0;
-						adpcm_sample = 0;
-						
-						fseek(aud, AUD_HEADER.first_block_offset, SEEK_SET);
-						
-						// Decode all blocks
-						for (b = 0; b < AUD_HEADER.blocks; b++) {
-							fread(&AUD_BLOCK_HEADER, 1, sizeof(AUD_BLOCK_HEADER), aud);
-							fread(in_buffer, 1, AUD_BLOCK_HEADER.encsize, aud);
-							for (i = 0; i < AUD_BLOCK_HEADER.encsize; i++) {
-								// Decode each byte into 2 samples, least significant nibble first
-								ADPCM_decode_sample(&adpcm_index, &adpcm_sample, in_buffer[i] & 0xF);
-								out_pcm[i*2] = adpcm_sample;
-								ADPCM_decode_sample(&adpcm_index, &adpcm_sample, (in_buffer[i] >> 4) & 0xF);
-								out_pcm[i*2 + 1] = adpcm_sample;
-							}
-							reat = fwrite(out_pcm, 1, AUD_BLOCK_HEADER.encsize * 4, wav);
-							if (reat != AUD_BLOCK_HEADER.encsize * 4) {
-								fprintf(stderr, "Error: wrote %d bytes of PCM WAV data instead of %d: %s\n", reat, AUD_BLOCK_HEADER.encsize * 4, strerror(errno));
-								break;
-							}
-						} // for AUD blocks
-						
-						fclose(wav);
-					} // if fopen(wav) succeeded
-				} // for algorithms
-				
-			} else { // if remuxing (not decode)
-				
-				// -------------------------------- Mode 2: Remux AUD to ADPCM WAV --------------------------------
-				
-				// Choose output filename if -o is not specified, and for second, third etc. input files
-				
-				if (!ofilename || (arg != optind)) {
-					ofilename = (char*)&out_buffer; // temporarily use wav output buffer
-					strncpy(ofilename, argv[arg], sizeof(out_buffer) - 5); // leave space for ".wav\0"
-					do {
-						if (str = strrchr(ofilename, '.')) // if input filename has extension
-							if (!stricmp(str, ".aud")) {   // and it is .aud
-								strcpy(str, ".wav");       // replace it with .wav
-								break;
-							}
-						strcat(ofilename, ".wav");         // otherwise append .wav
-					} while(0);
-				}
-				
-				wav = fopen(ofilename, "wb");
-				if (!wav) {
-					fprintf(stderr, "Error creating %s: %s\n", ofilename, strerror(errno));
-				} else {
-					
-					fprintf(stderr, "Remuxing AUD to %s\n", ofilename);
-					
-					// Find optimal blocksize if needed
-					// Initialize variables: wav_blocksize, wav_blocks, wav_datalen
-					
-					wav_datalen = INT_MAX;
-					
-					switch (blocksize) {
-						
-						case -1: // Find an ACM-compatible blocksize with smallest resulting file size, using bruteforce
-							for (i = 8; i <= 2760; i += 4) {
-								test_samples_per_block = (i - 4) * 2 + 1;
-								test_blocks = AUD_HEADER.num_samples / test_samples_per_block;
-								if (AUD_HEADER.num_samples % test_samples_per_block)
-									test_blocks++;
-								test_datalen = i * test_blocks;
-								if (test_datalen < wav_datalen) {
-									wav_blocksize = i - 4;
-									wav_blocks = test_blocks;
-									wav_datalen = test_datalen;
-								}
-							}
-							break;
-						
-						case -2: // Find any blocksize with smallest resulting file size, using bruteforce
-							for (i = 4; i <= 32771; i++) {
-								test_samples_per_block = (i - 4) * 2 + 1;
-								test_blocks = AUD_HEADER.num_samples / test_samples_per_block;
-								if (AUD_HEADER.num_samples % test_samples_per_block)
-									test_blocks++;
-								test_datalen = i * test_blocks;
-								if (test_datalen < wav_datalen) {
-									wav_blocksize = i - 4;
-									wav_blocks = test_blocks;
-									wav_datalen = test_datalen;
-								}
-							}
-							break;
-						
-						default: // Use default or user-specified blocksize
-							wav_blocksize = blocksize - 4;
-							test_samples_per_block = wav_blocksize * 2 + 1;
-							wav_blocks = AUD_HEADER.num_samples / test_samples_per_block;
-							if (AUD_HEADER.num_samples % test_samples_per_block)
-								wav_blocks++;
-							wav_datalen = blocksize * wav_blocks;
-					}
-					
-					fprintf(stderr, "Selected WAV block size: %u (4 + %u) bytes\n", wav_blocksize + 4, wav_blocksize);
-					
-					WAV_HEADER_ADPCM.RIFF = 0x46464952;
-					WAV_HEADER_ADPCM.riffsize = wav_datalen + sizeof(WAV_HEADER_ADPCM) - 8;
-					WAV_HEADER_ADPCM.WAVE = 0x45564157;
-					WAV_HEADER_ADPCM.fmt = 0x20746D66;
-					WAV_HEADER_ADPCM.fmtlen = 20;
-					WAV_HEADER_ADPCM.wFormatTag = 0x11;
-					WAV_HEADER_ADPCM.nChannels = 1;
-					WAV_HEADER_ADPCM.nSamplesPerSec = AUD_HEADER.samplerate;
-					WAV_HEADER_ADPCM.nAvgBytesPerSec = AUD_HEADER.samplerate * (wav_blocksize + 4) / (wav_blocksize * 2 + 1);
-					WAV_HEADER_ADPCM.nBlockAlign = wav_blocksize + 4;
-					WAV_HEADER_ADPCM.wBitsPerSample = 4;
-					WAV_HEADER_ADPCM.cbSize = 2;
-					WAV_HEADER_ADPCM.samplesPerBlock = wav_blocksize * 2 + 1;
-					WAV_HEADER_ADPCM.fact = 0x74636166;
-					WAV_HEADER_ADPCM.factlen = 4;
-					WAV_HEADER_ADPCM.nSamples = AUD_HEADER.num_samples;
-					WAV_HEADER_ADPCM.data = 0x61746164;
-					WAV_HEADER_ADPCM.datalen = wav_datalen;
-					
-					reat = fwrite(&WAV_HEADER_ADPCM, 1, sizeof(WAV_HEADER_ADPCM), wav);
-					if (reat != sizeof(WAV_HEADER_ADPCM)) {
-						fprintf(stderr, "Error: wrote %d bytes of ADPCM WAV header instead of %d: %s\n", reat, sizeof(WAV_HEADER_ADPCM), strerror(errno));
-						break;
-					}
-					
-					// Initialize decoder
-					adpcm_index = 0;
-					adpcm_sample = 0;
-					
-					fseek(aud, AUD_HEADER.first_block_offset, SEEK_SET);
-					o = -1; // output byte index in WAV block, -1 means block header needs to be written instead
-					
-					// Loop through each AUD block
-					for (b = 0; b < AUD_HEADER.blocks; b++) {
-						fread(&AUD_BLOCK_HEADER, 1, sizeof(AUD_BLOCK_HEADER), aud);
-						fread(in_buffer, 1, AUD_BLOCK_HEADER.encsize, aud);
-						
-						// Loop for each nibble in AUD block
-						for (i = 0, in_odd = 0; i < AUD_BLOCK_HEADER.encsize; (in_odd = !in_odd) ? i : i++) {
-							nibble = in_odd ? (in_buffer[i] >> 4) : (in_buffer[i] & 0xF);
-							
-							ADPCM_decode_sample(&adpcm_index, &adpcm_sample, nibble);
-							
-							if (o == -1) {
-								// Write WAV block header
-								WAV_BLOCK_HEADER.sample = adpcm_sample;
-								WAV_BLOCK_HEADER.index = adpcm_index;
-								WAV_BLOCK_HEADER.zero = 0;
-								reat = fwrite(&WAV_BLOCK_HEADER, 1, sizeof(WAV_BLOCK_HEADER), wav);
-								if (reat != sizeof(WAV_BLOCK_HEADER)) {
-									fprintf(stderr, "Error: wrote %d bytes of ADPCM block header instead of %d: %s\n", reat, sizeof(WAV_BLOCK_HEADER), strerror(errno));
-									b = AUD_HEADER.blocks; // breaks the outer loop of AUD blocks
-									break;
-								}
-								// Prepare to write WAV block contents
-								o = 0;
-								out_odd = 0;
-							} else { // o != -1
-								// Put nibble into output buffer
-								if (out_odd == 0) {
-									out_buffer[o] = nibble;
-								} else {
-									out_buffer[o] += (nibble << 4);
-									o++;
-								}
-								out_odd = !out_odd;
-								
-								// Write WAV block contents when block is full
-								if (o == wav_blocksize) {
-									reat = fwrite(out_buffer, 1, wav_blocksize, wav);
-									if (reat != wav_blocksize) {
-										fprintf(stderr, "Error: wrote %d bytes of ADPCM data instead of %d: %s\n", reat, wav_blocksize, strerror(errno));
-										b = AUD_HEADER.blocks; // breaks the outer loop of AUD blocks
-										break;
-									}
-									memset(out_buffer, 0, wav_blocksize);
-									o = -1;
-								}
-							}
-						}
-					}
-					
-					// Write the last incomplete WAV block
-					if (o != -1) {
-						if (out_odd) o++;
-						memset(&out_buffer[o], 0, wav_blocksize - o); // clear the rest of the buffer
-						reat = fwrite(out_buffer, 1, wav_blocksize, wav);
-						if (reat != wav_blocksize) {
-							fprintf(stderr, "Error: wrote %d bytes of ADPCM data instead of %d: %s\n", reat, wav_blocksize, strerror(errno));
-							break;
-						}
-					}
-					
-					fclose(wav);
-					
-				} // if fopen(wav) succeeded
-			} // if remuxing
-			
-			fclose(aud);
-			
-		} // if fopen(aud) succeeded
-	} // for all input files
-  
-  return 0;
-}
+// aud2wav
+
+// Command-line front end, all AUD parsing, decoding and remuxing is done by audlib
+
+#define _FILE_OFFSET_BITS 64 // stat() and fopen() of files over 2 GB on 32-bit systems
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h> // sysconf
+#include <getopt.h> // getopt_long, optarg, optind
+#include <string.h>
+#include <math.h> // sqrt, isnan
+#include <time.h> // clock_gettime
+#include <pthread.h>
+#include <sys/stat.h> // stat
+
+#ifdef _WIN32
+#include <io.h>    // _setmode
+#include <fcntl.h> // _O_BINARY
+#else
+#include <strings.h>
+#include <signal.h>     // --serve: SIGPIPE
+#include <sys/socket.h>
+#include <sys/un.h>     // sockaddr_un
+#include <sys/time.h>   // timeval, --serve timeouts
+#ifdef __linux__
+#include <poll.h>        // --watch
+#include <sys/inotify.h>
+#endif
+#define stricmp strcasecmp
+#define strnicmp strncasecmp
+#endif
+
+#include "audlib.h"
+
+
+
+/******************************** Worker state ********************************/
+
+#define OUTPUTS_MAX 8 // --outputs
+#define PARALLEL_WINDOW (1 << 23) // bytes of output a file split among spare -j threads is decoded to at a time
+
+// Command-line options, shared read-only by all workers
+typedef struct {
+	int blocksize; // ADPCM bytes per block: 0..32767 -> Total bytes per block: 4..32771
+	char decode;
+	int algo_last; // set to 3 when decoding to 4 different algorithms
+	char report;   // measure divergence of algorithms from #0
+	int jobs;      // number of worker threads
+	char stream;   // convert in a single pass, even if input is seekable
+	char probe;    // --probe: PROBE_CSV or PROBE_JSON, 0 to convert
+	int threads;   // threads decoding one file, when there are fewer files than jobs
+	const char *range; // --range start:end, NULL for the whole stream
+	FILE *stats;       // --stats, one JSON line per file and a summary, NULL if not requested
+	char verify;   // --verify: check that remuxed blocks decode to the same samples as the stream
+	const char *cache; // --cache manifest, NULL if not requested
+	char encode;       // -e: encode PCM WAV files into AUD instead
+	int encode_mode;   // AUD_ENCODE_GREEDY or AUD_ENCODE_TRELLIS
+	int outputs;       // --outputs: number of output files of each input, 0 if not requested
+	int output[OUTPUTS_MAX]; // their WAV block sizes as given to -b, 0 for PCM
+	uint32_t rate;     // --rate: sample rate of the PCM output of -d, 0 to keep the stream's own
+	int rate_quality;  // AUD_RESAMPLE_FAST, AUD_RESAMPLE_GOOD or AUD_RESAMPLE_BEST
+	char analyze;      // --analyze: measure levels and loudness of the samples while converting
+} OPTIONS;
+
+const char *resample_quality_names[] = { "fast", "good", "best" }; // --rate, AUD_RESAMPLE_FAST...
+
+#define PROBE_CSV  1
+#define PROBE_JSON 2
+#define PROBE_CSV_HEADER "file,outcome,format,samplerate,channels,bits,codec,samples,duration,blocks,first_block_size,last_block_size,filesize,encsize,decsize,encsize_diff,decsize_diff,method,error"
+
+// Divergence of one algorithm from #0 over a stream, for --report
+typedef struct {
+	uint64_t first;      // first divergent sample, UINT64_MAX if identical
+	uint32_t max_error;
+	uint64_t max_sample; // where max_error is
+	double sum_sq;       // squared errors
+	double *second_sq;   // squared errors of each second of audio, for drift
+	uint32_t seconds;
+	uint32_t seconds_size;
+} DIVERGENCE;
+
+// Output buffers: decoders fill one while the writer thread writes the previous ones
+// A worker fills at most one buffer per file it writes, so there are always some left for the writer
+#define WRITER_BUFFERS     (AUD_LANES + 4)
+#define WRITER_BUFFER_SIZE (1 << 18)
+
+typedef struct OUTPUT OUTPUT;
+
+// Writes the output of one worker thread, in its own thread so that writes overlap decoding
+typedef struct {
+	unsigned char *buffer[WRITER_BUFFERS]; // allocated when first used
+	OUTPUT *owner[WRITER_BUFFERS];         // output file of each queued buffer
+	uint32_t len[WRITER_BUFFERS];
+	int free[WRITER_BUFFERS];  // stack of unused buffers
+	int free_count;
+	int queue[WRITER_BUFFERS]; // FIFO of filled buffers, the head one is being written
+	int queue_head;
+	int queue_count;
+	char threaded; // 0 = no writer thread, buffers are written when they are queued
+	char stop;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond; // signals both queued and written buffers
+} WRITER;
+
+// One output file, written through the buffers of a writer
+struct OUTPUT {
+	WRITER *writer;
+	FILE *file;
+	int slot;     // buffer being filled, -1 if none
+	uint32_t len; // bytes in it
+	int pending;  // buffers queued for writing, guarded by writer->mutex
+	int error;    // errno of the first failed write, guarded by writer->mutex
+	char name[FILENAME_MAX]; // output filename, for error messages
+	// --stats, valid after output_flush()
+	uint64_t bytes;    // written
+	double write_time; // spent in fwrite, by the writer thread
+	double wait_time;  // spent by the worker waiting for the writer
+};
+
+// Per-file telemetry for --stats, times in seconds
+typedef struct {
+	double start;   // when the worker took the file
+	double open;    // opening and reading the header
+	double scan;    // counting blocks, loading or building the seek index
+	double convert; // decoding or remuxing, including waits for the writer
+	double write;   // writing output files, overlaps convert
+	double wait;    // convert stalled by writes
+	double total;
+	uint64_t bytes_out;
+	uint64_t bytes_in; // of a WAV input (-e), AUD inputs take these from their header
+	uint64_t samples;
+	int blocksize;  // selected WAV block size, 0 if decoding
+	char opened;    // header info is valid
+	char failed;
+	char cached;    // outputs were current, skipped
+	char analyzed;  // levels of the worker's analysis are valid
+	char error[256]; // first error or warning
+} STATS;
+
+// Everything the conversion of one file touches, one instance per worker thread
+typedef struct {
+	AUD_CONTEXT ctx;
+	FILE *aud;       // input file, NULL for a MIX entry
+	AUD_MEMORY entry; // MIX entry of the current file, read in place, data = NULL for files
+	AUD_INDEX index; // seek index of the current file, for --range
+	AUD_RESAMPLER resampler; // --rate, of the current file, filter = NULL if not resampling
+	AUD_ANALYSIS analysis;   // --analyze, of the current file
+	DIVERGENCE divergence[ADPCM_ALGORITHMS]; // of the current file, valid if reported
+	char reported;
+	WRITER *writer; // shared by all lanes of a worker thread
+	STATS stats;    // of the current file
+	unsigned char out_buffer[AUD_BLOCK_MAX * 4];
+	char ofilename[FILENAME_MAX];
+	// Per-file log, flushed as a whole so that output of parallel workers doesn't interleave
+	char buffered;   // 0 = print log lines directly to stderr
+	char *log;
+	size_t log_len;
+	size_t log_size;
+} WORKER;
+
+pthread_mutex_t stderr_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t stdout_mutex = PTHREAD_MUTEX_INITIALIZER; // --probe lines
+
+double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void wlog(WORKER *w, const char *format, ...) {
+	va_list ap;
+	int len;
+	
+	if (!w->buffered) {
+		va_start(ap, format);
+		vfprintf(stderr, format, ap);
+		va_end(ap);
+		return;
+	}
+	
+	va_start(ap, format);
+	len = vsnprintf(NULL, 0, format, ap);
+	va_end(ap);
+	if (len < 0) return;
+	
+	if (w->log_len + len + 1 > w->log_size) {
+		size_t size = w->log_size ? w->log_size : 1024;
+		char *log;
+		while (w->log_len + len + 1 > size) size *= 2;
+		log = realloc(w->log, size);
+		if (!log) return; // drop the line rather than the whole log
+		w->log = log;
+		w->log_size = size;
+	}
+	
+	va_start(ap, format);
+	vsnprintf(&w->log[w->log_len], w->log_size - w->log_len, format, ap);
+	va_end(ap);
+	w->log_len += len;
+}
+
+// Same as wlog(), also keeps the first error of the file for --stats
+void werror(WORKER *w, const char *format, ...) {
+	char line[sizeof(w->stats.error) + 1];
+	va_list ap;
+	size_t len;
+	
+	va_start(ap, format);
+	vsnprintf(line, sizeof(line), format, ap);
+	va_end(ap);
+	wlog(w, "%s", line);
+	if (w->stats.error[0]) return;
+	len = strlen(line);
+	if (len && (line[len - 1] == '\n')) line[--len] = 0;
+	strncpy(w->stats.error, line, sizeof(w->stats.error) - 1);
+	w->stats.error[sizeof(w->stats.error) - 1] = 0;
+}
+
+void wlog_flush(WORKER *w) {
+	if (!w->log_len) return;
+	pthread_mutex_lock(&stderr_mutex);
+	fwrite(w->log, 1, w->log_len, stderr);
+	fflush(stderr);
+	pthread_mutex_unlock(&stderr_mutex);
+	w->log_len = 0;
+}
+
+
+
+/******************************** Output ********************************/
+
+// Writes a filled buffer unless its file has already failed, returns errno on failure
+int write_buffer(WRITER *wr, int slot, int error) {
+	OUTPUT *o = wr->owner[slot];
+	double start = now();
+	size_t written;
+	
+	if (error) return error; // a failed file is not written any further
+	errno = 0;
+	written = fwrite(wr->buffer[slot], 1, wr->len[slot], o->file);
+	o->write_time += now() - start; // only ever written by one thread at a time
+	o->bytes += written;
+	if (written != wr->len[slot])
+		return errno ? errno : EIO;
+	return 0;
+}
+
+// Hands a written buffer back, called with the mutex held
+void buffer_written(WRITER *wr, int slot, int error) {
+	OUTPUT *o = wr->owner[slot];
+	
+	if (error && !o->error)
+		o->error = error;
+	o->pending--;
+	wr->free[wr->free_count++] = slot;
+}
+
+void *writer_thread(void *arg) {
+	WRITER *wr = arg;
+	int slot, error;
+	
+	pthread_mutex_lock(&wr->mutex);
+	while (1) {
+		while (!wr->queue_count && !wr->stop)
+			pthread_cond_wait(&wr->cond, &wr->mutex);
+		if (!wr->queue_count) break; // stopped and everything is written
+		slot = wr->queue[wr->queue_head];
+		error = wr->owner[slot]->error;
+		pthread_mutex_unlock(&wr->mutex);
+		
+		error = write_buffer(wr, slot, error);
+		
+		pthread_mutex_lock(&wr->mutex);
+		buffer_written(wr, slot, error);
+		wr->queue_head = (wr->queue_head + 1) % WRITER_BUFFERS;
+		wr->queue_count--;
+		pthread_cond_broadcast(&wr->cond);
+	}
+	pthread_mutex_unlock(&wr->mutex);
+	return NULL;
+}
+
+// Starts the writer thread, if it can't be started buffers are written by the worker itself
+void writer_start(WRITER *wr) {
+	int i;
+	
+	memset(wr, 0, sizeof(WRITER));
+	for (i = 0; i < WRITER_BUFFERS; i++)
+		wr->free[i] = WRITER_BUFFERS - 1 - i;
+	wr->free_count = WRITER_BUFFERS;
+	pthread_mutex_init(&wr->mutex, NULL);
+	pthread_cond_init(&wr->cond, NULL);
+	wr->threaded = (pthread_create(&wr->thread, NULL, writer_thread, wr) == 0);
+}
+
+// Waits for the remaining buffers to be written and frees them
+void writer_stop(WRITER *wr) {
+	int i;
+	
+	if (wr->threaded) {
+		pthread_mutex_lock(&wr->mutex);
+		wr->stop = 1;
+		pthread_cond_broadcast(&wr->cond);
+		pthread_mutex_unlock(&wr->mutex);
+		pthread_join(wr->thread, NULL);
+	}
+	for (i = 0; i < WRITER_BUFFERS; i++)
+		free(wr->buffer[i]);
+	pthread_cond_destroy(&wr->cond);
+	pthread_mutex_destroy(&wr->mutex);
+}
+
+void output_init(OUTPUT *o, WRITER *wr, FILE *file) {
+	o->writer = wr;
+	o->file = file;
+	o->slot = -1;
+	o->len = 0;
+	o->pending = 0;
+	o->error = 0;
+	o->bytes = 0;
+	o->write_time = 0;
+	o->wait_time = 0;
+}
+
+// Hands the buffer being filled over to the writer
+void output_queue(OUTPUT *o) {
+	WRITER *wr = o->writer;
+	int slot = o->slot;
+	
+	if (slot < 0) return;
+	o->slot = -1;
+	wr->owner[slot] = o;
+	wr->len[slot] = o->len;
+	pthread_mutex_lock(&wr->mutex);
+	o->pending++;
+	if (!wr->threaded) { // only this thread uses the writer
+		buffer_written(wr, slot, write_buffer(wr, slot, o->error));
+		pthread_mutex_unlock(&wr->mutex);
+		return;
+	}
+	wr->queue[(wr->queue_head + wr->queue_count++) % WRITER_BUFFERS] = slot;
+	pthread_cond_broadcast(&wr->cond);
+	pthread_mutex_unlock(&wr->mutex);
+}
+
+// Returns space for at least min bytes (up to WRITER_BUFFER_SIZE) to be filled and committed by output_commit()
+// size: set to the space available, NULL is returned if the file has failed
+unsigned char *output_reserve(OUTPUT *o, uint32_t min, uint32_t *size) {
+	WRITER *wr = o->writer;
+	int error;
+	
+	if ((o->slot >= 0) && (WRITER_BUFFER_SIZE - o->len < min))
+		output_queue(o);
+	
+	pthread_mutex_lock(&wr->mutex);
+	if ((o->slot < 0) && !wr->free_count) {
+		double start = now();
+		while (!wr->free_count)
+			pthread_cond_wait(&wr->cond, &wr->mutex);
+		o->wait_time += now() - start;
+	}
+	error = o->error;
+	if ((o->slot < 0) && !error) {
+		o->slot = wr->free[--wr->free_count];
+		o->len = 0;
+	}
+	pthread_mutex_unlock(&wr->mutex);
+	if (error) return NULL;
+	
+	if (!wr->buffer[o->slot] && !(wr->buffer[o->slot] = malloc(WRITER_BUFFER_SIZE))) {
+		pthread_mutex_lock(&wr->mutex);
+		o->error = ENOMEM;
+		wr->free[wr->free_count++] = o->slot;
+		pthread_mutex_unlock(&wr->mutex);
+		o->slot = -1;
+		return NULL;
+	}
+	*size = WRITER_BUFFER_SIZE - o->len;
+	return &wr->buffer[o->slot][o->len];
+}
+
+void output_commit(OUTPUT *o, uint32_t n) {
+	o->len += n;
+}
+
+// Copies data into the output buffers, returns 0 on success
+int output_write(OUTPUT *o, const void *data, size_t n) {
+	const unsigned char *src = data;
+	unsigned char *dst;
+	uint32_t size;
+	
+	while (n > 0) {
+		if (!(dst = output_reserve(o, 1, &size)))
+			return -1;
+		if (size > n) size = n;
+		memcpy(dst, src, size);
+		output_commit(o, size);
+		src += size;
+		n -= size;
+	}
+	return 0;
+}
+
+// Waits until everything committed to the output is written, returns 0 on success, errno of the failed write otherwise
+int output_flush(OUTPUT *o) {
+	WRITER *wr = o->writer;
+	double start = now();
+	int error;
+	
+	output_queue(o);
+	pthread_mutex_lock(&wr->mutex);
+	while (o->pending)
+		pthread_cond_wait(&wr->cond, &wr->mutex);
+	error = o->error;
+	o->wait_time += now() - start;
+	pthread_mutex_unlock(&wr->mutex);
+	return error;
+}
+
+
+
+/******************************** THE PROGRAM ********************************/
+
+void usage(char *argv0) {
+	// Extract filename from the command line
+	char *exe = strrchr(argv0, '/');      // Full path (unix)
+	if (!exe) exe = strrchr(argv0, '\\'); // Full path (windows)
+	exe = exe ? ++exe : argv0;            // Filename only
+	
+	fprintf(stderr, "Remuxes a Westwood AUD file into an IMA ADPCM WAV file, or encodes a PCM WAV file into AUD\n");
+	fprintf(stderr, "Usage: %s [-o out1.wav] [-b <blocksize> | -d | -4 | -e greedy|trellis | --outputs <list>] [-j <jobs>] [-s] [--range start:end] [--report] [--probe csv|json] [--stats <file>] [--verify] [--cache <file>] [--rate <Hz>] [--analyze] [--watch <dir>] <input1.aud> [input2.aud ...]\n", exe);
+	fprintf(stderr, "       %s --serve <socket> [-j <jobs>]\n", exe);
+	fprintf(stderr, "\t-o <filename>: specify first output filename, ignored if -4 is used, - for stdout\n");
+	fprintf(stderr, "\t-b <blocksize>: specify WAV ADPCM block size (including header), possible values:\n");
+	fprintf(stderr, "\t              512 - most compatible [default]\n");
+	fprintf(stderr, "\t    8..2760 mod 4 - Windows ACM compatible\n");
+	fprintf(stderr, "\t         4..32771 - all possible\n");
+	fprintf(stderr, "\t               -1 - choose the smallest file out of ACM-compatible\n");
+	fprintf(stderr, "\t               -2 - choose the smallest file out of all possible\n");
+	fprintf(stderr, "\t-d: decode to PCM instead of remuxing\n");
+	fprintf(stderr, "\t-4: decode to 4 PCM files using 4 different algorithms, in a single pass: (implies -d)\n");
+	fprintf(stderr, "\t            algo0 - large LUT based, original Westwood [default]\n");
+	fprintf(stderr, "\t            algo1 - small LUT based\n");
+	fprintf(stderr, "\t            algo2 - small LUT based, slightly optimized\n");
+	fprintf(stderr, "\t            algo3 - small LUT based, fully optimized\n");
+	fprintf(stderr, "\t-e greedy|trellis: encode mono 16-bit PCM WAV files into AUD (NEW format, IMA ADPCM), outputs are named <input>.aud\n");
+	fprintf(stderr, "\t            greedy - nibble closest to each sample, fast\n");
+	fprintf(stderr, "\t           trellis - searches for the smallest total error, slower, uses all -j threads on a single file\n");
+	fprintf(stderr, "\t--outputs pcm|<blocksize>,...: write several files from a single decode of each input, e.g. --outputs pcm,512,-1,\n");
+	fprintf(stderr, "\t                              named <input>.pcm.wav and <input>.b<blocksize>.wav, up to %d of them\n", OUTPUTS_MAX);
+	fprintf(stderr, "\t-j <jobs>: convert up to <jobs> files in parallel, 0 = one per CPU core [default: 1]\n");
+	fprintf(stderr, "\t           with fewer files than jobs, each file is also split among jobs / files threads\n");
+	fprintf(stderr, "\t-s: convert in a single pass (automatic for pipes), WAV header sizes are updated at the end if possible\n");
+	fprintf(stderr, "\t--range start:end: convert only samples start..end-1, or seconds if followed by s (e.g. 180s:190.5s),\n");
+	fprintf(stderr, "\t                   either can be omitted, uses the seek index <input>.idx and creates it if needed\n");
+	fprintf(stderr, "\t--report: decode with all 4 algorithms and report how far each one drifts from algo0,\n");
+	fprintf(stderr, "\t          no WAV files are written unless -4 is also specified\n");
+	fprintf(stderr, "\t--probe csv|json: print format, duration, block counts and header mismatches of each file to stdout instead of converting,\n");
+	fprintf(stderr, "\t                  walks block headers without reading the ADPCM data, with -s only the file header is read if it's consistent\n");
+	fprintf(stderr, "\t--stats <file>: append timings and sizes of each file and a batch summary to <file> as JSON lines, - for stdout\n");
+	fprintf(stderr, "\t--verify: decode every remuxed WAV block while remuxing and compare it to the AUD stream, a mismatch fails the file\n");
+	fprintf(stderr, "\t--cache <file>: skip inputs whose outputs are current, as recorded in the manifest <file> by earlier runs\n");
+	fprintf(stderr, "\t--serve <socket>: answer remux and decode requests on a Unix domain socket with -j workers instead, see README\n");
+	fprintf(stderr, "\t--rate <Hz>[,fast|good|best]: resample the output of -d to <Hz> while decoding, e.g. --rate 48000,best [default quality: good]\n");
+	fprintf(stderr, "\t--analyze: measure sample peak, clipped samples, RMS and EBU R128 integrated loudness of each stream while converting it,\n");
+	fprintf(stderr, "\t           logged and added to --stats\n");
+	fprintf(stderr, "\t--watch <dir>: also convert every file written into <dir> from now on, as soon as it's complete, until <dir> is deleted\n");
+	fprintf(stderr, "\tInput filename - means stdin, output goes to stdout unless -o is specified\n");
+	fprintf(stderr, "\tInput archive.mix converts the AUD files in a Westwood MIX archive, archive.mix#name1,name2 only the listed ones,\n");
+	fprintf(stderr, "\t                 given by filename or 8-digit hex ID, outputs are named archive.mix#<name or ID>.wav\n");
+	exit(0);
+}
+
+// Output filename: input filename with .aud extension (if any) replaced by .wav, or .algoX.wav if -4
+void make_ofilename(char *ofilename, size_t size, const char *ifilename, int algo) {
+	char *str;
+	
+	strncpy(ofilename, ifilename, size - 11); // leave space for ".algoX.wav\0"
+	ofilename[size - 11] = 0;
+	if ((str = strrchr(ofilename, '.')))      // if input filename has extension
+		if (stricmp(str, ".aud") == 0)        // and it is .aud
+			str[0] = 0;                       // strip it
+	str = &ofilename[strlen(ofilename)];      // find end of filename
+	if (algo >= 0)                            // if -4
+		str += sprintf(str, ".algo%u", algo); // append .algoX
+	strcpy(str, ".wav");                      // append .wav
+}
+
+// Output filename of --outputs: .pcm.wav, or .b<blocksize>.wav with the block size as given (.b512.wav, .b-1.wav)
+void make_output_ofilename(char *ofilename, size_t size, const char *ifilename, int blocksize) {
+	make_ofilename(ofilename, size - 8, ifilename, -1); // leave space for ".b32771.wav\0"
+	sprintf(&ofilename[strlen(ofilename) - 4], blocksize ? ".b%d.wav" : ".pcm.wav", blocksize);
+}
+
+// Output filename of -e: input filename with .wav extension (if any) replaced by .aud
+void make_aud_ofilename(char *ofilename, size_t size, const char *ifilename) {
+	char *str;
+	
+	strncpy(ofilename, ifilename, size - 5); // leave space for ".aud\0"
+	ofilename[size - 5] = 0;
+	if ((str = strrchr(ofilename, '.')) && (stricmp(str, ".wav") == 0))
+		str[0] = 0;
+	strcat(ofilename, ".aud");
+}
+
+// Prints block and sample counts, after the first read-through or after streaming
+void print_aud_stream_info(WORKER *w, const AUD_HEADER *aud_header, const char *stage) {
+	unsigned long long i;
+	
+	wlog(w, "%s %llu blocks, first block %u bytes, last block %u bytes\n", stage, (unsigned long long)aud_header->blocks, aud_header->first_block_size, aud_header->last_block_size);
+	i = aud_header->adpcm_bytes + AUD_BLOCK_HEADER_SIZE * aud_header->blocks;
+	wlog(w, "Total ADPCM bytes with block headers: %llu, diff with header: %lld\n", i, (long long)(i - aud_header->encsize));
+	if (aud_header->decsize)
+		wlog(w, "Decoded PCM size: %llu bytes, diff with header: %lld\n", (unsigned long long)aud_header->num_samples * 2, (long long)(aud_header->num_samples * 2 - aud_header->decsize));
+	i = aud_header->samplerate ? aud_header->num_samples * 1000 / aud_header->samplerate : 0; // duration in milliseconds
+	wlog(w, "Duration: %llu:%02u.%03u (%llu samples)\n", i / 60000, (unsigned)(i / 1000) % 60, (unsigned)(i % 1000), (unsigned long long)aud_header->num_samples);
+}
+
+// Rewrites WAV header once the real stream length is known, if the output can seek back
+// known = 0 if the header got unknown sizes instead, see patch_pcm_header()
+void patch_wav_header(WORKER *w, FILE *wav, const unsigned char *header, size_t size, int known) {
+	if ((fseek(wav, 0, SEEK_SET) == 0) && (fwrite(header, 1, size, wav) == size)) {
+		if (known)
+			wlog(w, "WAV header updated with actual stream length\n");
+		else
+			wlog(w, "Warning: stream is longer than its RIFF header allows, WAV header sizes set to unknown\n");
+	} else
+		wlog(w, "Warning: output is not seekable, WAV header sizes are estimated\n");
+}
+
+// Header sizes of a finished single-pass stream. They are patched over the header written at its start, so the
+// layout can't change: an RF64 header stays RF64, a RIFF one of a stream that outgrew 4 GB gets unknown sizes
+void patch_pcm_header(WORKER *w, FILE *wav, int rf64, uint32_t samplerate, uint64_t datalen) {
+	WAV_HEADER_PCM h;
+	unsigned char header[WAV_HEADER_MAX_SIZE];
+	int known;
+	
+	WAV_header_pcm(&h, samplerate, datalen);
+	if (!(known = !h.rf64 || rf64))
+		WAV_header_pcm(&h, samplerate, WAV_SIZE_UNKNOWN);
+	h.rf64 = rf64;
+	patch_wav_header(w, wav, header, WAV_write_header_pcm(&h, header), known);
+}
+
+void patch_adpcm_header(WORKER *w, FILE *wav, int rf64, uint32_t samplerate, uint32_t wav_blocksize, uint64_t num_samples, uint64_t datalen) {
+	WAV_HEADER_ADPCM h;
+	unsigned char header[WAV_HEADER_MAX_SIZE];
+	int known;
+	
+	WAV_header_adpcm(&h, samplerate, wav_blocksize, num_samples, datalen);
+	if (!(known = !h.rf64 || rf64))
+		WAV_header_adpcm(&h, samplerate, wav_blocksize, WAV_SIZE_UNKNOWN, WAV_SIZE_UNKNOWN);
+	h.rf64 = rf64;
+	patch_wav_header(w, wav, header, WAV_write_header_adpcm(&h, header), known);
+}
+
+FILE *open_wav(const char *ofilename) {
+	return strcmp(ofilename, "-") ? fopen(ofilename, "wb") : stdout;
+}
+
+void close_wav(FILE *wav) {
+	if (wav == stdout)
+		fflush(wav);
+	else
+		fclose(wav);
+}
+
+// Releases the decoder (and its mapping of the input) before closing the input
+void close_aud(WORKER *w) {
+	AUD_close(&w->ctx);
+	if (w->aud && (w->aud != stdin))
+		fclose(w->aud);
+	w->aud = NULL;
+}
+
+// Opens the input of the current file: a MIX entry in place, stdin, or a file
+// Returns the result of AUD_open_file() / AUD_open_memory(), AUD_ERROR_READ if the file can't be opened
+int open_input(WORKER *w, const char *ifilename, int stream) {
+	if (w->entry.data) {
+		w->aud = NULL;
+		return AUD_open_memory(&w->ctx, w->entry.data, w->entry.size);
+	}
+	if (!(w->aud = strcmp(ifilename, "-") ? fopen(ifilename, "rb") : stdin)) {
+		werror(w, "Error opening %s: %s\n", ifilename, strerror(errno));
+		return AUD_ERROR_READ;
+	}
+	return AUD_open_file(&w->ctx, w->aud, stream);
+}
+
+// Opens an AUD file, prints its info and counts its blocks, returns 0 on success
+// ofilename: output filename specified by -o, set to stdout if input is stdin and it's NULL
+int open_aud(WORKER *w, const OPTIONS *opt, const char *ifilename, const char **ofilename) {
+	
+	AUD_CONTEXT *ctx = &w->ctx;
+	AUD_HEADER *aud_header = &ctx->header;
+	double start = now();
+	int res;
+	
+	if ((strcmp(ifilename, "-") == 0) && !*ofilename)
+		*ofilename = "-"; // stdin -> stdout
+	res = open_input(w, ifilename, opt->stream);
+	w->stats.open = now() - start;
+	if (res == AUD_ERROR_READ) // the file couldn't be opened
+		return 1;
+	wlog(w, "\n%s: successfully opened\n", ifilename);
+	if (res == AUD_ERROR_FORMAT) {
+		werror(w, "%s: %s\n", ifilename, ctx->message);
+		close_aud(w);
+		return 1;
+	}
+	w->stats.opened = 1;
+	
+	wlog(w, "%s AUD format detected\n", (aud_header->format == AUD_FORMAT_NEW) ? "New" : "Old");
+	if (!ctx->stream)
+		wlog(w, "File size: %llu\n", (unsigned long long)aud_header->filesize);
+	wlog(w, "Sample rate: %u\n", aud_header->samplerate);
+	wlog(w, "Encoded stream size: %u bytes\n", aud_header->encsize);
+	if (aud_header->decsize)
+		wlog(w, "Decoded data size: %u bytes\n", aud_header->decsize);
+	wlog(w, "Flags: %s, %u-bit\n", (aud_header->flags & 1) ? "stereo" : "mono", (aud_header->flags & 2) ? 16 : 8);
+	wlog(w, "Codec: %u (%s)\n", aud_header->codec, (aud_header->codec == 1) ? "Westwood ADPCM" : (aud_header->codec == 99) ? "IMA ADPCM" : "Unknown");
+	
+	if (res != AUD_OK) {
+		werror(w, "%s\n", ctx->message);
+		close_aud(w);
+		return 1;
+	}
+	
+	if (ctx->stream) {
+		
+		// Single pass: take sample count from the header if it has one, fix up WAV header at the end
+		
+		wlog(w, "Streaming in a single pass, %s\n", aud_header->num_samples ? "sample count taken from header" : "sample count unknown until the end of stream");
+		
+	} else {
+		
+		// Analyze AUD stream (first read-through), want to count blocks and samples in advance
+		
+		start = now();
+		res = AUD_probe(ctx);
+		w->stats.scan = now() - start;
+		if (res != AUD_OK)
+			werror(w, "%s: %s\n", ifilename, ctx->message);
+		if (res < 0) {
+			close_aud(w);
+			return 1;
+		}
+		print_aud_stream_info(w, aud_header, "Scanned");
+	}
+	
+	return 0;
+}
+
+// Formats sample position as m:ss.mmm
+char *format_time(char *buf, size_t size, uint64_t sample, uint32_t samplerate) {
+	unsigned long long ms = samplerate ? sample * 1000 / samplerate : 0;
+	
+	snprintf(buf, size, "%llu:%02u.%03u", ms / 60000, (unsigned)(ms / 1000) % 60, (unsigned)(ms % 1000));
+	return buf;
+}
+
+// Parses one bound of --range: sample number, or seconds if followed by s
+// Returns pointer to the rest of str, NULL if there is no number
+const char *parse_range_bound(const char *str, uint32_t samplerate, uint64_t *bound) {
+	char *end;
+	double v = strtod(str, &end);
+	
+	if ((end == str) || (v < 0)) return NULL;
+	if (*end == 's') {
+		v *= samplerate;
+		end++;
+	}
+	*bound = (v < (double)UINT64_MAX) ? (uint64_t)v : UINT64_MAX;
+	return end;
+}
+
+// Parses --range start:end, missing start means the beginning, missing end the end of stream
+// Returns 0 on success
+int parse_range(const char *str, uint32_t samplerate, uint64_t *start, uint64_t *end) {
+	*start = 0;
+	*end = UINT64_MAX;
+	if ((*str != ':') && !(str = parse_range_bound(str, samplerate, start)))
+		return -1;
+	if (*str++ != ':')
+		return -1;
+	if (*str && (!(str = parse_range_bound(str, samplerate, end)) || *str))
+		return -1;
+	return 0;
+}
+
+// Parses --outputs pcm,512,-1... into opt, returns 0 if all of it is valid
+int parse_outputs(const char *str, OPTIONS *opt) {
+	int output[OUTPUTS_MAX], count = 0, blocksize, i;
+	char *end;
+	
+	while (1) {
+		if (strnicmp(str, "pcm", 3) == 0) {
+			blocksize = 0;
+			end = (char *)str + 3;
+		} else {
+			blocksize = strtol(str, &end, 10);
+			if ((end == str) || (((blocksize < 4) || (blocksize > 32771)) && (blocksize != -1) && (blocksize != -2)))
+				return 1;
+		}
+		if ((*end && (*end != ',')) || (count == OUTPUTS_MAX))
+			return 1;
+		for (i = 0; i < count; i++)
+			if (output[i] == blocksize) return 1; // the same file twice
+		output[count++] = blocksize;
+		if (!*end) break;
+		str = end + 1;
+	}
+	memcpy(opt->output, output, count * sizeof(int));
+	opt->outputs = count;
+	return 0;
+}
+
+// --rate <Hz>[,fast|good|best], returns 0 on success
+int parse_rate(const char *str, OPTIONS *opt) {
+	unsigned long rate = strtoul(str, (char **)&str, 10);
+	int quality = AUD_RESAMPLE_GOOD;
+	
+	if ((rate < 1000) || (rate > 384000))
+		return 1;
+	if (*str == ',')
+		for (quality = AUD_RESAMPLE_BEST; (quality >= 0) && stricmp(str + 1, resample_quality_names[quality]); quality--);
+	else if (*str)
+		return 1;
+	if (quality < 0)
+		return 1;
+	opt->rate = rate;
+	opt->rate_quality = quality;
+	return 0;
+}
+
+// Samples to be converted: the whole stream, or --range
+uint64_t output_samples(const AUD_CONTEXT *ctx) {
+	return ctx->range_end ? ctx->range_end - ctx->range_start : ctx->header.num_samples;
+}
+
+// Restricts conversion to --range for the given algorithm, the index of #0 and #1 is kept in <input>.idx,
+// the ones of approximations are only built in memory. Returns 0 on success
+int set_range(WORKER *w, const OPTIONS *opt, const char *ifilename, int algorithm) {
+	AUD_CONTEXT *ctx = &w->ctx;
+	AUD_INDEX *index = &w->index;
+	char filename[FILENAME_MAX];
+	uint64_t start, end;
+	char time[32];
+	FILE *f;
+	double index_start = now();
+	int res = AUD_ERROR_STATE;
+	
+	if (ctx->stream) {
+		werror(w, "%s: --range needs a seekable input\n", ifilename);
+		return 1;
+	}
+	
+	if (!index->checkpoints || (index->algorithm != ((algorithm == 1) ? 0 : algorithm))) {
+		AUD_index_free(index);
+		snprintf(filename, sizeof(filename), "%s.idx", ifilename);
+		if ((algorithm <= 1) && (f = fopen(filename, "rb"))) {
+			res = AUD_index_load(ctx, index, f);
+			fclose(f);
+			if (res != AUD_OK) {
+				wlog(w, "%s: %s, rebuilding it\n", filename, ctx->message);
+				AUD_index_free(index);
+			}
+		}
+		if (res != AUD_OK) {
+			if (AUD_index_build(ctx, index, algorithm) != AUD_OK) {
+				werror(w, "%s: %s\n", ifilename, ctx->message);
+				return 1;
+			}
+			wlog(w, "Seek index built, %llu checkpoints\n", (unsigned long long)index->count);
+			if ((algorithm <= 1) && (f = fopen(filename, "wb"))) {
+				res = AUD_index_save(ctx, index, f);
+				if (fclose(f) || (res != AUD_OK)) {
+					wlog(w, "Warning: can't write %s\n", filename);
+					remove(filename);
+				} else
+					wlog(w, "Seek index saved to %s\n", filename);
+			}
+		}
+		w->stats.scan += now() - index_start;
+	}
+	
+	parse_range(opt->range, ctx->header.samplerate, &start, &end); // syntax checked by main()
+	if (AUD_set_range(ctx, index, start, end) != AUD_OK) {
+		werror(w, "%s: %s\n", ifilename, ctx->message);
+		return 1;
+	}
+	wlog(w, "Range: %llu samples from %s (sample %llu)\n", (unsigned long long)output_samples(ctx),
+	     format_time(time, sizeof(time), ctx->range_start, ctx->header.samplerate), (unsigned long long)ctx->range_start);
+	return 0;
+}
+
+// Creates output file and starts writing it through the worker's writer, returns 0 on success
+int create_wav(WORKER *w, OUTPUT *out, const char *ofilename) {
+	FILE *wav = open_wav(ofilename);
+	
+	if (!wav) {
+		werror(w, "Error creating %s: %s\n", ofilename, strerror(errno));
+		return 1;
+	}
+	output_init(out, w->writer, wav);
+	snprintf(out->name, sizeof(out->name), "%s", ofilename);
+	return 0;
+}
+
+// Writes out everything still buffered and closes output file, returns 0 if all of it was written
+int finish_wav(WORKER *w, OUTPUT *out) {
+	int error = output_flush(out);
+	
+	w->stats.bytes_out += out->bytes;
+	w->stats.write += out->write_time;
+	w->stats.wait += out->wait_time;
+	if (error)
+		werror(w, "Error writing %s: %s\n", out->name, strerror(error));
+	close_wav(out->file);
+	return error != 0;
+}
+
+// Writes PCM WAV header, sizes are patched by finish_pcm_wav() at the end of a single-pass stream
+// Returns 0 on success
+int create_pcm_wav(WORKER *w, OUTPUT *out, const char *ofilename, WAV_HEADER_PCM *wav_header_pcm) {
+	AUD_HEADER *aud_header = &w->ctx.header;
+	unsigned char header[WAV_HEADER_MAX_SIZE];
+	
+	if (create_wav(w, out, ofilename))
+		return 1;
+	
+	wlog(w, "Decoding AUD to %s\n", ofilename);
+	
+	if (w->resampler.filter) {
+		wlog(w, "Resampling %u Hz to %u Hz\n", w->resampler.in_rate, w->resampler.out_rate);
+		WAV_header_pcm(wav_header_pcm, w->resampler.out_rate, output_samples(&w->ctx) ? AUD_resampled_samples(&w->resampler, output_samples(&w->ctx)) * 2 : WAV_SIZE_UNKNOWN);
+	} else
+		WAV_header_pcm(wav_header_pcm, aud_header->samplerate, output_samples(&w->ctx) ? output_samples(&w->ctx) * 2 : WAV_SIZE_UNKNOWN);
+	output_write(out, header, WAV_write_header_pcm(wav_header_pcm, header)); // errors are reported by finish_pcm_wav()
+	return 0;
+}
+
+// Returns 0 if the file was converted and written successfully
+int finish_pcm_wav(WORKER *w, OUTPUT *out, WAV_HEADER_PCM *wav_header_pcm, const char *ifilename, int failed) {
+	AUD_CONTEXT *ctx = &w->ctx;
+	AUD_HEADER *aud_header = &ctx->header;
+	uint64_t datalen;
+	
+	if (ctx->error)
+		werror(w, "%s: %s\n", ifilename, ctx->message);
+	
+	// Header is patched in place, after all the data has been written
+	if ((output_flush(out) == 0) && ctx->stream && !failed) {
+		print_aud_stream_info(w, aud_header, "Streamed");
+		datalen = (w->resampler.filter ? AUD_resampled_samples(&w->resampler, aud_header->num_samples) : aud_header->num_samples) * 2;
+		if (datalen != wav_header_pcm->datalen)
+			patch_pcm_header(w, out->file, wav_header_pcm->rf64, wav_header_pcm->nSamplesPerSec, datalen);
+	}
+	
+	return finish_wav(w, out) || failed;
+}
+
+// --rate: decodes into the worker's buffer, or a window of PARALLEL_WINDOW at a time if the file is split among threads,
+// and resamples straight into the output buffers
+void decode_resampled(WORKER *w, const OPTIONS *opt, OUTPUT *out) {
+	AUD_CONTEXT *ctx = &w->ctx;
+	AUD_RESAMPLER *rs = &w->resampler;
+	uint32_t min = (rs->up / rs->down + 3) * 2; // room for the output of one input sample
+	uint32_t space, n;
+	long size = 0, done = 0;
+	short *pcm = NULL, *in, *dst;
+	
+	if ((opt->threads > 1) && !ctx->stream && !ctx->range_end)
+		pcm = malloc(PARALLEL_WINDOW);
+	while ((dst = (short *)output_reserve(out, min, &space))) {
+		n = AUD_resample_input(rs, space / 2);
+		if (pcm) {
+			if (done == size) {
+				if ((size = AUD_decode_parallel(ctx, pcm, PARALLEL_WINDOW / 2, opt->threads)) <= 0)
+					break; // errors are reported by finish_pcm_wav()
+				done = 0;
+			}
+			if (n > size - done) n = size - done;
+			in = &pcm[done];
+		} else {
+			if (n > sizeof(w->out_buffer) / 2) n = sizeof(w->out_buffer) / 2;
+			in = (short *)w->out_buffer;
+			if ((size = AUD_decode(ctx, in, n)) < 0) break;
+			n = size;
+		}
+		if (!n) break;
+		output_commit(out, AUD_resample(rs, in, n, dst) * 2);
+		done += n;
+	}
+	free(pcm);
+	
+	// The last output samples, after the input has ended
+	if ((dst = (short *)output_reserve(out, AUD_resample_tail(rs) * 2, &space)))
+		output_commit(out, AUD_resample_end(rs, dst) * 2);
+}
+
+// --analyze: measures every sample the stream is decoded to from now on, called after it's rewound
+void start_analysis(WORKER *w, const OPTIONS *opt) {
+	if (!opt->analyze) return;
+	AUD_analysis_init(&w->analysis, w->ctx.header.samplerate);
+	AUD_analyze_stream(&w->ctx, &w->analysis);
+}
+
+// Level in dB for the log: -inf for silence, n/a if it wasn't measured
+char *format_db(char *buf, size_t size, double db) {
+	if (isnan(db))
+		snprintf(buf, size, "n/a");
+	else if (isinf(db))
+		snprintf(buf, size, "-inf");
+	else
+		snprintf(buf, size, "%.1f", db);
+	return buf;
+}
+
+// Logs the levels of a converted stream, which --stats reports too
+void finish_analysis(WORKER *w, int failed) {
+	AUD_ANALYSIS *a = &w->analysis;
+	char peak[16], rms[16], loudness[16];
+	
+	if (!w->ctx.analysis) return;
+	AUD_analyze_stream(&w->ctx, NULL);
+	if (!failed) {
+		AUD_analysis_end(a);
+		wlog(w, "Levels: peak %s dBFS, %llu clipped samples, RMS %s dBFS, loudness %s LUFS\n", format_db(peak, sizeof(peak), a->peak_db),
+		     (unsigned long long)a->clipped, format_db(rms, sizeof(rms), a->rms_db), format_db(loudness, sizeof(loudness), a->loudness));
+		w->stats.analyzed = 1;
+	}
+	AUD_analysis_free(a);
+}
+
+// Starts measuring a stream, keeps the buffer of the previous one
+void reset_divergence(DIVERGENCE *d) {
+	d->first = UINT64_MAX;
+	d->max_error = 0;
+	d->max_sample = 0;
+	d->sum_sq = 0;
+	d->seconds = 0;
+}
+
+// Compares n samples of pcm with ref (decoded by algorithm #0), starting at sample pos of the stream
+void measure_divergence(DIVERGENCE *d, const short *ref, const short *pcm, uint32_t n, uint64_t pos, uint32_t samplerate) {
+	uint32_t i, j, end, second, size;
+	uint64_t next;
+	int32_t error, max;
+	int64_t sq;
+	double *second_sq;
+	
+	if (!samplerate) samplerate = UINT32_MAX; // no time, only one "second"
+	for (i = 0; i < n; i = end) {
+		second = (pos + i) / samplerate;
+		next = (uint64_t)(second + 1) * samplerate - pos;
+		end = (next < n) ? next : n;
+		
+		// Branchless sums first, positions are only searched for when they change
+		for (sq = 0, max = 0, j = i; j < end; j++) {
+			error = pcm[j] - ref[j];
+			sq += (int64_t)error * error;
+			error ^= error >> 31; // abs(error) - 1 for negative errors, good enough to tell if there is a larger one
+			max = (error > max) ? error : max;
+		}
+		if (sq && ((d->first == UINT64_MAX) || ((uint32_t)max + 1 > d->max_error)))
+			for (j = i; j < end; j++) {
+				if (!(error = pcm[j] - ref[j])) continue;
+				if (d->first == UINT64_MAX)
+					d->first = pos + j;
+				if ((uint32_t)abs(error) > d->max_error) {
+					d->max_error = abs(error);
+					d->max_sample = pos + j;
+				}
+			}
+		d->sum_sq += sq;
+		i = end;
+		
+		// Drift is kept per second, a failed allocation only loses the drift
+		while (second >= d->seconds) {
+			if (d->seconds == d->seconds_size) {
+				size = d->seconds_size ? d->seconds_size * 2 : 1024;
+				if (!(second_sq = realloc(d->second_sq, size * sizeof(double)))) break;
+				d->second_sq = second_sq;
+				d->seconds_size = size;
+			}
+			d->second_sq[d->seconds++] = 0;
+		}
+		if (second < d->seconds)
+			d->second_sq[second] += sq;
+	}
+}
+
+void print_divergence(WORKER *w, const DIVERGENCE *d, int algorithm, uint64_t samples, uint32_t samplerate) {
+	char time1[32], time2[32], line[256];
+	uint32_t g, groups, s, s0, s1;
+	uint64_t n;
+	size_t len;
+	double sq;
+	
+	if (d->first == UINT64_MAX) {
+		wlog(w, "Algorithm #%d: identical to #0\n", algorithm);
+		return;
+	}
+	wlog(w, "Algorithm #%d: first divergent sample %llu (%s), max error %u at sample %llu (%s), RMS error %.3f\n", algorithm,
+	     (unsigned long long)d->first, format_time(time1, sizeof(time1), d->first, samplerate),
+	     d->max_error, (unsigned long long)d->max_sample, format_time(time2, sizeof(time2), d->max_sample, samplerate),
+	     sqrt(d->sum_sq / samples));
+	
+	// RMS error over each tenth of the stream (or each second of a short one) shows whether it keeps growing
+	
+	if (!samplerate || !d->seconds) return;
+	groups = (d->seconds < 10) ? d->seconds : 10;
+	len = snprintf(line, sizeof(line), "    drift, RMS error by %s:", (groups == 10) ? "tenth" : "second");
+	for (g = 0; g < groups; g++) {
+		s0 = (uint64_t)d->seconds * g / groups;
+		s1 = (uint64_t)d->seconds * (g + 1) / groups;
+		for (sq = 0, s = s0; s < s1; s++)
+			sq += d->second_sq[s];
+		n = ((uint64_t)s1 * samplerate < samples) ? (uint64_t)s1 * samplerate : samples;
+		n -= (uint64_t)s0 * samplerate;
+		if (len < sizeof(line))
+			len += snprintf(&line[len], sizeof(line) - len, " %.3f", n ? sqrt(sq / n) : 0);
+	}
+	wlog(w, "%s\n", line);
+}
+
+// Decodes with all algorithms in a single pass: writes 4 PCM WAV files if -4, measures divergence from #0 if --report
+// Returns 0 on success
+int decode_all(WORKER *w, const OPTIONS *opt, const char *ifilename) {
+	AUD_CONTEXT *ctx = &w->ctx;
+	AUD_HEADER *aud_header = &ctx->header;
+	OUTPUT out[ADPCM_ALGORITHMS];
+	WAV_HEADER_PCM wav_header_pcm[ADPCM_ALGORITHMS];
+	short *pcm[ADPCM_ALGORITHMS];
+	uint32_t max_samples = sizeof(w->out_buffer) / 2 / ADPCM_ALGORITHMS;
+	uint64_t done = 0;
+	uint32_t space;
+	long size;
+	int a, created = 0, failed = 0, res = 0;
+	
+	if (AUD_rewind(ctx, 0) != AUD_OK) {
+		werror(w, "%s: %s\n", ifilename, ctx->message);
+		return 1;
+	}
+	
+	for (a = 0; a < ADPCM_ALGORITHMS; a++) {
+		pcm[a] = (short *)w->out_buffer + max_samples * a;
+		reset_divergence(&w->divergence[a]);
+		if (opt->algo_last && !failed) {
+			make_ofilename(w->ofilename, sizeof(w->ofilename), ifilename, a);
+			if (create_pcm_wav(w, &out[a], w->ofilename, &wav_header_pcm[a]))
+				failed = 1;
+			else
+				created++;
+		}
+	}
+	if (!opt->algo_last)
+		wlog(w, "Comparing algorithms\n");
+	
+	while (!failed) {
+		// Files are decoded straight into their output buffers, which fill up at the same pace
+		if (created) {
+			max_samples = WRITER_BUFFER_SIZE / 2;
+			for (a = 0; a < created; a++) {
+				if (!(pcm[a] = (short *)output_reserve(&out[a], 2, &space))) break;
+				if (space / 2 < max_samples) max_samples = space / 2;
+			}
+			if (a < created) break; // write error, reported by finish_pcm_wav()
+		}
+		if ((size = AUD_decode_all(ctx, pcm, max_samples)) <= 0) break;
+		for (a = 0; a < ADPCM_ALGORITHMS; a++) {
+			if (opt->report && a)
+				measure_divergence(&w->divergence[a], pcm[0], pcm[a], size, done, aud_header->samplerate);
+			if (a < created)
+				output_commit(&out[a], size * 2);
+		}
+		done += size;
+	}
+	
+	if (opt->algo_last) {
+		for (a = 0; a < created; a++)
+			res |= finish_pcm_wav(w, &out[a], &wav_header_pcm[a], ifilename, failed);
+		failed |= res;
+	} else {
+		if (ctx->error)
+			werror(w, "%s: %s\n", ifilename, ctx->message);
+		if (ctx->stream)
+			print_aud_stream_info(w, aud_header, "Streamed");
+	}
+	
+	if (opt->report && !failed) {
+		for (a = 1; a < ADPCM_ALGORITHMS; a++)
+			print_divergence(w, &w->divergence[a], a, done, aud_header->samplerate);
+		w->reported = 1;
+	}
+	return failed;
+}
+
+// Converts one opened AUD file into every --outputs file from a single decode of the stream, returns 0 on success
+int convert_outputs(WORKER *w, const OPTIONS *opt, const char *ifilename) {
+	AUD_CONTEXT *ctx = &w->ctx;
+	AUD_HEADER *aud_header = &ctx->header;
+	AUD_OUTPUT *outputs;
+	OUTPUT out[OUTPUTS_MAX];
+	WAV_HEADER_PCM wav_header_pcm;
+	WAV_HEADER_ADPCM wav_header_adpcm;
+	unsigned char header[WAV_HEADER_MAX_SIZE];
+	char rf64[OUTPUTS_MAX]; // layout of each header, kept when it's patched
+	uint64_t samples, datalen;
+	uint32_t max_samples, space;
+	long size = 0;
+	int i, res, created = 0, failed = 0;
+	
+	if (opt->range && set_range(w, opt, ifilename, 0))
+		return 1;
+	if (!(outputs = malloc(opt->outputs * sizeof(AUD_OUTPUT)))) {
+		werror(w, "Error: not enough memory for the outputs of %s\n", ifilename);
+		return 1;
+	}
+	for (i = 0; i < opt->outputs; i++)
+		outputs[i].blocksize = opt->output[i];
+	if ((res = AUD_multi_begin(ctx, outputs, opt->outputs)) != AUD_OK)
+		werror(w, "%s\n", ctx->message);
+	failed = (res < 0);
+	samples = output_samples(ctx);
+	if (!failed)
+		start_analysis(w, opt);
+	
+	for (i = 0; !failed && (i < opt->outputs); i++) {
+		make_output_ofilename(w->ofilename, sizeof(w->ofilename), ifilename, outputs[i].blocksize);
+		if (create_wav(w, &out[i], w->ofilename)) {
+			failed = 1;
+			break;
+		}
+		created++;
+		if (!outputs[i].blocksize) {
+			wlog(w, "Decoding AUD to %s\n", w->ofilename);
+			WAV_header_pcm(&wav_header_pcm, aud_header->samplerate, samples ? samples * 2 : WAV_SIZE_UNKNOWN);
+			output_write(&out[i], header, WAV_write_header_pcm(&wav_header_pcm, header));
+			rf64[i] = wav_header_pcm.rf64;
+		} else {
+			wlog(w, "Remuxing AUD to %s, WAV block size: %u (4 + %u) bytes\n", w->ofilename, outputs[i].wav_blocksize + 4, outputs[i].wav_blocksize);
+			if (samples)
+				WAV_header_adpcm(&wav_header_adpcm, aud_header->samplerate, outputs[i].wav_blocksize, samples, outputs[i].wav_datalen);
+			else
+				WAV_header_adpcm(&wav_header_adpcm, aud_header->samplerate, outputs[i].wav_blocksize, WAV_SIZE_UNKNOWN, WAV_SIZE_UNKNOWN);
+			output_write(&out[i], header, WAV_write_header_adpcm(&wav_header_adpcm, header));
+			rf64[i] = wav_header_adpcm.rf64;
+		}
+	}
+	
+	// Every output buffer is filled in the same pass, with as many samples as the fullest one has room for
+	
+	while (!failed) {
+		max_samples = UINT32_MAX;
+		for (i = 0; i < opt->outputs; i++) {
+			if (!(outputs[i].buf = output_reserve(&out[i], outputs[i].blocksize ? 3 * (WAV_BLOCK_HEADER_SIZE + outputs[i].wav_blocksize) : 2, &space)))
+				break;
+			outputs[i].size = space;
+			if (AUD_multi_samples(&outputs[i], space) < max_samples)
+				max_samples = AUD_multi_samples(&outputs[i], space);
+		}
+		if (i < opt->outputs) break; // write error, reported by finish_wav()
+		if ((size = AUD_decode_multi(ctx, outputs, opt->outputs, max_samples)) < 0) break;
+		for (i = 0; i < opt->outputs; i++)
+			output_commit(&out[i], outputs[i].len);
+		if (!size) break;
+	}
+	if (ctx->error)
+		werror(w, "%s: %s\n", ifilename, ctx->message);
+	if (ctx->error == AUD_ERROR_STATE)
+		failed = 1;
+	
+	// Headers are patched in place, after all the data has been written
+	
+	if (ctx->stream && !failed) {
+		print_aud_stream_info(w, aud_header, "Streamed");
+		for (i = 0; i < created; i++) {
+			if (output_flush(&out[i]) != 0) continue;
+			if (!outputs[i].blocksize) {
+				if (aud_header->num_samples == samples) continue;
+				patch_pcm_header(w, out[i].file, rf64[i], aud_header->samplerate, aud_header->num_samples * 2);
+			} else {
+				datalen = outputs[i].wav_blocks_written * (outputs[i].wav_blocksize + 4);
+				if ((aud_header->num_samples == samples) && (datalen == outputs[i].wav_datalen)) continue;
+				patch_adpcm_header(w, out[i].file, rf64[i], aud_header->samplerate, outputs[i].wav_blocksize, aud_header->num_samples, datalen);
+			}
+		}
+	}
+	
+	for (i = 0; i < created; i++)
+		failed = finish_wav(w, &out[i]) || failed;
+	finish_analysis(w, failed);
+	free(outputs);
+	return failed;
+}
+
+// Converts one AUD file, returns 0 on success
+// ofilename: output filename specified by -o, or NULL to derive it from the input filename
+int convert_file(WORKER *w, const OPTIONS *opt, const char *ifilename, const char *ofilename) {
+	
+	AUD_CONTEXT *ctx = &w->ctx;
+	AUD_HEADER *aud_header = &ctx->header;
+	OUTPUT out;
+	int64_t size;
+	uint32_t space;
+	unsigned char *out_buffer;
+	short *pcm;
+	unsigned char *wav_data;
+	unsigned char header[WAV_HEADER_MAX_SIZE];
+	int use_algorithm;
+	int res;
+	int failed = 0;
+	
+	WAV_HEADER_PCM wav_header_pcm;
+	WAV_HEADER_ADPCM wav_header_adpcm;
+	
+	if (open_aud(w, opt, ifilename, &ofilename))
+		return 1;
+	
+	if (opt->outputs) {
+		
+		// -------------------------------- Mode 3: Several outputs from one decode --------------------------------
+		
+		failed = convert_outputs(w, opt, ifilename);
+		
+	} else if (opt->decode) {
+		
+		// -------------------------------- Mode 1: Decode AUD to PCM WAV --------------------------------
+		
+		// All algorithms side by side, except for ranges, those have to start from a checkpoint of each algorithm
+		if (opt->report || (opt->algo_last && !opt->range))
+			failed = decode_all(w, opt, ifilename);
+		else for (use_algorithm = 0; use_algorithm <= opt->algo_last; use_algorithm++) { // normally algo_last = 0 (if not -4)
+			
+			// Choose output filename if -o is not specified, or if -4
+			
+			if (!ofilename || opt->algo_last) {
+				make_ofilename(w->ofilename, sizeof(w->ofilename), ifilename, opt->algo_last ? use_algorithm : -1);
+				ofilename = w->ofilename;
+			}
+			
+			if (opt->range && set_range(w, opt, ifilename, use_algorithm)) {
+				failed = 1;
+				break;
+			}
+			if (AUD_rewind(ctx, use_algorithm) != AUD_OK) {
+				werror(w, "%s: %s\n", ifilename, ctx->message);
+				failed = 1;
+				break;
+			}
+			if (opt->rate && (AUD_resample_init(&w->resampler, aud_header->samplerate, opt->rate, opt->rate_quality) != AUD_OK)) {
+				werror(w, "%s: %s\n", ifilename, w->resampler.message);
+				failed = 1;
+				break;
+			}
+			start_analysis(w, opt); // of the stream's own samples, before resampling
+			
+			if (create_pcm_wav(w, &out, ofilename, &wav_header_pcm)) {
+				failed = 1;
+			} else {
+				
+				// Decode all blocks, a window at a time if the file is split among threads,
+				// otherwise straight into the output buffers, which are written while the next ones are decoded
+				if (w->resampler.filter) {
+					decode_resampled(w, opt, &out);
+				} else if ((opt->threads > 1) && !ctx->stream && !ctx->range_end && (pcm = malloc(PARALLEL_WINDOW))) {
+					while (((size = AUD_decode_parallel(ctx, pcm, PARALLEL_WINDOW / 2, opt->threads)) > 0) && !output_write(&out, pcm, size * 2));
+					free(pcm);
+				} else while ((pcm = (short *)output_reserve(&out, 2, &space)) && ((size = AUD_decode(ctx, pcm, space / 2)) > 0))
+					output_commit(&out, size * 2);
+				failed = finish_pcm_wav(w, &out, &wav_header_pcm, ifilename, failed);
+				finish_analysis(w, failed);
+			} // if fopen(wav) succeeded
+		} // for algorithms
+		
+	} else { // if remuxing (not decode)
+		
+		// -------------------------------- Mode 2: Remux AUD to ADPCM WAV --------------------------------
+		
+		// Choose output filename if -o is not specified
+		
+		if (!ofilename) {
+			make_ofilename(w->ofilename, sizeof(w->ofilename), ifilename, -1);
+			ofilename = w->ofilename;
+		}
+		
+		if (create_wav(w, &out, ofilename)) {
+			failed = 1;
+		} else {
+			
+			wlog(w, "Remuxing AUD to %s\n", ofilename);
+			
+			// Find optimal blocksize if needed
+			
+			if (opt->range && set_range(w, opt, ifilename, 0)) {
+				res = AUD_ERROR_STATE;
+			} else {
+				res = AUD_remux_begin(ctx, opt->blocksize);
+				if ((res >= 0) && opt->verify)
+					AUD_remux_verify(ctx, 1);
+				if (res >= 0)
+					start_analysis(w, opt); // decodes the samples, so remuxing uses one thread
+				if (res != AUD_OK)
+					werror(w, "%s\n", ctx->message);
+			}
+			if (res < 0) {
+				finish_wav(w, &out);
+				close_aud(w);
+				AUD_index_free(&w->index);
+				return 1;
+			}
+			
+			wlog(w, "Selected WAV block size: %u (4 + %u) bytes\n", ctx->wav_blocksize + 4, ctx->wav_blocksize);
+			w->stats.blocksize = ctx->wav_blocksize + 4;
+			
+			if (output_samples(ctx))
+				WAV_header_adpcm(&wav_header_adpcm, aud_header->samplerate, ctx->wav_blocksize, output_samples(ctx), ctx->wav_datalen);
+			else
+				WAV_header_adpcm(&wav_header_adpcm, aud_header->samplerate, ctx->wav_blocksize, WAV_SIZE_UNKNOWN, WAV_SIZE_UNKNOWN);
+			output_write(&out, header, WAV_write_header_adpcm(&wav_header_adpcm, header));
+			
+			// Remux all blocks, a window at a time if the file is split among threads, otherwise straight into the output buffers
+			if ((opt->threads > 1) && !ctx->stream && !ctx->range_end && (wav_data = malloc(PARALLEL_WINDOW))) {
+				while (((size = AUD_remux_parallel(ctx, wav_data, PARALLEL_WINDOW, opt->threads)) > 0) && !output_write(&out, wav_data, size));
+				free(wav_data);
+			} else while ((out_buffer = output_reserve(&out, ctx->wav_blocksize + 4, &space)) && ((size = AUD_remux(ctx, out_buffer, space)) > 0))
+				output_commit(&out, size);
+			if (ctx->error)
+				werror(w, "%s: %s\n", ifilename, ctx->message);
+			if (ctx->error == AUD_ERROR_VERIFY)
+				failed = 1;
+			else if (opt->verify)
+				wlog(w, "Verified: %llu WAV blocks decode to the same samples as the AUD stream\n", (unsigned long long)ctx->wav_blocks_written);
+			
+			// Header is patched in place, after all the data has been written
+			if ((output_flush(&out) == 0) && ctx->stream && !failed) {
+				print_aud_stream_info(w, aud_header, "Streamed");
+				ctx->wav_datalen = ctx->wav_blocks_written * (ctx->wav_blocksize + 4);
+				if ((aud_header->num_samples != wav_header_adpcm.nSamples) || (ctx->wav_datalen != wav_header_adpcm.datalen))
+					patch_adpcm_header(w, out.file, wav_header_adpcm.rf64, aud_header->samplerate, ctx->wav_blocksize, aud_header->num_samples, ctx->wav_datalen);
+			}
+			
+			failed = finish_wav(w, &out) || failed;
+			finish_analysis(w, failed);
+			
+		} // if fopen(wav) succeeded
+	} // if remuxing
+	
+	close_aud(w);
+	AUD_index_free(&w->index);
+	AUD_resample_free(&w->resampler);
+	AUD_analysis_free(&w->analysis);
+	return failed;
+}
+
+
+// Decodes several AUD files to PCM WAV together, one SIMD lane per file (see AUD_decode_lanes())
+// Each file uses its own worker state and log, returns number of files that failed
+int convert_lanes(WORKER *lanes, int count, const OPTIONS *opt, char **ifilenames, const char **ofilenames) {
+	
+	AUD_CONTEXT *ctx[AUD_LANES];
+	short *pcm[AUD_LANES];
+	long decoded[AUD_LANES];
+	int lane[AUD_LANES]; // file of each stream being decoded
+	OUTPUT out[AUD_LANES];
+	char created[AUD_LANES];
+	WAV_HEADER_PCM wav_header_pcm[AUD_LANES];
+	char failed[AUD_LANES];
+	const char *ofilename;
+	uint32_t max_samples, space;
+	double start;
+	int i, k, n = 0, failures = 0;
+	
+	// Open all files, a file that fails to open is done right away
+	
+	for (i = 0; i < count; i++) {
+		WORKER *w = &lanes[i];
+		
+		failed[i] = 1;
+		created[i] = 0;
+		ofilename = ofilenames[i];
+		w->stats.start = now(); // files of a batch are opened one after another
+		if (open_aud(w, opt, ifilenames[i], &ofilename)) {
+			w->stats.total = now() - w->stats.start;
+			continue;
+		}
+		if (!ofilename) {
+			make_ofilename(w->ofilename, sizeof(w->ofilename), ifilenames[i], -1);
+			ofilename = w->ofilename;
+		}
+		if (AUD_rewind(&w->ctx, 0) != AUD_OK)
+			werror(w, "%s: %s\n", ifilenames[i], w->ctx.message);
+		else if (!create_pcm_wav(w, &out[i], ofilename, &wav_header_pcm[i])) {
+			start_analysis(w, opt);
+			failed[i] = 0;
+			created[i] = 1;
+			ctx[n] = &w->ctx;
+			lane[n++] = i;
+			continue;
+		}
+		close_aud(w);
+		w->stats.total = now() - w->stats.start;
+	}
+	
+	// Decode all blocks of all files straight into their output buffers,
+	// a file leaves the batch when it ends or fails to write (reported by finish_pcm_wav())
+	
+	start = now();
+	while (n > 0) {
+		max_samples = WRITER_BUFFER_SIZE / 2;
+		for (k = 0; k < n; k++) {
+			if (!(pcm[k] = (short *)output_reserve(&out[lane[k]], 2, &space))) {
+				n--;
+				ctx[k] = ctx[n];
+				lane[k--] = lane[n];
+			} else if (space / 2 < max_samples)
+				max_samples = space / 2;
+		}
+		if (!n || (AUD_decode_lanes(ctx, n, pcm, max_samples, decoded) <= 0)) break;
+		for (k = 0; k < n; k++) {
+			if (decoded[k] > 0) {
+				output_commit(&out[lane[k]], decoded[k] * 2);
+				continue;
+			}
+			n--;
+			ctx[k] = ctx[n];
+			decoded[k] = decoded[n];
+			lane[k--] = lane[n];
+		}
+	}
+	
+	for (i = 0; i < count; i++) {
+		if (created[i]) {
+			failed[i] = finish_pcm_wav(&lanes[i], &out[i], &wav_header_pcm[i], ifilenames[i], failed[i]);
+			finish_analysis(&lanes[i], failed[i]);
+			close_aud(&lanes[i]);
+			lanes[i].stats.convert = now() - start; // the batch is decoded together
+			lanes[i].stats.total = now() - lanes[i].stats.start;
+		}
+		lanes[i].stats.failed = failed[i];
+		failures += failed[i];
+	}
+	return failures;
+}
+
+// Reads all of f into memory, returns NULL on a read error or if there's not enough memory
+unsigned char *read_all(FILE *f, size_t *size) {
+	unsigned char *data = NULL, *grown;
+	size_t len = 0, capacity = 1 << 16, n;
+	
+	while (1) {
+		if (!data || (len == capacity)) {
+			if (data) capacity *= 2;
+			if (!(grown = realloc(data, capacity))) break;
+			data = grown;
+		}
+		if ((n = fread(data + len, 1, capacity - len, f)) == 0) {
+			if (ferror(f)) break;
+			*size = len;
+			return data;
+		}
+		len += n;
+	}
+	free(data);
+	return NULL;
+}
+
+// Decodes an encoded file back and compares it with the samples it was made of, returns 0 if it decodes to all of them
+int check_encoded(WORKER *w, const unsigned char *aud, uint32_t size, const short *pcm, uint32_t num_samples) {
+	AUD_CONTEXT *ctx = &w->ctx;
+	short *decoded = (short *)w->out_buffer;
+	uint32_t done = 0, max_error = 0, i;
+	double sum_sq = 0, error_sq = 0;
+	long n;
+	int err;
+	
+	if (AUD_open_memory(ctx, aud, size) != AUD_OK || AUD_probe(ctx) != AUD_OK) {
+		werror(w, "Error: encoded stream doesn't decode: %s\n", ctx->message);
+		AUD_close(ctx);
+		return 1;
+	}
+	while ((n = AUD_decode(ctx, decoded, sizeof(w->out_buffer) / 2)) > 0) {
+		for (i = 0; (i < (uint32_t)n) && (done + i < num_samples); i++) {
+			err = decoded[i] - pcm[done + i];
+			sum_sq += (double)pcm[done + i] * pcm[done + i];
+			error_sq += (double)err * err;
+			if ((uint32_t)abs(err) > max_error) max_error = abs(err);
+		}
+		done += n;
+	}
+	AUD_close(ctx);
+	if (done < num_samples) {
+		werror(w, "Error: encoded stream decodes to %u samples instead of %u\n", done, num_samples);
+		return 1;
+	}
+	if (error_sq > 0)
+		wlog(w, "Decoded back: SNR %.2f dB, RMS error %.1f, max error %u\n", 10 * log10(sum_sq / error_sq), sqrt(error_sq / num_samples), max_error);
+	else
+		wlog(w, "Decoded back: identical to the input\n");
+	return 0;
+}
+
+// Encodes one mono 16-bit PCM WAV file into AUD (-e), the result is decoded back before it's written
+// ofilename: output filename specified by -o, or NULL to derive it from the input filename
+// Returns 0 on success
+int encode_file(WORKER *w, const OPTIONS *opt, const char *ifilename, const char *ofilename) {
+	WAV_HEADER_PCM wav_header_pcm;
+	OUTPUT out;
+	FILE *wav;
+	unsigned char *data, *aud = NULL;
+	uint32_t offset, num_samples = 0;
+	size_t size;
+	long encoded;
+	double start = now();
+	int res, failed = 1;
+	
+	if ((strcmp(ifilename, "-") == 0) && !ofilename)
+		ofilename = "-"; // stdin -> stdout
+	if (!(wav = strcmp(ifilename, "-") ? fopen(ifilename, "rb") : stdin)) {
+		werror(w, "Error opening %s: %s\n", ifilename, strerror(errno));
+		return 1;
+	}
+	data = read_all(wav, &size);
+	if (wav != stdin)
+		fclose(wav);
+	w->stats.open = now() - start;
+	if (!data) {
+		werror(w, "Error reading %s\n", ifilename);
+		return 1;
+	}
+	w->stats.bytes_in = size;
+	wlog(w, "\n%s: successfully opened\n", ifilename);
+	
+	res = WAV_read_header_pcm(&wav_header_pcm, data, size, &offset);
+	if (res == AUD_ERROR_FORMAT)
+		werror(w, "%s: not a WAV file\n", ifilename);
+	else if (res != AUD_OK)
+		werror(w, "%s: format %u, %u channels, %u-bit, only mono 16-bit PCM can be encoded\n", ifilename, wav_header_pcm.wFormatTag, wav_header_pcm.nChannels, wav_header_pcm.wBitsPerSample);
+	else if (wav_header_pcm.nSamplesPerSec > 65535)
+		werror(w, "%s: sample rate %u doesn't fit an AUD header\n", ifilename, wav_header_pcm.nSamplesPerSec);
+	else if (wav_header_pcm.datalen / 2 > AUD_ENCODE_MAX_SAMPLES)
+		werror(w, "%s: %llu samples don't fit an AUD header\n", ifilename, (unsigned long long)wav_header_pcm.datalen / 2);
+	else if (!(num_samples = wav_header_pcm.datalen / 2))
+		werror(w, "%s: no samples to encode\n", ifilename);
+	else if (!(aud = malloc(AUD_encoded_size(num_samples))))
+		werror(w, "Error: not enough memory to encode %s\n", ifilename);
+	else {
+		wlog(w, "Sample rate: %u\n", wav_header_pcm.nSamplesPerSec);
+		wlog(w, "Samples: %u\n", num_samples);
+		w->stats.samples = num_samples;
+		
+		// Samples are moved to the start of the buffer, where they are aligned
+		memmove(data, data + offset, num_samples * 2);
+		start = now();
+		encoded = AUD_encode((short *)data, num_samples, wav_header_pcm.nSamplesPerSec, opt->encode_mode, opt->threads, aud);
+		wlog(w, "Encoded %s in %.3f s, %ld bytes\n", (opt->encode_mode == AUD_ENCODE_TRELLIS) ? "by trellis search" : "greedily", now() - start, encoded);
+		
+		if (!ofilename) {
+			make_aud_ofilename(w->ofilename, sizeof(w->ofilename), ifilename);
+			ofilename = w->ofilename;
+		}
+		if ((encoded > 0) && !check_encoded(w, aud, encoded, (short *)data, num_samples) && !create_wav(w, &out, ofilename)) {
+			wlog(w, "Writing AUD to %s\n", ofilename);
+			output_write(&out, aud, encoded);
+			failed = finish_wav(w, &out);
+		}
+	}
+	free(aud);
+	free(data);
+	return failed;
+}
+
+
+// Writes str as a JSON string
+void json_string(FILE *f, const char *str) {
+	unsigned char c;
+	
+	fputc('"', f);
+	while ((c = *str++)) {
+		if ((c == '"') || (c == '\\'))
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+// Writes a level in dB as a JSON number, null for silence or if it wasn't measured
+void json_db(FILE *f, double db) {
+	if (isnan(db) || isinf(db))
+		fprintf(f, "null");
+	else
+		fprintf(f, "%.2f", db);
+}
+
+// Writes str as a CSV field
+void csv_string(FILE *f, const char *str) {
+	fputc('"', f);
+	for (; *str; str++) {
+		if (*str == '"')
+			fputc('"', f);
+		fputc(*str, f);
+	}
+	fputc('"', f);
+}
+
+// Prints stream info of one file for --probe, without decoding it
+// The file header is enough with -s if it is consistent with the file size, otherwise block headers are walked
+// Returns 0 on success, unsupported codecs are only reported
+int probe_file(WORKER *w, const OPTIONS *opt, const char *ifilename) {
+	AUD_CONTEXT *ctx = &w->ctx;
+	AUD_HEADER *aud_header = &ctx->header;
+	FILE *f = stdout;
+	const char *outcome = "failed", *method = NULL, *error = w->stats.error;
+	int frame, walked, res = AUD_ERROR_READ;
+	int csv = (opt->probe == PROBE_CSV);
+	unsigned long long samples = 0, encsize_diff, decsize_diff;
+	double start = now();
+	
+	if ((res = open_input(w, ifilename, 0)) != AUD_ERROR_READ) {
+		w->stats.open = now() - start;
+		if (res == AUD_ERROR_FORMAT) {
+			werror(w, "%s: %s\n", ifilename, ctx->message);
+		} else {
+			w->stats.opened = 1;
+			start = now();
+			if (ctx->stream || (opt->stream && (aud_header->format == AUD_FORMAT_NEW) && aud_header->decsize && (aud_header->filesize == (uint64_t)AUD_HEADER_NEW_SIZE + aud_header->encsize))) {
+				method = "header";
+			} else {
+				method = "blocks";
+				res = AUD_probe_headers(ctx);
+			}
+			w->stats.scan = now() - start;
+			if (res != AUD_OK)
+				werror(w, "%s: %s\n", ifilename, ctx->message);
+			outcome = (res == AUD_OK) ? "ok" : (res == AUD_WARNING) ? "warning" : (res == AUD_ERROR_UNSUPPORTED) ? "unsupported" : "failed";
+		}
+		close_aud(w);
+	}
+	
+	walked = method && (method[0] == 'b');
+	frame = ((aud_header->flags & 1) ? 2 : 1) * ((aud_header->flags & 2) ? 2 : 1);
+	if (method)
+		samples = walked ? aud_header->num_samples : aud_header->decsize / frame;
+	encsize_diff = aud_header->adpcm_bytes + AUD_BLOCK_HEADER_SIZE * aud_header->blocks - aud_header->encsize;
+	decsize_diff = aud_header->decsize ? samples * frame - aud_header->decsize : 0;
+	
+	pthread_mutex_lock(&stdout_mutex);
+	if (csv) {
+		// Columns of PROBE_CSV_HEADER, the ones that aren't known are left empty
+		csv_string(f, ifilename);
+		fprintf(f, ",%s", outcome);
+		if (method) {
+			fprintf(f, ",%s,%u,%u,%u,%u,%llu,%.3f", (aud_header->format == AUD_FORMAT_NEW) ? "new" : "old", aud_header->samplerate,
+			        (aud_header->flags & 1) ? 2 : 1, (aud_header->flags & 2) ? 16 : 8, aud_header->codec,
+			        samples, aud_header->samplerate ? (double)samples / aud_header->samplerate : 0);
+			if (walked)
+				fprintf(f, ",%llu,%u,%u", (unsigned long long)aud_header->blocks, aud_header->first_block_size, aud_header->last_block_size);
+			else
+				fprintf(f, ",,,");
+			fprintf(f, ",%llu,%u,%u", (unsigned long long)aud_header->filesize, aud_header->encsize, aud_header->decsize);
+			if (walked)
+				fprintf(f, ",%lld,%lld", (long long)encsize_diff, (long long)decsize_diff);
+			else
+				fprintf(f, ",,");
+			fprintf(f, ",%s,", method);
+		} else
+			fprintf(f, ",,,,,,,,,,,,,,,,,");
+		csv_string(f, error);
+	} else {
+		fprintf(f, "{\"file\":");
+		json_string(f, ifilename);
+		fprintf(f, ",\"outcome\":\"%s\"", outcome);
+		if (error[0]) {
+			fprintf(f, ",\"error\":");
+			json_string(f, error);
+		}
+		if (method) {
+			fprintf(f, ",\"format\":\"%s\",\"samplerate\":%u,\"channels\":%u,\"bits\":%u,\"codec\":%u,\"samples\":%llu,\"duration\":%.3f",
+			        (aud_header->format == AUD_FORMAT_NEW) ? "new" : "old", aud_header->samplerate,
+			        (aud_header->flags & 1) ? 2 : 1, (aud_header->flags & 2) ? 16 : 8, aud_header->codec,
+			        samples, aud_header->samplerate ? (double)samples / aud_header->samplerate : 0);
+			if (walked)
+				fprintf(f, ",\"blocks\":%llu,\"first_block_size\":%u,\"last_block_size\":%u", (unsigned long long)aud_header->blocks, aud_header->first_block_size, aud_header->last_block_size);
+			fprintf(f, ",\"filesize\":%llu,\"encsize\":%u,\"decsize\":%u", (unsigned long long)aud_header->filesize, aud_header->encsize, aud_header->decsize);
+			if (walked)
+				fprintf(f, ",\"encsize_diff\":%lld,\"decsize_diff\":%lld", (long long)encsize_diff, (long long)decsize_diff);
+			fprintf(f, ",\"method\":\"%s\"", method);
+		}
+		fprintf(f, "}");
+	}
+	fprintf(f, "\n");
+	pthread_mutex_unlock(&stdout_mutex);
+	
+	return (res < 0) && (res != AUD_ERROR_UNSUPPORTED);
+}
+
+
+
+/******************************** MIX archives ********************************/
+
+// Input files of the batch, with MIX archives replaced by their AUD entries
+typedef struct {
+	char **files;         // filename, or archive.mix#entry
+	AUD_MEMORY *entries;  // data of each MIX entry, data = NULL for files
+	int count;
+	int size;
+	MIX_ARCHIVE **archives; // kept open until the batch is done
+	int archive_count;
+	int args; // files before this one are command-line arguments, later ones were found by --watch and allocated
+} INPUTS;
+
+// Length of the archive filename if arg is archive.mix or archive.mix#entries, 0 if it isn't an archive
+size_t mix_filename_length(const char *arg) {
+	const char *str;
+	
+	for (str = arg; (str = strchr(str, '.')); str++)
+		if ((strnicmp(str, ".mix", 4) == 0) && (!str[4] || (str[4] == '#')))
+			return str + 4 - arg;
+	return 0;
+}
+
+// name: not copied, entry: NULL for files. Returns 0 on success
+int add_input(INPUTS *in, char *name, const MIX_ARCHIVE *mix, const MIX_ENTRY *entry) {
+	if (in->count == in->size) {
+		int size = in->size ? in->size * 2 : 64;
+		char **files = realloc(in->files, size * sizeof(char *));
+		AUD_MEMORY *entries = files ? realloc(in->entries, size * sizeof(AUD_MEMORY)) : NULL;
+		if (files) in->files = files;
+		if (!entries) return 1;
+		in->entries = entries;
+		in->size = size;
+	}
+	in->files[in->count] = name;
+	in->entries[in->count].data = entry ? &mix->data[entry->offset] : NULL;
+	in->entries[in->count].size = entry ? entry->size : 0;
+	in->entries[in->count].pos = 0;
+	in->count++;
+	return 0;
+}
+
+// Adds an entry as archive.mix#name, name is the filename or the 8-digit hex ID of the entry
+int add_entry(INPUTS *in, const char *arg, size_t len, const char *name, const MIX_ARCHIVE *mix, const MIX_ENTRY *entry) {
+	char *str = malloc(len + 1 + strlen(name) + 1);
+	
+	if (!str) return 1;
+	sprintf(str, "%.*s#%s", (int)len, arg, name);
+	if (add_input(in, str, mix, entry) == 0)
+		return 0;
+	free(str);
+	return 1;
+}
+
+// Adds AUD entries of the MIX archive arg to the inputs: the ones listed after # (comma-separated filenames or hex IDs),
+// or all entries that have an AUD header, named by their IDs. ctx is used for header detection
+// unsupported: also add AUD entries with unsupported formats, otherwise they are only counted
+// Returns number of errors: archive that can't be read, or listed entries that aren't in it
+int add_archive(INPUTS *in, const char *arg, AUD_CONTEXT *ctx, int unsupported) {
+	size_t len = mix_filename_length(arg);
+	const char *list = arg[len] ? &arg[len + 1] : NULL;
+	char filename[FILENAME_MAX], name[FILENAME_MAX], *end;
+	MIX_ARCHIVE *mix, **archives;
+	const MIX_ENTRY *entry;
+	uint32_t i, id, found = 0, skipped = 0;
+	int res, errors = 0;
+	FILE *f;
+	
+	snprintf(filename, sizeof(filename), "%.*s", (int)len, arg);
+	if (!(mix = calloc(1, sizeof(MIX_ARCHIVE))) || !(archives = realloc(in->archives, (in->archive_count + 1) * sizeof(MIX_ARCHIVE *)))) {
+		fprintf(stderr, "Error opening %s: not enough memory\n", filename);
+		free(mix);
+		return 1;
+	}
+	in->archives = archives;
+	if (!(f = fopen(filename, "rb"))) {
+		fprintf(stderr, "Error opening %s: %s\n", filename, strerror(errno));
+		free(mix);
+		return 1;
+	}
+	res = MIX_open(mix, f);
+	fclose(f); // the mapping stays valid
+	if (res != AUD_OK) {
+		fprintf(stderr, "%s: %s\n", filename, mix->message);
+		MIX_close(mix);
+		free(mix);
+		return 1;
+	}
+	in->archives[in->archive_count++] = mix;
+	
+	if (!list) {
+		for (i = 0; i < mix->count; i++) {
+			entry = &mix->entries[i];
+			res = AUD_open_memory(ctx, &mix->data[entry->offset], entry->size);
+			AUD_close(ctx);
+			if (res == AUD_ERROR_FORMAT) continue; // other kinds of files
+			found++;
+			if ((res == AUD_ERROR_UNSUPPORTED) && !unsupported) {
+				skipped++;
+				continue;
+			}
+			snprintf(name, sizeof(name), "%08X", entry->id);
+			errors += add_entry(in, arg, len, name, mix, entry);
+		}
+		fprintf(stderr, "%s: %u AUD files in %u entries", filename, found, mix->count);
+		if (skipped)
+			fprintf(stderr, ", %u of them skipped, only mono 16-bit IMA ADPCM is supported", skipped);
+		fprintf(stderr, "\n");
+		return errors;
+	}
+	
+	while (*list) {
+		snprintf(name, sizeof(name), "%.*s", (int)strcspn(list, ","), list);
+		list += strcspn(list, ",");
+		if (*list) list++;
+		if (!name[0]) continue;
+		id = strtoul(name, &end, 16);
+		if ((strlen(name) != 8) || *end) // not an ID
+			id = MIX_id(name);
+		if (!(entry = MIX_find(mix, id))) {
+			fprintf(stderr, "%s: no entry %s\n", filename, name);
+			errors++;
+		} else
+			errors += add_entry(in, arg, len, name, mix, entry);
+	}
+	return errors;
+}
+
+void free_inputs(INPUTS *in) {
+	int i;
+	
+	for (i = 0; i < in->count; i++)
+		if (in->entries[i].data || (i >= in->args))
+			free(in->files[i]);
+	for (i = 0; i < in->archive_count; i++) {
+		MIX_close(in->archives[i]);
+		free(in->archives[i]);
+	}
+	free(in->files);
+	free(in->entries);
+	free(in->archives);
+}
+
+
+
+/******************************** Cache ********************************/
+
+// --cache manifest: one line per converted input, with the stamps of the input and of its outputs
+// Lines are appended as files are converted, so an interrupted batch resumes where it stopped,
+// the manifest is rewritten with one line per input at the end
+#define CACHE_SIGNATURE   "aud2wav cache 1"
+#define CACHE_OUTPUTS_MAX OUTPUTS_MAX // --outputs, -4 has fewer
+#define CACHE_LINE_MAX    ((CACHE_OUTPUTS_MAX + 1) * (FILENAME_MAX + 48) + 64)
+
+typedef struct {
+	char *name;
+	uint64_t size;
+	int64_t mtime; // ns, see stamp_file()
+} CACHE_FILE;
+
+// line holds the strings, fields are split by tabs:
+// input, size, mtime, hash, params, number of outputs, and name, size, mtime of each output
+typedef struct {
+	char *line;
+	int order;       // in the manifest, a later line of the same input replaces earlier ones
+	CACHE_FILE input;
+	uint64_t hash;
+	char *params;
+	int outputs;
+	CACHE_FILE output[CACHE_OUTPUTS_MAX];
+} CACHE_ENTRY;
+
+typedef struct {
+	const char *filename;
+	FILE *journal;         // manifest opened for appending
+	char params[FILENAME_MAX]; // conversion options the outputs depend on
+	CACHE_ENTRY *entries;  // loaded ones sorted by input, then the ones added by this batch
+	int count;             // loaded
+	int total;             // with added ones
+	int size;
+	char recent;           // also look up the added ones, --watch converts a file again when it's written again
+	pthread_mutex_t mutex;
+} CACHE;
+
+// Content hash of the inputs, 4 lanes of 64-bit words with xxHash64 rounds, fast but not cryptographic
+typedef struct {
+	uint64_t lane[4];
+	uint64_t len;
+} HASH;
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+#define HASH_PRIME4 0x85EBCA77C2B2AE63ULL
+
+uint64_t hash_round(uint64_t lane, uint64_t word) {
+	lane += word * HASH_PRIME2;
+	lane = (lane << 31) | (lane >> 33);
+	return lane * HASH_PRIME1;
+}
+
+void hash_init(HASH *h) {
+	h->lane[0] = HASH_PRIME1 + HASH_PRIME2;
+	h->lane[1] = HASH_PRIME2;
+	h->lane[2] = 0;
+	h->lane[3] = -HASH_PRIME1;
+	h->len = 0;
+}
+
+// n has to be a multiple of 32, except in the last call
+void hash_update(HASH *h, const unsigned char *p, size_t n) {
+	unsigned char tail[8];
+	uint64_t word;
+	size_t i;
+	int k;
+	
+	h->len += n;
+	for (i = 0; i + 32 <= n; i += 32)
+		for (k = 0; k < 4; k++) {
+			memcpy(&word, &p[i + k * 8], 8);
+			h->lane[k] = hash_round(h->lane[k], word);
+		}
+	for (k = 0; i < n; i += 8, k++) { // zero-padded words
+		memset(tail, 0, sizeof(tail));
+		memcpy(tail, &p[i], (n - i < 8) ? n - i : 8);
+		memcpy(&word, tail, 8);
+		h->lane[k] = hash_round(h->lane[k], word);
+	}
+}
+
+uint64_t hash_final(const HASH *h) {
+	uint64_t x = h->len * HASH_PRIME1;
+	int k;
+	
+	for (k = 0; k < 4; k++)
+		x = (x ^ hash_round(0, h->lane[k])) * HASH_PRIME1 + HASH_PRIME4;
+	x ^= x >> 33;
+	x *= HASH_PRIME2;
+	x ^= x >> 29;
+	x *= HASH_PRIME3;
+	return x ^ (x >> 32);
+}
+
+// Hashes the current input, returns 0 on success
+int hash_input(WORKER *w, const char *ifilename, uint64_t *hash) {
+	unsigned char buf[1 << 16];
+	HASH h;
+	FILE *f;
+	size_t n;
+	int error;
+	
+	hash_init(&h);
+	if (w->entry.data) {
+		hash_update(&h, w->entry.data, w->entry.size);
+	} else {
+		if (!(f = fopen(ifilename, "rb")))
+			return 1;
+		while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+			hash_update(&h, buf, n); // only the last read is short
+		error = ferror(f);
+		fclose(f);
+		if (error) return 1;
+	}
+	*hash = hash_final(&h);
+	return 0;
+}
+
+// Size and modification time of a file in nanoseconds, returns 0 on success
+// Seconds aren't enough: a same-length file rewritten within the same second would look unchanged
+int stamp_file(const char *filename, uint64_t *size, int64_t *mtime) {
+	struct stat st;
+	
+	if (stat(filename, &st) != 0) return 1;
+	*size = st.st_size;
+#if defined(_WIN32)
+	*mtime = (int64_t)st.st_mtime * 1000000000;
+#elif defined(__APPLE__)
+	*mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+	*mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+	return 0;
+}
+
+// Same for the current input, MIX entries have the time of their archive
+int stamp_input(WORKER *w, const char *ifilename, uint64_t *size, int64_t *mtime) {
+	char archive[FILENAME_MAX];
+	
+	if (!w->entry.data)
+		return stamp_file(ifilename, size, mtime);
+	snprintf(archive, sizeof(archive), "%.*s", (int)mix_filename_length(ifilename), ifilename);
+	if (stamp_file(archive, size, mtime)) return 1;
+	*size = w->entry.size;
+	return 0;
+}
+
+// Output files of an input, the same as convert_file() writes, returns their number, 0 if they can't be cached
+int output_names(const OPTIONS *opt, const char *ifilename, const char *ofilename, char names[][FILENAME_MAX]) {
+	int algo;
+	
+	if (!strcmp(ifilename, "-") || (ofilename && !strcmp(ofilename, "-")))
+		return 0;
+	if (opt->encode && !ofilename) {
+		make_aud_ofilename(names[0], FILENAME_MAX, ifilename);
+		return 1;
+	}
+	if (opt->outputs) {
+		for (algo = 0; algo < opt->outputs; algo++)
+			make_output_ofilename(names[algo], FILENAME_MAX, ifilename, opt->output[algo]);
+		return opt->outputs;
+	}
+	if (opt->algo_last) {
+		for (algo = 0; algo <= opt->algo_last; algo++)
+			make_ofilename(names[algo], FILENAME_MAX, ifilename, algo);
+		return opt->algo_last + 1;
+	}
+	if (ofilename)
+		snprintf(names[0], FILENAME_MAX, "%s", ofilename);
+	else
+		make_ofilename(names[0], FILENAME_MAX, ifilename, -1);
+	return 1;
+}
+
+// Splits a manifest line into e, returns 0 if it is valid
+int cache_parse(CACHE_ENTRY *e, char *line) {
+	char *field[6 + CACHE_OUTPUTS_MAX * 3];
+	int i, n = 0;
+	
+	line[strcspn(line, "\r\n")] = 0;
+	field[n++] = line;
+	while ((n < (int)(sizeof(field) / sizeof(field[0]))) && (line = strchr(line, '\t'))) {
+		*line++ = 0;
+		field[n++] = line;
+	}
+	if ((n < 6) || (n != 6 + atoi(field[5]) * 3)) return 1;
+	e->input.name = field[0];
+	e->input.size = strtoull(field[1], NULL, 10);
+	e->input.mtime = strtoll(field[2], NULL, 10);
+	e->hash = strtoull(field[3], NULL, 16);
+	e->params = field[4];
+	e->outputs = atoi(field[5]);
+	for (i = 0; i < e->outputs; i++) {
+		e->output[i].name = field[6 + i * 3];
+		e->output[i].size = strtoull(field[7 + i * 3], NULL, 10);
+		e->output[i].mtime = strtoll(field[8 + i * 3], NULL, 10);
+	}
+	return (e->outputs < 1) || (e->outputs > CACHE_OUTPUTS_MAX);
+}
+
+void cache_print(FILE *f, const CACHE_ENTRY *e) {
+	int i;
+	
+	fprintf(f, "%s\t%llu\t%lld\t%016llx\t%s\t%d", e->input.name, (unsigned long long)e->input.size, (long long)e->input.mtime,
+	        (unsigned long long)e->hash, e->params, e->outputs);
+	for (i = 0; i < e->outputs; i++)
+		fprintf(f, "\t%s\t%llu\t%lld", e->output[i].name, (unsigned long long)e->output[i].size, (long long)e->output[i].mtime);
+	fprintf(f, "\n");
+}
+
+int compare_cache_inputs(const void *a, const void *b) {
+	return strcmp(((const CACHE_ENTRY *)a)->input.name, ((const CACHE_ENTRY *)b)->input.name);
+}
+
+int compare_cache_entries(const void *a, const void *b) {
+	int res = compare_cache_inputs(a, b);
+	return res ? res : ((const CACHE_ENTRY *)a)->order - ((const CACHE_ENTRY *)b)->order;
+}
+
+// Sorts entries by input and keeps the last line of each one
+void cache_sort(CACHE *cache) {
+	int i, n = 0;
+	
+	qsort(cache->entries, cache->total, sizeof(CACHE_ENTRY), compare_cache_entries);
+	for (i = 0; i < cache->total; i++) {
+		if ((i + 1 < cache->total) && !strcmp(cache->entries[i].input.name, cache->entries[i + 1].input.name)) {
+			free(cache->entries[i].line);
+			continue;
+		}
+		cache->entries[n] = cache->entries[i];
+		cache->entries[n].order = n;
+		n++;
+	}
+	cache->count = cache->total = n;
+}
+
+// Adds a copy of e, returns 0 on success
+int cache_append(CACHE *cache, const CACHE_ENTRY *e) {
+	CACHE_ENTRY *entries, *copy;
+	char *line;
+	size_t len;
+	int i;
+	
+	if (cache->total == cache->size) {
+		int size = cache->size ? cache->size * 2 : 256;
+		if (!(entries = realloc(cache->entries, size * sizeof(CACHE_ENTRY))))
+			return 1;
+		cache->entries = entries;
+		cache->size = size;
+	}
+	len = strlen(e->input.name) + 1 + strlen(e->params) + 1;
+	for (i = 0; i < e->outputs; i++)
+		len += strlen(e->output[i].name) + 1;
+	if (!(line = malloc(len)))
+		return 1;
+	copy = &cache->entries[cache->total];
+	*copy = *e;
+	copy->line = line;
+	copy->order = cache->total++;
+	copy->input.name = strcpy(line, e->input.name);
+	line += strlen(line) + 1;
+	copy->params = strcpy(line, e->params);
+	line += strlen(line) + 1;
+	for (i = 0; i < e->outputs; i++) {
+		copy->output[i].name = strcpy(line, e->output[i].name);
+		line += strlen(line) + 1;
+	}
+	return 0;
+}
+
+void cache_free(CACHE *cache) {
+	int i;
+	
+	for (i = 0; i < cache->total; i++)
+		free(cache->entries[i].line);
+	free(cache->entries);
+	pthread_mutex_destroy(&cache->mutex);
+}
+
+// Loads the manifest and opens it for appending, returns 0 on success
+int cache_open(CACHE *cache, const OPTIONS *opt, const char *filename) {
+	char *line = malloc(CACHE_LINE_MAX);
+	CACHE_ENTRY e;
+	FILE *f;
+	int valid = 0, i;
+	
+	memset(cache, 0, sizeof(CACHE));
+	cache->filename = filename;
+	pthread_mutex_init(&cache->mutex, NULL);
+	if (opt->encode)
+		snprintf(cache->params, sizeof(cache->params), "encode %s", (opt->encode_mode == AUD_ENCODE_TRELLIS) ? "trellis" : "greedy");
+	else if (opt->outputs)
+		for (i = 0; i < opt->outputs; i++)
+			snprintf(&cache->params[strlen(cache->params)], sizeof(cache->params) - strlen(cache->params), opt->output[i] ? "%sb%d" : "%spcm", i ? "," : "outputs ", opt->output[i]);
+	else if (opt->algo_last)
+		snprintf(cache->params, sizeof(cache->params), "decode4");
+	else if (opt->decode && opt->rate)
+		snprintf(cache->params, sizeof(cache->params), "decode rate=%u,%s", opt->rate, resample_quality_names[opt->rate_quality]);
+	else if (opt->decode)
+		snprintf(cache->params, sizeof(cache->params), "decode");
+	else
+		snprintf(cache->params, sizeof(cache->params), "remux b=%d%s", opt->blocksize, opt->verify ? " verify" : "");
+	if (opt->range)
+		snprintf(&cache->params[strlen(cache->params)], sizeof(cache->params) - strlen(cache->params), " range=%s", opt->range);
+	
+	if (!line) return 1;
+	if ((f = fopen(filename, "r"))) {
+		// A line cut short by an interrupted batch is skipped
+		if (!fgets(line, CACHE_LINE_MAX, f)) { // empty
+			valid = 1;
+		} else if (strncmp(line, CACHE_SIGNATURE "\n", strlen(CACHE_SIGNATURE) + 1) == 0) {
+			valid = 1;
+			while (fgets(line, CACHE_LINE_MAX, f))
+				if ((cache_parse(&e, line) == 0) && cache_append(cache, &e))
+					break;
+		}
+		fclose(f);
+		if (!valid) {
+			fprintf(stderr, "Error: %s is not an aud2wav cache. Parameter ignored.\n", filename);
+			free(line);
+			cache_free(cache);
+			return 1;
+		}
+	}
+	free(line);
+	cache_sort(cache);
+	
+	if (!(cache->journal = fopen(filename, "a"))) {
+		fprintf(stderr, "Error opening %s: %s. Parameter ignored.\n", filename, strerror(errno));
+		cache_free(cache);
+		return 1;
+	}
+	if (ftell(cache->journal) == 0)
+		fprintf(cache->journal, "%s\n", CACHE_SIGNATURE);
+	fflush(cache->journal);
+	return 0;
+}
+
+// Records an input whose outputs have just been written, or were found current again
+void cache_record(CACHE *cache, WORKER *w, const char *ifilename, const CACHE_FILE *input, uint64_t hash, char names[][FILENAME_MAX], int outputs) {
+	CACHE_ENTRY e;
+	int i;
+	
+	e.input = *input;
+	e.input.name = (char *)ifilename;
+	e.hash = hash;
+	e.params = cache->params;
+	e.outputs = outputs;
+	for (i = 0; i < outputs; i++) {
+		e.output[i].name = names[i];
+		if (stamp_file(names[i], &e.output[i].size, &e.output[i].mtime)) return;
+	}
+	pthread_mutex_lock(&cache->mutex);
+	cache_print(cache->journal, &e);
+	fflush(cache->journal);
+	if (cache_append(cache, &e))
+		wlog(w, "Warning: not enough memory for the cache, %s is only in its journal\n", ifilename);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+// Returns 1 if the outputs of the current input are current: the input has the same size and time or content,
+// and the outputs are still the ones written
+int cache_current(CACHE *cache, WORKER *w, const OPTIONS *opt, const char *ifilename, const char *ofilename) {
+	char names[CACHE_OUTPUTS_MAX][FILENAME_MAX];
+	CACHE_ENTRY key, *found, e;
+	CACHE_FILE input, output;
+	uint64_t hash;
+	int i, outputs = output_names(opt, ifilename, ofilename, names);
+	
+	if (!outputs || strpbrk(ifilename, "\t\n"))
+		return 0;
+	key.input.name = (char *)ifilename;
+	pthread_mutex_lock(&cache->mutex); // entries are reallocated as they are added
+	// Added entries are searched from the latest one, a batch has each input once
+	for (i = cache->total - 1, found = NULL; cache->recent && (i >= cache->count) && !found; i--)
+		if (!strcmp(cache->entries[i].input.name, ifilename))
+			found = &cache->entries[i];
+	if (found || (found = bsearch(&key, cache->entries, cache->count, sizeof(CACHE_ENTRY), compare_cache_inputs)))
+		e = *found;
+	pthread_mutex_unlock(&cache->mutex);
+	if (!found)
+		return 0;
+	if (strcmp(e.params, cache->params) || (e.outputs != outputs) || stamp_input(w, ifilename, &input.size, &input.mtime) || (input.size != e.input.size))
+		return 0;
+	for (i = 0; i < outputs; i++)
+		if (strcmp(e.output[i].name, names[i]) || stamp_file(names[i], &output.size, &output.mtime)
+		    || (output.size != e.output[i].size) || (output.mtime != e.output[i].mtime))
+			return 0;
+	if (input.mtime == e.input.mtime)
+		return 1;
+	
+	// Touched or copied: same content is still current
+	if (hash_input(w, ifilename, &hash) || (hash != e.hash))
+		return 0;
+	cache_record(cache, w, ifilename, &input, hash, names, outputs);
+	return 1;
+}
+
+// Records a converted input
+void cache_add(CACHE *cache, WORKER *w, const OPTIONS *opt, const char *ifilename, const char *ofilename) {
+	char names[CACHE_OUTPUTS_MAX][FILENAME_MAX];
+	CACHE_FILE input;
+	uint64_t hash;
+	int outputs = output_names(opt, ifilename, ofilename, names);
+	
+	if (!outputs || strpbrk(ifilename, "\t\n") || stamp_input(w, ifilename, &input.size, &input.mtime) || hash_input(w, ifilename, &hash))
+		return;
+	cache_record(cache, w, ifilename, &input, hash, names, outputs);
+}
+
+// Rewrites the manifest with one line per input
+void cache_close(CACHE *cache) {
+	char filename[FILENAME_MAX];
+	FILE *f;
+	int i;
+	
+	fclose(cache->journal);
+	cache_sort(cache);
+	snprintf(filename, sizeof(filename), "%s.tmp", cache->filename);
+	if ((f = fopen(filename, "w"))) {
+		fprintf(f, "%s\n", CACHE_SIGNATURE);
+		for (i = 0; i < cache->count; i++)
+			cache_print(f, &cache->entries[i]);
+		if (fclose(f) != 0) {
+			remove(filename); // the journal is still there
+		} else if (rename(filename, cache->filename) != 0) { // Windows doesn't replace files
+			remove(cache->filename);
+			rename(filename, cache->filename);
+		}
+	}
+	cache_free(cache);
+}
+
+
+
+/******************************** Worker pool ********************************/
+
+// Input files are handed out one at a time, so that a few long files don't stall a statically split batch
+typedef struct {
+	const OPTIONS *opt;
+	char **files;
+	AUD_MEMORY *entries; // of files that are MIX entries, see INPUTS
+	int count;
+	const char *ofilename; // -o, applies to the first file only
+	int next;              // next file to be converted
+	int failed;            // number of files that failed
+	CACHE *cache;          // --cache, NULL if not requested
+	int cached;            // number of files skipped because their outputs were current
+	// --report totals
+	int reported;
+	int diverged[ADPCM_ALGORITHMS];
+	uint32_t max_error[ADPCM_ALGORITHMS];
+	// --stats totals
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t samples;
+	double slowest; // total time of the slowest file
+	const char *slowest_file;
+	char watching; // --watch: workers wait for more files instead of finishing
+	pthread_mutex_t mutex;
+	pthread_cond_t cond; // signals files added by --watch
+} POOL;
+
+// Writes --stats line of a converted file and adds it to the totals, called with pool->mutex held
+void add_stats(POOL *pool, WORKER *w, const char *ifilename) {
+	const OPTIONS *opt = pool->opt;
+	const STATS *st = &w->stats;
+	const AUD_HEADER *aud_header = &w->ctx.header;
+	FILE *f = opt->stats;
+	double total = st->total;
+	unsigned long long samples = st->samples, bytes_in = st->bytes_in;
+	
+	fprintf(f, "{\"file\":");
+	json_string(f, ifilename);
+	fprintf(f, ",\"mode\":\"%s\",\"outcome\":\"%s\"", opt->probe ? "probe" : opt->encode ? "encode" : opt->outputs ? "outputs" : opt->report ? "report" : opt->algo_last ? "decode4" : opt->decode ? "decode" : "remux", st->failed ? "failed" : st->cached ? "cached" : "ok");
+	if (st->error[0]) {
+		fprintf(f, ",\"error\":");
+		json_string(f, st->error);
+	}
+	if (st->opened) {
+		samples = output_samples(&w->ctx);
+		bytes_in = !w->ctx.stream ? aud_header->filesize : aud_header->adpcm_bytes + AUD_BLOCK_HEADER_SIZE * aud_header->blocks
+		         + ((aud_header->format == AUD_FORMAT_NEW) ? AUD_HEADER_NEW_SIZE : AUD_HEADER_OLD_SIZE);
+		fprintf(f, ",\"format\":\"%s\",\"samplerate\":%u,\"blocks\":%llu,\"samples\":%llu,\"bytes_in\":%llu",
+		        (aud_header->format == AUD_FORMAT_NEW) ? "new" : "old", aud_header->samplerate, (unsigned long long)aud_header->blocks, samples, bytes_in);
+	} else if (samples)
+		fprintf(f, ",\"samples\":%llu,\"bytes_in\":%llu", samples, bytes_in);
+	fprintf(f, ",\"bytes_out\":%llu", (unsigned long long)st->bytes_out);
+	if (st->blocksize)
+		fprintf(f, ",\"wav_blocksize\":%d", st->blocksize);
+	fprintf(f, ",\"open_ms\":%.3f,\"scan_ms\":%.3f,\"convert_ms\":%.3f,\"write_ms\":%.3f,\"wait_ms\":%.3f,\"total_ms\":%.3f",
+	        st->open * 1000, st->scan * 1000, st->convert * 1000, st->write * 1000, st->wait * 1000, total * 1000);
+	if (samples && (st->convert > 0) && !st->failed)
+		fprintf(f, ",\"samples_per_sec\":%.0f", samples / st->convert);
+	if (st->analyzed) {
+		fprintf(f, ",\"peak\":%u,\"peak_dbfs\":", w->analysis.peak);
+		json_db(f, w->analysis.peak_db);
+		fprintf(f, ",\"clipped\":%llu,\"rms_dbfs\":", (unsigned long long)w->analysis.clipped);
+		json_db(f, w->analysis.rms_db);
+		fprintf(f, ",\"loudness_lufs\":");
+		json_db(f, w->analysis.loudness);
+	}
+	fprintf(f, "}\n");
+	fflush(f);
+	
+	pool->bytes_in += bytes_in;
+	pool->bytes_out += st->bytes_out;
+	if (!st->failed)
+		pool->samples += samples;
+	if (total > pool->slowest) {
+		pool->slowest = total;
+		pool->slowest_file = ifilename;
+	}
+}
+
+void *worker_thread(void *arg) {
+	POOL *pool = arg;
+	const OPTIONS *opt = pool->opt;
+	// Plain decoding of many files takes several at once, one per SIMD lane
+	int lanes = (opt->decode && !opt->probe && !opt->algo_last && !opt->report && !opt->range && !opt->rate && (opt->threads <= 1) && ((pool->count > 1) || pool->watching)) ? AUD_LANES : 1;
+	WORKER *w = calloc(lanes, sizeof(WORKER));
+	WRITER writer;
+	char *files[AUD_LANES];
+	AUD_MEMORY entries[AUD_LANES];
+	const char *ofilenames[AUD_LANES];
+	int i, k, n, take, failed;
+	
+	if (!w) {
+		pthread_mutex_lock(&stderr_mutex);
+		fprintf(stderr, "Error: not enough memory for worker state\n");
+		pthread_mutex_unlock(&stderr_mutex);
+		return NULL;
+	}
+	writer_start(&writer);
+	for (i = 0; i < lanes; i++) {
+		w[i].buffered = (opt->jobs > 1) || (lanes > 1) || pool->watching;
+		w[i].writer = &writer;
+	}
+	
+	while (1) {
+		// Take a full batch only while there are enough files left for all workers
+		// With --watch, wait for more files, the lists grow meanwhile so they are only read here
+		pthread_mutex_lock(&pool->mutex);
+		while ((pool->next >= pool->count) && pool->watching)
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		n = pool->next;
+		take = (pool->count - n) / opt->jobs;
+		if (take > lanes) take = lanes;
+		if (take < 1) take = 1;
+		for (i = 0; (i < take) && (n + i < pool->count); i++) {
+			files[i] = pool->files[n + i];
+			entries[i] = pool->entries[n + i];
+		}
+		pool->next += take;
+		pthread_mutex_unlock(&pool->mutex);
+		if (n >= pool->count) break;
+		
+		// Files whose outputs are current are done right away, the rest of the batch is converted
+		for (i = k = 0; i < take; i++) {
+			files[k] = files[i];
+			ofilenames[k] = ((n + i == 0) && !opt->algo_last) ? pool->ofilename : NULL;
+			w[k].entry = entries[i];
+			memset(&w[k].stats, 0, sizeof(STATS));
+			w[k].stats.start = now();
+			if (!pool->cache || !cache_current(pool->cache, &w[k], opt, files[k], ofilenames[k])) {
+				k++;
+				continue;
+			}
+			wlog(&w[k], "\n%s: outputs are current, skipped\n", files[k]);
+			wlog_flush(&w[k]);
+			w[k].stats.cached = 1;
+			w[k].stats.total = now() - w[k].stats.start;
+			pthread_mutex_lock(&pool->mutex);
+			pool->cached++;
+			if (opt->stats)
+				add_stats(pool, &w[k], files[k]);
+			pthread_mutex_unlock(&pool->mutex);
+		}
+		if (!(take = k)) continue;
+		
+		w->reported = 0;
+		if (opt->probe) {
+			failed = probe_file(w, opt, files[0]);
+			w->stats.failed = failed;
+			w->stats.total = now() - w->stats.start;
+		} else if (take == 1) {
+			failed = opt->encode ? encode_file(w, opt, files[0], ofilenames[0]) : convert_file(w, opt, files[0], ofilenames[0]);
+			w->stats.failed = failed;
+			w->stats.total = now() - w->stats.start;
+			w->stats.convert = w->stats.total - w->stats.open - w->stats.scan;
+		} else
+			failed = convert_lanes(w, take, opt, files, ofilenames);
+		for (i = 0; i < take; i++) {
+			wlog_flush(&w[i]);
+			if (pool->cache && !w[i].stats.failed)
+				cache_add(pool->cache, &w[i], opt, files[i], ofilenames[i]);
+		}
+		
+		if (failed || w->reported || opt->stats) {
+			pthread_mutex_lock(&pool->mutex);
+			pool->failed += failed;
+			if (opt->stats)
+				for (i = 0; i < take; i++)
+					add_stats(pool, &w[i], files[i]);
+			if (w->reported) {
+				pool->reported++;
+				for (i = 1; i < ADPCM_ALGORITHMS; i++) {
+					pool->diverged[i] += (w->divergence[i].first != UINT64_MAX);
+					if (w->divergence[i].max_error > pool->max_error[i])
+						pool->max_error[i] = w->divergence[i].max_error;
+				}
+			}
+			pthread_mutex_unlock(&pool->mutex);
+		}
+	}
+	
+	for (i = 0; i < lanes; i++) {
+		free(w[i].log);
+		for (n = 0; n < ADPCM_ALGORITHMS; n++)
+			free(w[i].divergence[n].second_sq);
+	}
+	free(w);
+	writer_stop(&writer);
+	return NULL;
+}
+
+/******************************** Server ********************************/
+
+// --serve: a long-lived process answering one request per connection on a Unix domain socket, a line such as
+//   remux [-b <blocksize>] [--range start:end] <path>
+//   decode [-a <algorithm>] [--range start:end] <path>
+// where path - means AUD data following the line, until the client shuts down its side of the connection.
+// The answer is "OK <bytes>\n" followed by a WAV file of that size, or "ERROR <message>\n"
+// A client that sends nothing or takes no part of the answer for SERVE_TIMEOUT seconds is answered "ERROR timeout\n" or dropped
+#define SERVE_LINE_MAX   (FILENAME_MAX + 64)
+#define SERVE_DATA_MAX   (64 << 20)  // AUD data sent with a request
+#define SERVE_CACHE_SIZE (256 << 20) // sent data, probed headers, seek indexes and decoded samples kept for the next requests
+#define SERVE_TIMEOUT    10          // seconds, so that idle clients can't hold workers
+
+#ifndef _WIN32
+
+typedef struct SERVE_ENTRY SERVE_ENTRY;
+
+// Cached input: a file, or AUD data sent with a request, shared by all requests of it
+// Files are not kept in memory, each request maps them again, only what was learned from them is cached
+struct SERVE_ENTRY {
+	char *path;     // NULL for data sent with a request
+	uint64_t hash;  // of data sent with a request
+	uint64_t filesize; // of the file when it was probed, or of the data
+	int64_t mtime;     // ns, so that a same-size file rewritten within a second isn't served from stale samples
+	unsigned char *data; // NULL for a file
+	size_t size;
+	AUD_HEADER header; // probed, see AUD_probe_restore()
+	char warning[256]; // of AUD_probe(), empty if none
+	AUD_INDEX index[ADPCM_ALGORITHMS]; // built by the first --range of each algorithm, #1 uses the one of #0
+	short *pcm[ADPCM_ALGORITHMS];      // whole stream decoded by each algorithm, kept after the first whole decode if it fits the cache
+	size_t bytes;  // memory held by all of the above
+	int refs;      // requests using it
+	char evicted;  // no longer in the cache, freed by its last request
+	SERVE_ENTRY *prev; // LRU list, most recently used first
+	SERVE_ENTRY *next;
+};
+
+typedef struct {
+	int fd; // listening socket
+	SERVE_ENTRY *head;
+	SERVE_ENTRY *tail;
+	size_t bytes; // held by the entries in the list
+	pthread_mutex_t mutex; // guards the list and the lazily filled parts of entries
+} SERVER;
+
+// One request, parsed in place from its line
+typedef struct {
+	char decode;
+	int blocksize;
+	int algorithm;
+	const char *range; // NULL for the whole stream
+	const char *path;  // "-" for data following the line
+} SERVE_REQUEST;
+
+void serve_free(SERVE_ENTRY *e) {
+	int a;
+	
+	for (a = 0; a < ADPCM_ALGORITHMS; a++) {
+		AUD_index_free(&e->index[a]);
+		free(e->pcm[a]);
+	}
+	free(e->data);
+	free(e->path);
+	free(e);
+}
+
+// Takes an entry out of the cache, it's freed when no request uses it. Called with the mutex held
+void serve_evict(SERVER *s, SERVE_ENTRY *e) {
+	if (e->prev) e->prev->next = e->next; else s->head = e->next;
+	if (e->next) e->next->prev = e->prev; else s->tail = e->prev;
+	s->bytes -= e->bytes;
+	e->evicted = 1;
+	if (!e->refs)
+		serve_free(e);
+}
+
+// Adds memory held by an entry, least recently used entries are evicted until the cache fits. Called with the mutex held
+void serve_grow(SERVER *s, SERVE_ENTRY *e, size_t bytes) {
+	e->bytes += bytes;
+	if (e->evicted) return;
+	s->bytes += bytes;
+	while ((s->bytes > SERVE_CACHE_SIZE) && s->tail)
+		serve_evict(s, s->tail); // an entry larger than the whole cache only serves its own request
+}
+
+void serve_release(SERVER *s, SERVE_ENTRY *e) {
+	pthread_mutex_lock(&s->mutex);
+	if (!--e->refs && e->evicted)
+		serve_free(e);
+	pthread_mutex_unlock(&s->mutex);
+}
+
+// Writes all of data to the client, returns 0 on success
+int serve_send(WORKER *w, int fd, const void *data, size_t n) {
+	const unsigned char *p = data;
+	ssize_t written;
+	
+	while (n > 0) {
+		if ((written = write(fd, p, n)) < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += written;
+		n -= written;
+		w->stats.bytes_out += written;
+	}
+	return 0;
+}
+
+// Reads the request line into line, returns its length without \n, -1 if the connection ends first or it's too long,
+// or -2 if the client timed out. *len gets the bytes read, AUD data following the line is kept after it
+long serve_read_line(int fd, char *line, size_t size, size_t *len) {
+	char *end;
+	ssize_t n;
+	
+	*len = 0;
+	while (!(end = memchr(line, '\n', *len))) {
+		if (*len == size) return -1;
+		if ((n = read(fd, &line[*len], size - *len)) < 0) {
+			if (errno == EINTR) continue;
+			return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? -2 : -1;
+		}
+		if (n == 0) return -1;
+		*len += n;
+	}
+	*end = 0;
+	if ((end > line) && (end[-1] == '\r'))
+		end[-1] = 0;
+	return end - line;
+}
+
+// Reads the AUD data following a request, head holds what came with the request line
+// Returns NULL on failure with errno set, EAGAIN or EWOULDBLOCK if the client timed out
+unsigned char *serve_read_data(int fd, const char *head, size_t head_len, size_t *size) {
+	unsigned char *data = NULL, *grown;
+	size_t len = head_len, capacity = 1 << 16;
+	ssize_t n;
+	
+	while (capacity < len) capacity *= 2;
+	if (!(data = malloc(capacity))) return NULL;
+	memcpy(data, head, len);
+	while (1) {
+		if (len == capacity) {
+			if ((capacity >= SERVE_DATA_MAX) || !(grown = realloc(data, capacity * 2))) {
+				errno = ENOMEM;
+				break;
+			}
+			data = grown;
+			capacity *= 2;
+		}
+		if ((n = read(fd, &data[len], capacity - len)) < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (n == 0) {
+			*size = len;
+			return data;
+		}
+		len += n;
+	}
+	free(data);
+	return NULL;
+}
+
+char *serve_token(char **p) {
+	char *token;
+	
+	while (**p == ' ') (*p)++;
+	if (!**p) return NULL;
+	token = *p;
+	while (**p && (**p != ' ')) (*p)++;
+	if (**p) *(*p)++ = 0;
+	return token;
+}
+
+// Parses a request line in place, returns 0 if it's valid
+int serve_parse(char *line, SERVE_REQUEST *r) {
+	char *p = line, *option, *value;
+	uint64_t start, end;
+	
+	if (!(option = serve_token(&p)))
+		return -1;
+	if (!strcmp(option, "decode"))
+		r->decode = 1;
+	else if (strcmp(option, "remux"))
+		return -1;
+	
+	// Options, then the path as the rest of the line, so that it may contain spaces
+	
+	while (1) {
+		while (*p == ' ') p++;
+		if (strncmp(p, "-b ", 3) && strncmp(p, "-a ", 3) && strncmp(p, "--range ", 8)) break;
+		option = serve_token(&p);
+		if (!(value = serve_token(&p)))
+			return -1;
+		if (!strcmp(option, "-b")) {
+			r->blocksize = atoi(value);
+			if (!(((r->blocksize >= 4) && (r->blocksize <= 32771)) || (r->blocksize == -1) || (r->blocksize == -2)))
+				return -1;
+		} else if (!strcmp(option, "-a")) {
+			r->algorithm = atoi(value);
+			if ((r->algorithm < 0) || (r->algorithm >= ADPCM_ALGORITHMS))
+				return -1;
+		} else {
+			if (parse_range(value, 1, &start, &end) != 0)
+				return -1;
+			r->range = value;
+		}
+	}
+	r->path = p;
+	return *p ? 0 : -1;
+}
+
+// Opens the input of an entry: its data, or its file. Returns the result of AUD_open_memory() / AUD_open_file(),
+// AUD_ERROR_READ if the file can't be opened. Closed by close_aud()
+int serve_open(WORKER *w, const SERVE_ENTRY *e) {
+	w->aud = NULL;
+	if (e->data)
+		return AUD_open_memory(&w->ctx, e->data, e->size);
+	if (!(w->aud = fopen(e->path, "rb"))) {
+		snprintf(w->ctx.message, sizeof(w->ctx.message), "%s", strerror(errno));
+		return AUD_ERROR_READ;
+	}
+	return AUD_open_file(&w->ctx, w->aud, 0);
+}
+
+// Probes the input of a new entry, returns 0 on success
+int serve_probe(WORKER *w, SERVE_ENTRY *e, const char *name) {
+	AUD_CONTEXT *ctx = &w->ctx;
+	int res;
+	
+	if ((res = serve_open(w, e)) == AUD_OK)
+		res = AUD_probe(ctx);
+	if (res < 0)
+		werror(w, "%s: %s\n", name, ctx->message);
+	else if (res != AUD_OK)
+		snprintf(e->warning, sizeof(e->warning), "%s", ctx->message);
+	e->header = ctx->header;
+	close_aud(w);
+	return res < 0;
+}
+
+// Finds the input of a request in the cache, or reads and probes it. Returns NULL on failure,
+// otherwise the entry is held until serve_release(). head: AUD data that came with the request line
+SERVE_ENTRY *serve_acquire(SERVER *s, WORKER *w, const SERVE_REQUEST *r, int fd, const char *head, size_t head_len, char *hit) {
+	SERVE_ENTRY *e;
+	unsigned char *data = NULL;
+	uint64_t filesize, hash = 0;
+	int64_t mtime = 0;
+	size_t size = 0;
+	HASH h;
+	int sent = !strcmp(r->path, "-");
+	
+	if (sent) {
+		if (!(data = serve_read_data(fd, head, head_len, &size))) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				werror(w, "timeout\n");
+			else
+				werror(w, "-: AUD data can't be read or is larger than %u bytes\n", SERVE_DATA_MAX);
+			return NULL;
+		}
+		hash_init(&h);
+		hash_update(&h, data, size);
+		hash = hash_final(&h);
+		filesize = size;
+	} else if (stamp_file(r->path, &filesize, &mtime)) {
+		werror(w, "Error opening %s: %s\n", r->path, strerror(errno));
+		return NULL;
+	}
+	
+	pthread_mutex_lock(&s->mutex);
+	for (e = s->head; e; e = e->next)
+		if (sent ? (!e->path && (e->hash == hash)) : (e->path && !strcmp(e->path, r->path)))
+			break;
+	if (e && (e->filesize == filesize) && (e->mtime == mtime)) {
+		if (e != s->head) { // most recently used first
+			e->prev->next = e->next;
+			if (e->next) e->next->prev = e->prev; else s->tail = e->prev;
+			e->prev = NULL;
+			e->next = s->head;
+			s->head->prev = e;
+			s->head = e;
+		}
+		e->refs++;
+		pthread_mutex_unlock(&s->mutex);
+		free(data);
+		*hit = 1;
+		return e;
+	}
+	if (e) // file changed since it was read
+		serve_evict(s, e);
+	pthread_mutex_unlock(&s->mutex);
+	
+	// Not cached: probe it, the same input requested by several clients at once may be probed by each of them
+	
+	if (!(e = calloc(1, sizeof(SERVE_ENTRY))) || (!sent && !(e->path = strdup(r->path)))) {
+		werror(w, "Error: not enough memory for %s\n", r->path);
+		free(e);
+		free(data);
+		return NULL;
+	}
+	e->hash = hash;
+	e->filesize = filesize;
+	e->mtime = mtime;
+	e->data = data;
+	e->size = size;
+	if (serve_probe(w, e, r->path)) {
+		serve_free(e);
+		return NULL;
+	}
+	
+	pthread_mutex_lock(&s->mutex);
+	e->refs = 1;
+	e->next = s->head;
+	if (s->head) s->head->prev = e; else s->tail = e;
+	s->head = e;
+	serve_grow(s, e, sizeof(SERVE_ENTRY) + size + (e->path ? strlen(e->path) + 1 : 0));
+	pthread_mutex_unlock(&s->mutex);
+	return e;
+}
+
+// Seek index of an entry for the given algorithm, built by its first request with a range, NULL on failure
+const AUD_INDEX *serve_index(SERVER *s, WORKER *w, SERVE_ENTRY *e, int algorithm, const char *name) {
+	AUD_CONTEXT *ctx = &w->ctx;
+	AUD_INDEX index;
+	int a = (algorithm == 1) ? 0 : algorithm, built;
+	
+	pthread_mutex_lock(&s->mutex);
+	built = (e->index[a].checkpoints != NULL);
+	pthread_mutex_unlock(&s->mutex);
+	if (built)
+		return &e->index[a];
+	
+	if (AUD_index_build(ctx, &index, a) != AUD_OK) {
+		werror(w, "%s: %s\n", name, ctx->message);
+		AUD_index_free(&index);
+		return NULL;
+	}
+	pthread_mutex_lock(&s->mutex);
+	if (e->index[a].checkpoints) { // built by another request meanwhile
+		AUD_index_free(&index);
+	} else {
+		e->index[a] = index;
+		serve_grow(s, e, index.count * sizeof(AUD_CHECKPOINT));
+	}
+	pthread_mutex_unlock(&s->mutex);
+	return &e->index[a];
+}
+
+// Whole stream of an entry decoded by the given algorithm, NULL if it isn't cached and decode = 0, or on failure
+// Needs a context without a range
+const short *serve_pcm(SERVER *s, WORKER *w, SERVE_ENTRY *e, int algorithm, const char *name, int decode) {
+	AUD_CONTEXT *ctx = &w->ctx;
+	uint64_t done = 0, n = e->header.num_samples;
+	short *pcm;
+	long size = 0;
+	
+	pthread_mutex_lock(&s->mutex);
+	pcm = e->pcm[algorithm];
+	pthread_mutex_unlock(&s->mutex);
+	if (pcm || !decode)
+		return pcm;
+	
+	if (!(pcm = malloc(n * 2 + 1))) {
+		werror(w, "Error: not enough memory to decode %s\n", name);
+		return NULL;
+	}
+	if (AUD_rewind(ctx, algorithm) == AUD_OK)
+		while ((done < n) && ((size = AUD_decode(ctx, &pcm[done], n - done)) > 0))
+			done += size;
+	if (done < n) {
+		werror(w, "%s: %s\n", name, (size < 0) ? ctx->message : "stream ended early");
+		free(pcm);
+		return NULL;
+	}
+	pthread_mutex_lock(&s->mutex);
+	if (e->pcm[algorithm]) { // decoded by another request meanwhile
+		free(pcm);
+		pcm = e->pcm[algorithm];
+	} else {
+		e->pcm[algorithm] = pcm;
+		serve_grow(s, e, n * 2);
+	}
+	pthread_mutex_unlock(&s->mutex);
+	return pcm;
+}
+
+// Sends the WAV file a request asks for, returns 0 on success, 1 if nothing was sent, -1 if the answer was cut short
+// Whole streams that fit the cache are decoded once and kept, later requests of them and of their ranges are copies
+int serve_answer(SERVER *s, WORKER *w, SERVE_ENTRY *e, const SERVE_REQUEST *r, int fd) {
+	AUD_CONTEXT *ctx = &w->ctx;
+	const AUD_INDEX *index;
+	const short *pcm = NULL;
+	WAV_HEADER_PCM wav_header_pcm;
+	WAV_HEADER_ADPCM wav_header_adpcm;
+	unsigned char header[WAV_HEADER_MAX_SIZE];
+	uint32_t header_size;
+	char line[32];
+	uint64_t start, end, samples, done = 0;
+	int algorithm = r->decode ? r->algorithm : 0;
+	int keep = r->decode && !r->range && (e->header.num_samples * 2 <= SERVE_CACHE_SIZE);
+	long size;
+	
+	if ((serve_open(w, e) != AUD_OK) || (AUD_probe_restore(ctx, &e->header) != AUD_OK)) {
+		werror(w, "%s: %s\n", r->path, ctx->message);
+		return 1;
+	}
+	// A whole stream is decoded and kept, a range is copied from it only if it's already there
+	if (r->decode && !(pcm = serve_pcm(s, w, e, algorithm, r->path, keep)) && keep)
+		return 1;
+	start = 0;
+	end = e->header.num_samples;
+	if (r->range) {
+		parse_range(r->range, e->header.samplerate, &start, &end); // syntax checked by serve_parse()
+		if (end > e->header.num_samples)
+			end = e->header.num_samples;
+		if (start >= end) {
+			werror(w, "%s: range %llu..%llu is empty, stream has %llu samples\n", r->path,
+			       (unsigned long long)start, (unsigned long long)end, (unsigned long long)e->header.num_samples);
+			return 1;
+		}
+		if (!pcm) {
+			if (!(index = serve_index(s, w, e, algorithm, r->path)))
+				return 1;
+			if (AUD_set_range(ctx, index, start, end) != AUD_OK) {
+				werror(w, "%s: %s\n", r->path, ctx->message);
+				return 1;
+			}
+		}
+	}
+	if (r->decode && !pcm && (AUD_rewind(ctx, algorithm) != AUD_OK)) {
+		werror(w, "%s: %s\n", r->path, ctx->message);
+		return 1;
+	}
+	samples = end - start;
+	
+	if (r->decode) {
+		WAV_header_pcm(&wav_header_pcm, e->header.samplerate, samples * 2);
+		header_size = WAV_write_header_pcm(&wav_header_pcm, header);
+		snprintf(line, sizeof(line), "OK %llu\n", (unsigned long long)header_size + samples * 2);
+		if (serve_send(w, fd, line, strlen(line)) || serve_send(w, fd, header, header_size))
+			return -1;
+		if (pcm)
+			return serve_send(w, fd, &pcm[start], samples * 2) ? -1 : 0;
+		while ((done < samples) && ((size = AUD_decode(ctx, (short *)w->out_buffer, sizeof(w->out_buffer) / 2)) > 0)) {
+			if (serve_send(w, fd, w->out_buffer, size * 2))
+				return -1;
+			done += size;
+		}
+		return (done == samples) ? 0 : -1;
+	}
+	
+	if (AUD_remux_begin(ctx, r->blocksize) < 0) {
+		werror(w, "%s: %s\n", r->path, ctx->message);
+		return 1;
+	}
+	w->stats.blocksize = ctx->wav_blocksize + 4;
+	WAV_header_adpcm(&wav_header_adpcm, e->header.samplerate, ctx->wav_blocksize, samples, ctx->wav_datalen);
+	header_size = WAV_write_header_adpcm(&wav_header_adpcm, header);
+	snprintf(line, sizeof(line), "OK %llu\n", (unsigned long long)header_size + ctx->wav_datalen);
+	if (serve_send(w, fd, line, strlen(line)) || serve_send(w, fd, header, header_size))
+		return -1;
+	while ((size = AUD_remux(ctx, w->out_buffer, sizeof(w->out_buffer))) > 0) {
+		if (serve_send(w, fd, w->out_buffer, size))
+			return -1;
+		done += size;
+	}
+	return (done == ctx->wav_datalen) ? 0 : -1;
+}
+
+// Answers the request of one connection, closed by the caller
+void serve_connection(SERVER *s, WORKER *w, int fd) {
+	SERVE_REQUEST r = { 0, 512, 0, NULL, NULL };
+	SERVE_ENTRY *e;
+	char line[SERVE_LINE_MAX], answer[sizeof(w->stats.error) + 8];
+	size_t len;
+	long n;
+	char hit = 0;
+	int res = 1;
+	
+	memset(&w->stats, 0, sizeof(STATS));
+	w->stats.start = now();
+	if ((n = serve_read_line(fd, line, sizeof(line), &len)) == -2) {
+		werror(w, "timeout\n");
+	} else if (n < 0) {
+		if (len < sizeof(line))
+			return; // the connection ended before a whole line, nobody to answer
+		werror(w, "Invalid request, longer than %u bytes\n", SERVE_LINE_MAX);
+	} else if (serve_parse(line, &r) != 0) {
+		werror(w, "Invalid request, expected: remux|decode [-b <blocksize>] [-a <algorithm>] [--range start:end] <path>|-\n");
+		r.path = NULL;
+	} else if ((e = serve_acquire(s, w, &r, fd, &line[n + 1], len - n - 1, &hit))) {
+		if (e->warning[0])
+			wlog(w, "%s: %s\n", r.path, e->warning);
+		res = serve_answer(s, w, e, &r, fd);
+		close_aud(w);
+		serve_release(s, e);
+	}
+	if (res > 0) {
+		snprintf(answer, sizeof(answer), "ERROR %s\n", w->stats.error);
+		serve_send(w, fd, answer, strlen(answer));
+	}
+	
+	if (r.path)
+		wlog(w, "%s %d%s%s %s: %s, %llu bytes in %.3f ms%s\n", r.decode ? "decode -a" : "remux -b", r.decode ? r.algorithm : r.blocksize,
+		     r.range ? " --range " : "", r.range ? r.range : "", r.path,
+		     !res ? "sent" : (res > 0) ? "failed" : "cut short", (unsigned long long)w->stats.bytes_out, (now() - w->stats.start) * 1000, hit ? ", cached" : "");
+	wlog_flush(w);
+}
+
+void *serve_thread(void *arg) {
+	SERVER *s = arg;
+	WORKER *w = calloc(1, sizeof(WORKER));
+	struct timeval timeout = { SERVE_TIMEOUT, 0 };
+	int fd;
+	
+	if (!w) {
+		pthread_mutex_lock(&stderr_mutex);
+		fprintf(stderr, "Error: not enough memory for worker state\n");
+		pthread_mutex_unlock(&stderr_mutex);
+		return NULL;
+	}
+	w->buffered = 1;
+	while (1) {
+		if ((fd = accept(s->fd, NULL, NULL)) < 0) {
+			if ((errno == EINTR) || (errno == ECONNABORTED)) continue;
+			pthread_mutex_lock(&stderr_mutex);
+			fprintf(stderr, "Error accepting a connection: %s\n", strerror(errno));
+			pthread_mutex_unlock(&stderr_mutex);
+			break;
+		}
+		// Every read or write waiting longer fails with EAGAIN
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		serve_connection(s, w, fd);
+		close(fd);
+	}
+	free(w->log);
+	free(w);
+	return NULL;
+}
+
+// Answers requests on a Unix domain socket with opt->jobs workers until the process is killed
+// Returns 1 if the socket can't be created or every worker has failed
+int serve(const OPTIONS *opt, const char *path) {
+	SERVER s;
+	struct sockaddr_un addr;
+	struct stat st;
+	pthread_t *threads;
+	int t, started = 0;
+	
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Error: socket path %s is too long\n", path);
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if ((stat(path, &st) == 0) && S_ISSOCK(st.st_mode))
+		unlink(path); // left behind by an earlier server
+	if (((s.fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) || bind(s.fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(s.fd, SOMAXCONN)) {
+		fprintf(stderr, "Error listening on %s: %s\n", path, strerror(errno));
+		if (s.fd >= 0) close(s.fd);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN); // a client hanging up only cuts its own answer short
+	s.head = s.tail = NULL;
+	s.bytes = 0;
+	pthread_mutex_init(&s.mutex, NULL);
+	fprintf(stderr, "Serving requests on %s with %d workers, cache of %u MB\n", path, opt->jobs, SERVE_CACHE_SIZE >> 20);
+	
+	threads = malloc(opt->jobs * sizeof(pthread_t));
+	if (threads)
+		for (t = 0; t < opt->jobs; t++)
+			if (pthread_create(&threads[started], NULL, serve_thread, &s) == 0)
+				started++;
+	if (!started)
+		serve_thread(&s); // couldn't start any threads, do it ourselves
+	for (t = 0; t < started; t++)
+		pthread_join(threads[t], NULL);
+	free(threads);
+	
+	close(s.fd);
+	unlink(path);
+	while (s.head)
+		serve_evict(&s, s.head);
+	pthread_mutex_destroy(&s.mutex);
+	return 1;
+}
+
+#else
+
+int serve(const OPTIONS *opt, const char *path) {
+	fprintf(stderr, "Error: --serve needs Unix domain sockets, not supported on this platform\n");
+	return 1;
+}
+
+#endif
+
+
+
+/******************************** Watch folder ********************************/
+
+// --watch: files are converted as soon as they are written into a directory, by the workers of the pool
+// inotify reports a file when it is closed after writing or renamed into the directory, so it's complete
+#define WATCH_QUIET_MS 5    // a burst of files is handed to the workers once no more arrived for this long
+#define WATCH_BURST_MS 50   // or this long after its first file, if it goes on
+
+#ifdef __linux__
+
+// Whether a file written into the watched directory can be an input: not hidden (temporary files of editors and rsync),
+// and not one of the outputs or seek indexes written there
+int watch_wanted(const OPTIONS *opt, const char *name) {
+	const char *ext = strrchr(name, '.');
+	
+	if (name[0] == '.') return 0;
+	if (opt->encode)
+		return ext && (stricmp(ext, ".wav") == 0);
+	return !ext || ((stricmp(ext, ".wav") != 0) && (stricmp(ext, ".idx") != 0) && (stricmp(ext, ".tmp") != 0));
+}
+
+// Whether a file has an AUD header, other kinds of files written into the watched directory are left alone
+int watch_is_aud(AUD_CONTEXT *ctx, const char *path) {
+	FILE *f = fopen(path, "rb");
+	int res;
+	
+	if (!f) return 0; // already deleted or moved
+	res = AUD_open_file(ctx, f, 0);
+	AUD_close(ctx);
+	fclose(f);
+	return res != AUD_ERROR_FORMAT;
+}
+
+// Returns the inotify descriptor, -1 if dir can't be watched
+int watch_open(const char *dir) {
+	int fd = inotify_init1(IN_CLOEXEC);
+	
+	if ((fd < 0) || (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR) < 0)) {
+		fprintf(stderr, "Error watching %s: %s\n", dir, strerror(errno));
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Hands the files of a burst to the workers, except the ones still waiting for a worker
+// Returns number of errors: MIX archives that can't be read
+int watch_queue(POOL *pool, INPUTS *in, char **names, int count, AUD_CONTEXT *ctx) {
+	int i, k, errors = 0;
+	
+	for (i = k = 0; i < count; i++) // headers are read before the workers are held up
+		if (pool->opt->encode || mix_filename_length(names[i]) || watch_is_aud(ctx, names[i]))
+			names[k++] = names[i];
+		else
+			free(names[i]);
+	count = k;
+	
+	pthread_mutex_lock(&pool->mutex);
+	for (i = 0; i < count; i++) {
+		for (k = pool->next; (k < in->count) && strcmp(in->files[k], names[i]); k++);
+		if (k < in->count) {
+			free(names[i]);
+		} else if (pool->opt->encode || !mix_filename_length(names[i])) {
+			if (add_input(in, names[i], NULL, NULL) != 0) {
+				pthread_mutex_lock(&stderr_mutex);
+				fprintf(stderr, "Error: not enough memory for %s\n", names[i]);
+				pthread_mutex_unlock(&stderr_mutex);
+				free(names[i]);
+				errors++;
+			}
+		} else {
+			pthread_mutex_lock(&stderr_mutex);
+			errors += add_archive(in, names[i], ctx, pool->opt->probe);
+			pthread_mutex_unlock(&stderr_mutex);
+			free(names[i]);
+		}
+	}
+	pool->files = in->files;
+	pool->entries = in->entries;
+	pool->count = in->count;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+	return errors;
+}
+
+// Queues the files written into dir for the workers until dir is deleted or moved, fd from watch_open()
+// Each file is queued once per burst, and not again while it's still waiting for a worker
+// Returns number of errors
+int watch(POOL *pool, INPUTS *in, int fd, const char *dir) {
+	union {
+		struct inotify_event event; // aligns the buffer
+		char buf[4096];
+	} u;
+	const struct inotify_event *e;
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	AUD_CONTEXT *ctx = malloc(sizeof(AUD_CONTEXT)); // MIX entry detection
+	char **names = NULL, **grown, *path;
+	int i, res, count = 0, size = 0, gone = 0, errors = 0;
+	size_t dir_len = strlen(dir);
+	double first = 0; // when the burst started
+	ssize_t len;
+	
+	if (!ctx) {
+		fprintf(stderr, "Error: not enough memory for watching %s\n", dir);
+		close(fd);
+		return 1;
+	}
+	while (dir_len > 1 && (dir[dir_len - 1] == '/')) dir_len--;
+	while (!gone) {
+		res = poll(&pfd, 1, count ? WATCH_QUIET_MS : -1);
+		if ((res < 0) && (errno != EINTR)) {
+			fprintf(stderr, "Error watching %s: %s\n", dir, strerror(errno));
+			errors++;
+			break;
+		}
+		if ((res > 0) && ((len = read(fd, u.buf, sizeof(u.buf))) > 0)) {
+			for (i = 0; i < len; i += sizeof(struct inotify_event) + e->len) {
+				e = (const struct inotify_event *)&u.buf[i];
+				if (e->mask & IN_Q_OVERFLOW) {
+					pthread_mutex_lock(&stderr_mutex);
+					fprintf(stderr, "Warning: too many files at once in %s, some of them were missed\n", dir);
+					pthread_mutex_unlock(&stderr_mutex);
+				}
+				if (e->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+					gone = 1;
+				if ((e->mask & IN_ISDIR) || !e->len || !watch_wanted(pool->opt, e->name))
+					continue;
+				if (!(path = malloc(dir_len + 1 + strlen(e->name) + 1))) continue;
+				sprintf(path, "%.*s/%s", (int)dir_len, dir, e->name);
+				for (res = 0; (res < count) && strcmp(names[res], path); res++);
+				if ((res < count) && (e->mask & (IN_MOVED_FROM | IN_DELETE))) { // a temporary file, renamed or deleted in the same burst
+					free(names[res]);
+					memmove(&names[res], &names[res + 1], (--count - res) * sizeof(char *));
+				}
+				if ((res < count) || !(e->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))) { // written again in the same burst
+					free(path);
+					continue;
+				}
+				if ((count == size) && (grown = realloc(names, (size ? size * 2 : 64) * sizeof(char *)))) {
+					names = grown;
+					size = size ? size * 2 : 64;
+				}
+				if (count == size) {
+					free(path);
+					continue;
+				}
+				if (!count) first = now();
+				names[count++] = path;
+			}
+			if (count && !gone && ((now() - first) * 1000 < WATCH_BURST_MS)) continue;
+		}
+		if (count && (res >= 0)) {
+			errors += watch_queue(pool, in, names, count, ctx);
+			count = 0;
+		}
+	}
+	
+	if (gone) {
+		pthread_mutex_lock(&stderr_mutex);
+		fprintf(stderr, "\n%s was deleted or moved, no longer watching it\n", dir);
+		pthread_mutex_unlock(&stderr_mutex);
+	}
+	for (i = 0; i < count; i++)
+		free(names[i]);
+	free(names);
+	free(ctx);
+	close(fd);
+	return errors;
+}
+
+#else
+
+int watch_open(const char *dir) {
+	fprintf(stderr, "Error: --watch needs inotify, not supported on this platform\n");
+	return -1;
+}
+
+int watch(POOL *pool, INPUTS *in, int fd, const char *dir) {
+	return 0;
+}
+
+#endif
+
+
+
+int main(int argc, char *argv[]) {
+	
+	// Default values for command-line input
+	char *ofilename = 0;
+	const char *socket_path = NULL; // --serve
+	const char *watch_dir = NULL;   // --watch
+	int watch_fd = -1;
+	OPTIONS opt = { 512, 0, 0, 0, 1, 0, 0, 1, NULL, NULL, 0, NULL, 0, AUD_ENCODE_GREEDY, 0, { 0 }, 0, AUD_RESAMPLE_GOOD, 0 };
+	INPUTS inputs;
+	CACHE cache;
+	AUD_CONTEXT *ctx = NULL;
+	int missing = 0; // archives and archive entries that couldn't be found
+	POOL pool;
+	pthread_t *threads;
+	double wall;
+	int t, started;
+	
+	// Parse command-line arguments
+	static const struct option long_options[] = {
+		{ "range",  required_argument, NULL, 'R' },
+		{ "report", no_argument,       NULL, 'C' },
+		{ "stats",  required_argument, NULL, 'S' },
+		{ "probe",  required_argument, NULL, 'P' },
+		{ "verify", no_argument,       NULL, 'V' },
+		{ "cache",  required_argument, NULL, 'K' },
+		{ "encode", required_argument, NULL, 'e' },
+		{ "outputs", required_argument, NULL, 'O' },
+		{ "serve",  required_argument, NULL, 'L' },
+		{ "watch",  required_argument, NULL, 'W' },
+		{ "rate",   required_argument, NULL, 'T' },
+		{ "analyze", no_argument,      NULL, 'A' },
+		{ "help",   no_argument,       NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	uint64_t start, end;
+	int c;
+	while ((c = getopt_long(argc, argv, "ho:b:d4e:j:s", long_options, NULL)) != -1)
+		switch (c) {
+			case 'o': // output filename
+				ofilename = optarg;
+				break;
+			
+			case 'b': // blocksize
+				c = atoi(optarg);
+				if (((c >= 4) && (c <= 32771)) || (c == -1) || (c == -2)) {
+					opt.blocksize = c;
+				} else
+					fprintf(stderr, "Invalid blocksize specified: %d. Parameter ignored.\n", c);
+				break;
+			
+			case 'd': // decode
+				opt.decode = 1;
+				break;
+			
+			case '4': // decode x4
+				opt.decode = 1;
+				opt.algo_last = 3;
+				break;
+			
+			case 'e': // encode greedy|trellis
+				if (stricmp(optarg, "greedy") == 0) {
+					opt.encode = 1;
+					opt.encode_mode = AUD_ENCODE_GREEDY;
+				} else if (stricmp(optarg, "trellis") == 0) {
+					opt.encode = 1;
+					opt.encode_mode = AUD_ENCODE_TRELLIS;
+				} else
+					fprintf(stderr, "Invalid encoder specified: %s. Parameter ignored.\n", optarg);
+				break;
+			
+			case 'O': // --outputs pcm,512,-1...
+				if (parse_outputs(optarg, &opt) != 0)
+					fprintf(stderr, "Invalid outputs specified: %s. Parameter ignored.\n", optarg);
+				break;
+			
+			case 'j': // parallel jobs
+				c = atoi(optarg);
+				if (c >= 0) {
+					opt.jobs = c;
+				} else
+					fprintf(stderr, "Invalid number of jobs specified: %d. Parameter ignored.\n", c);
+				break;
+			
+			case 's': // single pass
+				opt.stream = 1;
+				break;
+			
+			case 'C': // --report
+				opt.decode = 1;
+				opt.report = 1;
+				break;
+			
+			case 'R': // --range start:end
+				if (parse_range(optarg, 1, &start, &end) == 0) {
+					opt.range = optarg;
+				} else
+					fprintf(stderr, "Invalid range specified: %s. Parameter ignored.\n", optarg);
+				break;
+			
+			case 'P': // --probe csv|json
+				if (stricmp(optarg, "csv") == 0) {
+					opt.probe = PROBE_CSV;
+				} else if (stricmp(optarg, "json") == 0) {
+					opt.probe = PROBE_JSON;
+				} else
+					fprintf(stderr, "Invalid probe format specified: %s. Parameter ignored.\n", optarg);
+				break;
+			
+			case 'V': // --verify
+				opt.verify = 1;
+				break;
+			
+			case 'K': // --cache filename
+				opt.cache = optarg;
+				break;
+			
+			case 'L': // --serve socket
+				socket_path = optarg;
+				break;
+			
+			case 'W': // --watch directory
+				watch_dir = optarg;
+				break;
+			
+			case 'T': // --rate Hz[,fast|good|best]
+				if (parse_rate(optarg, &opt) != 0)
+					fprintf(stderr, "Invalid rate specified: %s. Parameter ignored.\n", optarg);
+				break;
+			
+			case 'A': // --analyze
+				opt.analyze = 1;
+				break;
+			
+			case 'S': // --stats filename
+				if (opt.stats && (opt.stats != stdout))
+					fclose(opt.stats);
+				if (!(opt.stats = strcmp(optarg, "-") ? fopen(optarg, "a") : stdout))
+					fprintf(stderr, "Error creating %s: %s. Parameter ignored.\n", optarg, strerror(errno));
+				break;
+			
+			default: // 'h', '?'
+				usage(argv[0]);
+		}
+	
+	if (argc == 1) // zero arguments passed
+		usage(argv[0]);
+	if (opt.report && opt.range) {
+		fprintf(stderr, "--report always covers whole streams, --range ignored.\n");
+		opt.range = NULL;
+	}
+	if (opt.encode && (opt.decode || opt.probe || opt.range || opt.verify)) {
+		fprintf(stderr, "-e encodes whole WAV files and always decodes them back, -d, -4, --report, --probe, --range and --verify ignored.\n");
+		opt.decode = opt.algo_last = opt.report = opt.probe = opt.verify = 0;
+		opt.range = NULL;
+	}
+	if (opt.outputs && (opt.encode || opt.algo_last || opt.report || opt.probe)) {
+		fprintf(stderr, "--outputs can't be combined with -e, -4, --report or --probe, ignored.\n");
+		opt.outputs = 0;
+	}
+	if (opt.outputs && (opt.decode || ofilename || opt.verify)) {
+		fprintf(stderr, "--outputs names every output and decodes the stream once, -d, -o and --verify ignored.\n");
+		opt.decode = opt.verify = 0;
+		ofilename = NULL;
+	}
+	if (opt.rate && (!opt.decode || opt.algo_last || opt.report || opt.probe)) {
+		fprintf(stderr, "--rate only resamples the output of -d, ignored when remuxing and with -e, -4, --outputs, --report and --probe.\n");
+		opt.rate = 0;
+	}
+	if (opt.analyze && (opt.encode || opt.algo_last || opt.report || opt.probe)) {
+		fprintf(stderr, "--analyze measures the stream while it's remuxed or decoded, ignored with -e, -4, --report and --probe.\n");
+		opt.analyze = 0;
+	}
+	if (opt.verify && (opt.decode || opt.probe)) {
+		fprintf(stderr, "--verify only checks remuxed WAV files, ignored.\n");
+		opt.verify = 0;
+	}
+	if (opt.cache && (opt.probe || opt.report)) {
+		fprintf(stderr, "--cache only skips conversions, ignored with --probe and --report.\n");
+		opt.cache = NULL;
+	}
+	
+	if (socket_path) {
+		if ((optind < argc) || ofilename || opt.decode || opt.encode || opt.outputs || opt.probe || opt.range || opt.verify || opt.cache || opt.stats || opt.rate || opt.analyze || watch_dir)
+			fprintf(stderr, "--serve takes the mode, block size, algorithm and range of each request, input files and other options ignored.\n");
+		if (opt.jobs == 0) {
+			long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+			opt.jobs = (cpus > 0) ? cpus : 1;
+		}
+		return serve(&opt, socket_path);
+	}
+	if (watch_dir) {
+		if (ofilename) {
+			fprintf(stderr, "--watch names every output after its input, -o ignored.\n");
+			ofilename = NULL;
+		}
+		// Watched before the inputs are read, so that files written meanwhile aren't missed
+		if ((watch_fd = watch_open(watch_dir)) < 0)
+			return 1;
+	}
+
+#ifdef _WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	
+	// Expand MIX archives into their entries
+	
+	memset(&inputs, 0, sizeof(INPUTS));
+	for (t = optind; t < argc; t++) {
+		if (opt.encode || !mix_filename_length(argv[t])) {
+			missing += add_input(&inputs, argv[t], NULL, NULL);
+			continue;
+		}
+		if (!ctx && !(ctx = malloc(sizeof(AUD_CONTEXT)))) {
+			fprintf(stderr, "Error: not enough memory for %s\n", argv[t]);
+			missing++;
+			continue;
+		}
+		missing += add_archive(&inputs, argv[t], ctx, opt.probe);
+	}
+	free(ctx);
+	inputs.args = inputs.count;
+	
+	pool.opt = &opt;
+	pool.files = inputs.files;
+	pool.entries = inputs.entries;
+	pool.count = inputs.count;
+	pool.ofilename = ofilename;
+	pool.next = 0;
+	pool.failed = 0;
+	pool.cache = (opt.cache && (cache_open(&cache, &opt, opt.cache) == 0)) ? &cache : NULL;
+	if (pool.cache)
+		cache.recent = (watch_fd >= 0);
+	pool.cached = 0;
+	pool.reported = 0;
+	memset(pool.diverged, 0, sizeof(pool.diverged));
+	memset(pool.max_error, 0, sizeof(pool.max_error));
+	pool.bytes_in = 0;
+	pool.bytes_out = 0;
+	pool.samples = 0;
+	pool.slowest = 0;
+	pool.slowest_file = NULL;
+	pool.watching = (watch_fd >= 0);
+	pthread_mutex_init(&pool.mutex, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+	
+	if (opt.jobs == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		opt.jobs = (cpus > 0) ? cpus : 1;
+	}
+	if ((pool.count > 0) && (opt.jobs > pool.count) && !pool.watching) {
+		// Spare jobs split the files themselves
+		opt.threads = opt.jobs / pool.count;
+		opt.jobs = pool.count;
+	}
+	
+	// Loop through all input files
+	
+	if (opt.probe == PROBE_CSV)
+		printf("%s\n", PROBE_CSV_HEADER);
+	wall = now();
+	if ((opt.jobs <= 1) && !pool.watching) {
+		worker_thread(&pool);
+	} else {
+		threads = malloc(opt.jobs * sizeof(pthread_t));
+		started = 0;
+		if (threads)
+			for (t = 0; t < opt.jobs; t++)
+				if (pthread_create(&threads[started], NULL, worker_thread, &pool) == 0)
+					started++;
+		if (started && pool.watching) {
+			// This thread watches, the workers convert until the directory is gone
+			fprintf(stderr, "Watching %s with %d workers\n", watch_dir, started);
+			missing += watch(&pool, &inputs, watch_fd, watch_dir);
+			pthread_mutex_lock(&pool.mutex);
+			pool.watching = 0;
+			pthread_cond_broadcast(&pool.cond);
+			pthread_mutex_unlock(&pool.mutex);
+		} else if (!started) {
+			if (pool.watching) {
+				fprintf(stderr, "Error: couldn't start workers for --watch, converting the listed files only\n");
+				close(watch_fd);
+				pool.watching = 0;
+				missing++;
+			}
+			worker_thread(&pool); // couldn't start any threads, do it ourselves
+		}
+		for (t = 0; t < started; t++)
+			pthread_join(threads[t], NULL);
+		free(threads);
+	}
+	
+	// Archives and entries that couldn't be found count as failed files
+	pool.count += missing;
+	pool.failed += missing;
+	
+	if (pool.cache) {
+		cache_close(pool.cache);
+		if (pool.count > 1)
+			fprintf(stderr, "\nConverted %d of %d files, %d unchanged, %d failed\n", pool.count - pool.cached - pool.failed, pool.count, pool.cached, pool.failed);
+	} else if (pool.count > 1)
+		fprintf(stderr, "\n%s %d of %d files, %d failed\n", opt.probe ? "Probed" : "Converted", pool.count - pool.failed, pool.count, pool.failed);
+	if (opt.report && (pool.reported > 1))
+		for (t = 1; t < ADPCM_ALGORITHMS; t++)
+			fprintf(stderr, "Algorithm #%d: diverged from #0 in %d of %d files, max error %u\n", t, pool.diverged[t], pool.reported, pool.max_error[t]);
+	
+	if (opt.stats) {
+		wall = now() - wall;
+		fprintf(opt.stats, "{\"summary\":true,\"files\":%d,\"failed\":%d,\"jobs\":%d,\"bytes_in\":%llu,\"bytes_out\":%llu,\"samples\":%llu,\"wall_ms\":%.3f",
+		        pool.count, pool.failed, opt.jobs * opt.threads, (unsigned long long)pool.bytes_in, (unsigned long long)pool.bytes_out, (unsigned long long)pool.samples, wall * 1000);
+		if (pool.cache)
+			fprintf(opt.stats, ",\"cached\":%d", pool.cached);
+		if (wall > 0)
+			fprintf(opt.stats, ",\"samples_per_sec\":%.0f", pool.samples / wall);
+		if (pool.slowest_file) {
+			fprintf(opt.stats, ",\"slowest_file\":");
+			json_string(opt.stats, pool.slowest_file);
+			fprintf(opt.stats, ",\"slowest_ms\":%.3f", pool.slowest * 1000);
+		}
+		fprintf(opt.stats, "}\n");
+		if (opt.stats != stdout)
+			fclose(opt.stats);
+		else
+			fflush(stdout);
+	}
+	
+	free_inputs(&inputs);
+	return pool.failed ? 1 : 0;
+}
@@ -0,0 +1,795 @@
+// audbench
+
+// Throughput benchmark and regression check for audlib: generates synthetic AUD streams,
+// times scanning, decoding, remuxing, resampling, analyzing and encoding them with and without file I/O,
+// and compares the output with known checksums, also reading them back from MIX archives
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h> // sqrt
+#include <time.h>
+#include <unistd.h> // optarg, sysconf
+
+#include "audlib.h"
+
+
+
+/******************************** Synthetic streams ********************************/
+
+#define KIND_TONE  0 // music-like, encoded sum of two tones with a bit of noise
+#define KIND_NOISE 1 // random nibbles, index jumps around and often hits the rails
+#define KIND_RAILS 2 // pathological, long runs of maximum steps, every sample is clamped
+
+const char *kind_names[] = { "tone", "noise", "rails" };
+
+uint32_t random_state;
+
+uint32_t random32(void) {
+	// xorshift32, same sequence on every platform
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 17;
+	random_state ^= random_state << 5;
+	return random_state;
+}
+
+// Integer approximation of 32767 * sin(phase * 2 * pi / 65536), identical on every platform
+int32_t tone(uint32_t phase) {
+	int32_t x = phase & 0x7FFF;
+	int32_t y = (x * (32768 - x)) >> 13; // parabola, 0..32768
+	
+	if (y > 32767) y = 32767;
+	return (phase & 0x8000) ? -y : y;
+}
+
+// Nibble closest to the next sample, decoder state is advanced with it
+unsigned char encode_sample(char *index, long *sample, long target) {
+	int diff = target - *sample;
+	int step = ADPCM_STEP_TABLE[(int)*index];
+	unsigned char nibble = 0;
+	
+	if (diff < 0) {
+		nibble = 8;
+		diff = -diff;
+	}
+	if (diff >= step) { nibble |= 4; diff -= step; }
+	if (diff >= step / 2) { nibble |= 2; diff -= step / 2; }
+	if (diff >= step / 4) nibble |= 1;
+	ADPCM_decode_sample(0, index, sample, nibble);
+	return nibble;
+}
+
+// Builds a complete AUD file in memory, block_size is ADPCM bytes per AUD block
+unsigned char *make_aud(int format, int kind, uint32_t samples, uint32_t block_size, size_t *size) {
+	uint32_t bytes = (samples + 1) / 2;
+	uint32_t blocks = (bytes + block_size - 1) / block_size;
+	uint32_t header_size = (format == AUD_FORMAT_NEW) ? AUD_HEADER_NEW_SIZE : AUD_HEADER_OLD_SIZE;
+	uint32_t encsize = bytes + blocks * AUD_BLOCK_HEADER_SIZE;
+	unsigned char *aud, *p, *data;
+	uint32_t i, b, n;
+	unsigned char nibble;
+	char index = 0;
+	long sample = 0;
+	
+	*size = header_size + encsize;
+	if (!(aud = calloc(1, *size)))
+		return NULL;
+	random_state = 2463534242u + kind;
+	
+	// ADPCM data first, at its final place after each block header
+	
+	for (i = 0; i < samples; i++) {
+		switch (kind) {
+			case KIND_TONE:
+				nibble = encode_sample(&index, &sample, tone(i * 323) * 12 / 32 + tone(i * 1803) * 6 / 32 + (int)(random32() % 2001) - 1000);
+				break;
+			case KIND_NOISE:
+				nibble = random32() & 0xF;
+				break;
+			default:
+				nibble = ((i / 3000) & 1) ? 15 : 7;
+		}
+		b = (i / 2) / block_size;
+		data = &aud[header_size + (b + 1) * AUD_BLOCK_HEADER_SIZE + i / 2];
+		*data |= (i & 1) ? (nibble << 4) : nibble;
+	}
+	
+	// Headers, little-endian
+	
+	p = aud;
+	p[0] = 22050 & 0xFF;
+	p[1] = 22050 >> 8;
+	for (i = 0; i < 4; i++)
+		p[2 + i] = encsize >> (i * 8);
+	if (format == AUD_FORMAT_NEW) {
+		for (i = 0; i < 4; i++)
+			p[6 + i] = (bytes * 4) >> (i * 8);
+		p += 4;
+	}
+	p[6] = 2;  // mono, 16-bit
+	p[7] = 99; // IMA ADPCM
+	
+	p = &aud[header_size];
+	for (b = 0; b < blocks; b++) {
+		n = (b + 1 < blocks) ? block_size : bytes - b * block_size;
+		p[0] = n & 0xFF;
+		p[1] = n >> 8;
+		p[2] = (n * 4) & 0xFF;
+		p[3] = (n * 4) >> 8;
+		p[4] = 0xAF;
+		p[5] = 0xDE;
+		p += AUD_BLOCK_HEADER_SIZE + n;
+	}
+	return aud;
+}
+
+
+
+/******************************** Output sinks ********************************/
+
+// Where the output of a test goes: nowhere, to a file, or into a checksum
+typedef struct {
+	FILE *file;
+	uint32_t checksum; // FNV-1a
+	char check;
+} SINK;
+
+void sink_write(SINK *sink, const void *data, size_t size) {
+	const unsigned char *p = data;
+	size_t i;
+	
+	if (sink->file)
+		fwrite(data, 1, size, sink->file);
+	if (sink->check)
+		for (i = 0; i < size; i++)
+			sink->checksum = (sink->checksum ^ p[i]) * 16777619u;
+}
+
+void sink_pcm(SINK *sink, const short *pcm, size_t samples) {
+	unsigned char buf[4096];
+	size_t i, n;
+	
+	if (!sink->check && !sink->file)
+		return;
+	// Checksums are of little-endian data, as written to a WAV file
+	while (samples) {
+		n = (samples > sizeof(buf) / 2) ? sizeof(buf) / 2 : samples;
+		for (i = 0; i < n; i++) {
+			buf[i * 2] = pcm[i] & 0xFF;
+			buf[i * 2 + 1] = (pcm[i] >> 8) & 0xFF;
+		}
+		sink_write(sink, buf, n * 2);
+		pcm += n;
+		samples -= n;
+	}
+}
+
+
+
+/******************************** Tests ********************************/
+
+#define TEST_SCAN     0
+#define TEST_DECODE   1 // param = algorithm
+#define TEST_REMUX    2 // param = -b blocksize
+#define TEST_PARALLEL 3 // param = 0 for AUD_decode_parallel() of algorithm #0, or -b blocksize for AUD_remux_parallel()
+#define TEST_LANES    4 // AUD_decode_lanes(), AUD_LANES copies of the stream, algorithm #0
+#define TEST_RESAMPLE 5 // param = output rate, algorithm #0 through AUD_resample(), good quality
+#define TEST_ANALYZE  6 // AUD_decode() of algorithm #0 measured by AUD_analyze_stream(), output is its integer sums
+#define TEST_ENCODE   7 // param = AUD_ENCODE_GREEDY or AUD_ENCODE_TRELLIS, of the first BENCH_ENCODE_SAMPLES samples of algorithm #0 at 3/4 level
+
+typedef struct {
+	int type;
+	int param;
+	char file_io; // also run with file input and output
+} TEST;
+
+const TEST tests[] = {
+	{ TEST_SCAN,     0,     1 },
+	{ TEST_DECODE,   0,     1 },
+	{ TEST_DECODE,   1,     1 },
+	{ TEST_DECODE,   2,     1 },
+	{ TEST_DECODE,   3,     1 },
+	{ TEST_REMUX,    512,   1 },
+	{ TEST_REMUX,    4,     1 },
+	{ TEST_REMUX,    2048,  1 },
+	{ TEST_REMUX,    32771, 1 },
+	{ TEST_REMUX,    -1,    1 },
+	{ TEST_REMUX,    -2,    1 },
+	{ TEST_PARALLEL, 0,     0 },
+	{ TEST_PARALLEL, 512,   0 },
+	{ TEST_LANES,    0,     0 },
+	{ TEST_RESAMPLE, 48000, 1 },
+	{ TEST_ANALYZE,  0,     1 },
+	{ TEST_ENCODE,   AUD_ENCODE_GREEDY,  0 },
+	{ TEST_ENCODE,   AUD_ENCODE_TRELLIS, 0 },
+};
+
+// Checksums of the default streams (-n 1000000 -k 1024) for each test, scan has no output
+// Parallel and lanes output must be the same as decode algo0 and remux -b 512, resampling, analysis and encoding are of algo0 output
+#define TESTS (sizeof(tests) / sizeof(tests[0]))
+const uint32_t golden[2][3][TESTS] = {
+	{
+		{ 0x811c9dc5, 0x4957d1d7, 0x4957d1d7, 0x5aef5718, 0x89c452bf, 0x85b1066e, 0x2853d680, 0xcd64986c, 0x8de5dfe4, 0xbf8b1b39, 0x4991d93b, 0x4957d1d7, 0x85b1066e, 0x4957d1d7, 0xae71a56b, 0xfc6a7d8b, 0x4944fdea, 0x4f3b00e0 },  // new-tone
+		{ 0x811c9dc5, 0x7b144b33, 0x7b144b33, 0x8ec04494, 0x7b425053, 0x7782d15d, 0x69a7f3d9, 0x6d44d8c9, 0x602275c9, 0x83f74e80, 0xd8b73600, 0x7b144b33, 0x7782d15d, 0x7b144b33, 0x0e966977, 0xbd9e5542, 0xceca033f, 0xd2a7241e },  // new-noise
+		{ 0x811c9dc5, 0x12ad6fd9, 0x12ad6fd9, 0xf717c0f2, 0x0e75a689, 0xbbe090ca, 0x84f5f839, 0x61afdbca, 0x21d31dea, 0x3386676b, 0xab617a2e, 0x12ad6fd9, 0xbbe090ca, 0x12ad6fd9, 0xbd208580, 0xdcb348a0, 0xe12a2a5c, 0x6baf9178 },  // new-rails
+	},
+	{
+		{ 0x811c9dc5, 0x4957d1d7, 0x4957d1d7, 0x5aef5718, 0x89c452bf, 0x85b1066e, 0x2853d680, 0xcd64986c, 0x8de5dfe4, 0xbf8b1b39, 0x4991d93b, 0x4957d1d7, 0x85b1066e, 0x4957d1d7, 0xae71a56b, 0xfc6a7d8b, 0x4944fdea, 0x4f3b00e0 },  // old-tone
+		{ 0x811c9dc5, 0x7b144b33, 0x7b144b33, 0x8ec04494, 0x7b425053, 0x7782d15d, 0x69a7f3d9, 0x6d44d8c9, 0x602275c9, 0x83f74e80, 0xd8b73600, 0x7b144b33, 0x7782d15d, 0x7b144b33, 0x0e966977, 0xbd9e5542, 0xceca033f, 0xd2a7241e },  // old-noise
+		{ 0x811c9dc5, 0x12ad6fd9, 0x12ad6fd9, 0xf717c0f2, 0x0e75a689, 0xbbe090ca, 0x84f5f839, 0x61afdbca, 0x21d31dea, 0x3386676b, 0xab617a2e, 0x12ad6fd9, 0xbbe090ca, 0x12ad6fd9, 0xbd208580, 0xdcb348a0, 0xe12a2a5c, 0x6baf9178 },  // old-rails
+	}
+};
+
+typedef struct {
+	int threads;
+	int repeats;
+	char check_golden; // default stream parameters, golden checksums apply
+	// Scratch
+	AUD_CONTEXT *ctx[AUD_LANES];
+	short *pcm[AUD_LANES];
+	short *pcm_all;
+	short *resampled;
+	unsigned char *buf;
+	unsigned char *encoded;
+} BENCH;
+
+#define BENCH_CHUNK 32768 // samples or bytes per AUD_decode() / AUD_remux() call
+#define BENCH_RESAMPLED (BENCH_CHUNK * 3) // output of resampling a chunk, up to 3x the 22050 Hz streams
+#define BENCH_WINDOW 300007 // samples per AUD_decode_parallel() call, windows start within blocks
+#define BENCH_ENCODE_SAMPLES 300000 // encoded per stream, more than the 2^18 samples of a trellis chunk, so that threads split it
+#define BENCH_ENCODE_THREADS 4      // compared with one thread when -j is 1
+
+double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void test_name(char *name, size_t size, const TEST *t) {
+	switch (t->type) {
+		case TEST_SCAN:     snprintf(name, size, "scan"); break;
+		case TEST_DECODE:   snprintf(name, size, "decode algo%d", t->param); break;
+		case TEST_REMUX:    snprintf(name, size, "remux -b %d", t->param); break;
+		case TEST_PARALLEL: snprintf(name, size, t->param ? "remux -b %d -j" : "decode -j", t->param); break;
+		case TEST_RESAMPLE: snprintf(name, size, "resample %d", t->param); break;
+		case TEST_ANALYZE:  snprintf(name, size, "decode analyze"); break;
+		case TEST_ENCODE:   snprintf(name, size, "encode %s", (t->param == AUD_ENCODE_TRELLIS) ? "trellis" : "greedy"); break;
+		default:            snprintf(name, size, "decode x%d lanes", AUD_LANES);
+	}
+}
+
+// Every lane decodes the same stream, each of them must give the same checksum
+long run_lanes(BENCH *b, const unsigned char *aud, size_t size, SINK *sink) {
+	SINK lanes[AUD_LANES];
+	long decoded[AUD_LANES];
+	long total = 0;
+	int i;
+	
+	for (i = 0; i < AUD_LANES; i++) {
+		if (i > 0) {
+			AUD_open_memory(b->ctx[i], aud, size);
+			AUD_probe(b->ctx[i]);
+		}
+		lanes[i] = *sink;
+	}
+	
+	while (AUD_decode_lanes(b->ctx, AUD_LANES, b->pcm, BENCH_CHUNK, decoded) > 0)
+		for (i = 0; i < AUD_LANES; i++)
+			if (decoded[i] > 0) {
+				sink_pcm(&lanes[i], b->pcm[i], decoded[i]);
+				total += decoded[i];
+			}
+	
+	for (i = 1; i < AUD_LANES; i++) {
+		AUD_close(b->ctx[i]);
+		if (lanes[i].checksum != lanes[0].checksum)
+			total = -1;
+	}
+	sink->checksum = lanes[0].checksum;
+	return total;
+}
+
+// Output is bit-exact whichever dot product kernel is compiled in
+long run_resample(BENCH *b, AUD_CONTEXT *ctx, uint32_t rate, SINK *sink) {
+	AUD_RESAMPLER r;
+	long n, total = 0;
+	
+	AUD_rewind(ctx, 0);
+	if (AUD_resample_init(&r, ctx->header.samplerate, rate, AUD_RESAMPLE_GOOD) != AUD_OK) {
+		AUD_resample_free(&r);
+		return -1;
+	}
+	while ((n = AUD_decode(ctx, b->pcm[0], BENCH_CHUNK)) > 0) {
+		n = AUD_resample(&r, b->pcm[0], n, b->resampled);
+		sink_pcm(sink, b->resampled, n);
+		total += n;
+	}
+	n = AUD_resample_end(&r, b->resampled);
+	sink_pcm(sink, b->resampled, n);
+	AUD_resample_free(&r);
+	return total + n;
+}
+
+// Peak, clipping and sum of squares are exact, whether they are summed with SSE2 or not; loudness is left out,
+// it's in floating point
+long run_analyze(BENCH *b, AUD_CONTEXT *ctx, SINK *sink) {
+	AUD_ANALYSIS a;
+	unsigned char sums[24];
+	long n, total = 0;
+	int i;
+	
+	AUD_rewind(ctx, 0);
+	AUD_analysis_init(&a, ctx->header.samplerate);
+	AUD_analyze_stream(ctx, &a);
+	while ((n = AUD_decode(ctx, b->pcm[0], BENCH_CHUNK)) > 0)
+		total += n;
+	AUD_analysis_free(&a);
+	for (i = 0; i < 8; i++) {
+		sums[i] = (a.peak >> (i * 8)) & 0xFF;
+		sums[8 + i] = (a.clipped >> (i * 8)) & 0xFF;
+		sums[16 + i] = (a.sum_sq >> (i * 8)) & 0xFF;
+	}
+	sink_write(sink, sums, sizeof(sums));
+	return total;
+}
+
+// Decodes b->encoded back, returns its RMS error against the n samples of b->pcm_all, or -1 if it doesn't have n samples
+double round_trip(BENCH *b, long size, uint32_t n) {
+	AUD_CONTEXT *ctx = b->ctx[1];
+	double sum_sq = 0, diff;
+	uint32_t done = 0;
+	long decoded, i;
+	
+	if ((AUD_open_memory(ctx, b->encoded, size) != AUD_OK) || (AUD_probe(ctx) != AUD_OK) || (ctx->header.num_samples != n)) {
+		AUD_close(ctx);
+		return -1;
+	}
+	AUD_rewind(ctx, 0);
+	while ((decoded = AUD_decode(ctx, b->pcm[1], BENCH_CHUNK)) > 0) {
+		for (i = 0; (i < decoded) && (done + i < n); i++) {
+			diff = b->pcm[1][i] - b->pcm_all[done + i];
+			sum_sq += diff * diff;
+		}
+		done += decoded;
+	}
+	AUD_close(ctx);
+	return (done == n) ? sqrt(sum_sq / n) : -1;
+}
+
+// Output is the encoded AUD file. When checked, it must decode back to as many samples, and trellis must give
+// the same bytes with one thread as with several, and a smaller RMS error than greedy
+long run_encode(BENCH *b, AUD_CONTEXT *ctx, int mode, SINK *sink) {
+	uint32_t n = (ctx->header.num_samples < BENCH_ENCODE_SAMPLES) ? ctx->header.num_samples : BENCH_ENCODE_SAMPLES;
+	SINK other = { NULL, 2166136261u, 1 };
+	double error, greedy_error;
+	uint32_t i, done = 0;
+	long size = 0;
+	
+	AUD_rewind(ctx, 0);
+	while ((done < n) && ((size = AUD_decode(ctx, &b->pcm_all[done], n - done)) > 0))
+		done += size;
+	// At 3/4 of the level: the tone stream was made greedily, at full level greedy would find its very nibbles again
+	for (i = 0; i < done; i++)
+		b->pcm_all[i] = b->pcm_all[i] * 3 / 4;
+	if ((done < n) || ((size = AUD_encode(b->pcm_all, n, ctx->header.samplerate, mode, b->threads, b->encoded)) < 0))
+		return -1;
+	sink_write(sink, b->encoded, size);
+	if (!sink->check)
+		return n;
+	
+	if ((error = round_trip(b, size, n)) < 0)
+		return -1;
+	if (mode == AUD_ENCODE_TRELLIS) {
+		size = AUD_encode(b->pcm_all, n, ctx->header.samplerate, mode, (b->threads > 1) ? 1 : BENCH_ENCODE_THREADS, b->encoded);
+		sink_write(&other, b->encoded, size);
+		if (other.checksum != sink->checksum)
+			return -1;
+		size = AUD_encode(b->pcm_all, n, ctx->header.samplerate, AUD_ENCODE_GREEDY, 1, b->encoded);
+		if (((greedy_error = round_trip(b, size, n)) < 0) || (error >= greedy_error))
+			return -1;
+	}
+	return n;
+}
+
+// Runs a test once, aud_file = NULL for memory input, returns number of samples, or -1 on error
+long run_test(BENCH *b, const TEST *t, const unsigned char *aud, size_t size, FILE *aud_file, SINK *sink) {
+	AUD_CONTEXT *ctx = b->ctx[0];
+	long n, total = 0;
+	
+	if (aud_file) {
+		rewind(aud_file);
+		if (AUD_open_file(ctx, aud_file, 0) != AUD_OK) return -1;
+	} else if (AUD_open_memory(ctx, aud, size) != AUD_OK)
+		return -1;
+	if (AUD_probe(ctx) != AUD_OK)
+		return -1;
+	
+	switch (t->type) {
+		case TEST_SCAN:
+			total = ctx->header.num_samples;
+			break;
+		
+		case TEST_DECODE:
+			AUD_rewind(ctx, t->param);
+			while ((n = AUD_decode(ctx, b->pcm[0], BENCH_CHUNK)) > 0) {
+				sink_pcm(sink, b->pcm[0], n);
+				total += n;
+			}
+			break;
+		
+		case TEST_REMUX:
+			if (AUD_remux_begin(ctx, t->param) < 0) return -1;
+			while ((n = AUD_remux(ctx, b->buf, BENCH_CHUNK)) > 0)
+				sink_write(sink, b->buf, n);
+			total = ctx->header.num_samples;
+			break;
+		
+		case TEST_PARALLEL:
+			if (t->param) {
+				if (AUD_remux_begin(ctx, t->param) < 0) return -1;
+				while ((n = AUD_remux_parallel(ctx, (unsigned char *)b->pcm_all, BENCH_WINDOW * 2, b->threads)) > 0)
+					sink_write(sink, b->pcm_all, n);
+				total = (n < 0) ? -1 : (long)ctx->header.num_samples;
+				break;
+			}
+			AUD_rewind(ctx, 0);
+			while ((n = AUD_decode_parallel(ctx, b->pcm_all, BENCH_WINDOW, b->threads)) > 0) {
+				sink_pcm(sink, b->pcm_all, n);
+				total += n;
+			}
+			if (n < 0) total = -1;
+			break;
+		
+		case TEST_LANES:
+			total = run_lanes(b, aud, size, sink);
+			break;
+		
+		case TEST_RESAMPLE:
+			total = run_resample(b, ctx, t->param, sink);
+			break;
+		
+		case TEST_ANALYZE:
+			total = run_analyze(b, ctx, sink);
+			break;
+		
+		case TEST_ENCODE:
+			total = run_encode(b, ctx, t->param, sink);
+			break;
+	}
+	
+	AUD_close(ctx);
+	return total;
+}
+
+// Best time of all repeats, in seconds, or -1 on error
+double time_test(BENCH *b, const TEST *t, const unsigned char *aud, size_t size, FILE *aud_file, FILE *out_file) {
+	SINK sink = { NULL, 0, 0 };
+	double best = -1, start, time;
+	int r;
+	
+	for (r = 0; r < b->repeats; r++) {
+		if (out_file) {
+			rewind(out_file);
+			sink.file = out_file;
+		}
+		start = now();
+		if (run_test(b, t, aud, size, aud_file, &sink) < 0)
+			return -1;
+		if (out_file)
+			fflush(out_file);
+		time = now() - start;
+		if ((best < 0) || (time < best))
+			best = time;
+	}
+	return best;
+}
+
+// Returns number of failed tests
+int bench_stream(BENCH *b, int format, int kind, uint32_t samples, uint32_t block_size) {
+	const char *io_names[] = { "memory", "file" };
+	char stream_name[32], name[32];
+	unsigned char *aud;
+	size_t size;
+	FILE *aud_file, *out_file;
+	SINK sink;
+	long total;
+	double time;
+	int t, io, failed = 0;
+	
+	snprintf(stream_name, sizeof(stream_name), "%s-%s", (format == AUD_FORMAT_NEW) ? "new" : "old", kind_names[kind]);
+	if (!(aud = make_aud(format, kind, samples, block_size, &size))) {
+		fprintf(stderr, "Error: not enough memory for %s stream\n", stream_name);
+		return 1;
+	}
+	aud_file = tmpfile();
+	out_file = tmpfile();
+	if (!aud_file || !out_file || (fwrite(aud, 1, size, aud_file) != size) || fflush(aud_file)) {
+		fprintf(stderr, "Error: can't create temporary files, file I/O tests skipped\n");
+		if (aud_file) fclose(aud_file);
+		if (out_file) fclose(out_file);
+		aud_file = out_file = NULL;
+	}
+	
+	for (t = 0; t < (int)TESTS; t++) {
+		test_name(name, sizeof(name), &tests[t]);
+		
+		// Output checked once, untimed
+		
+		sink.file = NULL;
+		sink.checksum = 2166136261u;
+		sink.check = 1;
+		total = run_test(b, &tests[t], aud, size, NULL, &sink);
+		
+		for (io = 0; io <= (tests[t].file_io && aud_file); io++) {
+			time = (total < 0) ? -1 : time_test(b, &tests[t], aud, size, io ? aud_file : NULL, io ? out_file : NULL);
+			printf("%-12s %-18s %-7s", stream_name, name, io_names[io]);
+			if (time < 0) {
+				printf(" %10s %11s %10s  FAILED\n", "-", "-", "-");
+				failed++;
+				continue;
+			}
+			if (time <= 0) time = 1e-9;
+			printf(" %10.1f %11.1f   %08x", size * (tests[t].type == TEST_LANES ? AUD_LANES : 1) / time / 1e6, total / time / 1e6, sink.checksum);
+			if (!b->check_golden || (tests[t].type == TEST_SCAN))
+				printf("  -\n");
+			else if (sink.checksum == golden[format - AUD_FORMAT_NEW][kind][t]) {
+				printf("  ok\n");
+			} else {
+				printf("  MISMATCH, expected %08x\n", golden[format - AUD_FORMAT_NEW][kind][t]);
+				failed++;
+			}
+		}
+	}
+	
+	if (aud_file) fclose(aud_file);
+	if (out_file) fclose(out_file);
+	free(aud);
+	return failed;
+}
+
+
+
+/******************************** MIX archives ********************************/
+
+#define MIX_INTACT    0
+#define MIX_ENCRYPTED 1 // Red Alert flags say the index is encrypted
+#define MIX_OUTSIDE   2 // last entry runs one byte past the body
+#define MIX_TRUNCATED 3 // archive ends inside the index
+
+#define MIX_ENTRIES 3
+#define MIX_OTHER_ID 0x8000ABCD // the entry that isn't an AUD file, negative as a signed ID
+
+void put32(unsigned char *p, uint32_t x) {
+	int i;
+	
+	for (i = 0; i < 4; i++)
+		p[i] = x >> (i * 8);
+}
+
+// Builds a MIX archive in memory, Tiberian Dawn or Red Alert with a (zeroed) SHA-1 at the end
+// The index is left unsorted, MIX_open() has to sort it
+unsigned char *make_mix(int red_alert, int damage, const uint32_t *ids, unsigned char *const *files, const size_t *sizes, size_t *size) {
+	uint32_t header = red_alert ? 4 : 0, body, offset = 0;
+	unsigned char *mix, *p;
+	int i;
+	
+	body = header + MIX_HEADER_SIZE + MIX_ENTRIES * MIX_ENTRY_SIZE;
+	*size = body + (red_alert ? 20 : 0);
+	for (i = 0; i < MIX_ENTRIES; i++)
+		*size += sizes[i];
+	if (!(mix = calloc(1, *size)))
+		return NULL;
+	if (red_alert)
+		put32(mix, MIX_FLAG_CHECKSUM | ((damage == MIX_ENCRYPTED) ? MIX_FLAG_ENCRYPTED : 0));
+	p = &mix[header];
+	p[0] = MIX_ENTRIES;
+	put32(p + 2, *size - body - (red_alert ? 20 : 0));
+	for (i = 0; i < MIX_ENTRIES; i++) {
+		p = &mix[header + MIX_HEADER_SIZE + i * MIX_ENTRY_SIZE];
+		put32(p, ids[i]);
+		put32(p + 4, offset);
+		put32(p + 8, sizes[i] + ((damage == MIX_OUTSIDE) && (i == MIX_ENTRIES - 1)));
+		memcpy(&mix[body + offset], files[i], sizes[i]);
+		offset += sizes[i];
+	}
+	if (damage == MIX_TRUNCATED)
+		*size = body - 1;
+	return mix;
+}
+
+// Opens an archive built by make_mix() from a temporary file, returns what MIX_open() did
+int open_mix(MIX_ARCHIVE *mix, const unsigned char *data, size_t size) {
+	FILE *f = tmpfile();
+	int res;
+	
+	if (!f || (fwrite(data, 1, size, f) != size) || fflush(f)) {
+		if (f) fclose(f);
+		memset(mix, 0, sizeof(MIX_ARCHIVE));
+		snprintf(mix->message, sizeof(mix->message), "can't create a temporary file");
+		return AUD_ERROR_WRITE;
+	}
+	rewind(f);
+	res = MIX_open(mix, f);
+	fclose(f); // the mapping stays valid
+	return res;
+}
+
+// Checksum of a test of the AUD file at aud, 0 if it failed
+uint32_t mix_checksum(BENCH *b, const TEST *t, const unsigned char *aud, size_t size) {
+	SINK sink = { NULL, 2166136261u, 1 };
+	
+	return (run_test(b, t, aud, size, NULL, &sink) < 0) ? 0 : sink.checksum;
+}
+
+int mix_check(const char *archive, const char *what, int ok, const char *message) {
+	printf("MIX %-3s %-42s %s%s%s\n", archive, what, ok ? "ok" : "FAILED", (!ok && message) ? ": " : "", (!ok && message) ? message : "");
+	return !ok;
+}
+
+// Entries of TD and RA archives have to decode and remux exactly like the streams they were made of,
+// found by filename and by hex ID; encrypted, damaged and truncated archives have to be refused
+// Returns number of failed checks
+int bench_mix(BENCH *b, uint32_t samples, uint32_t block_size) {
+	const char *names[MIX_ENTRIES] = { "TONE.AUD", "RAILS.AUD", NULL };
+	const char *archive_names[] = { "td", "ra" };
+	const TEST checked[] = { { TEST_DECODE, 0, 0 }, { TEST_REMUX, 512, 0 } };
+	const struct {
+		int damage;
+		int expected;
+		const char *name;
+	} damaged[] = {
+		{ MIX_ENCRYPTED, AUD_ERROR_UNSUPPORTED, "encrypted refused" },
+		{ MIX_OUTSIDE,   AUD_ERROR_FORMAT,      "entry outside of the body refused" },
+		{ MIX_TRUNCATED, AUD_ERROR_FORMAT,      "truncated index refused" },
+	};
+	static const char other[] = "not an AUD file";
+	unsigned char *files[MIX_ENTRIES], *data;
+	uint32_t ids[MIX_ENTRIES], checksum;
+	size_t sizes[MIX_ENTRIES], size;
+	MIX_ARCHIVE mix;
+	const MIX_ENTRY *entry;
+	char what[64], hex[16], test[32];
+	int ra, i, t, d, res, failed = 0;
+	
+	files[0] = make_aud(AUD_FORMAT_NEW, KIND_TONE, samples, block_size, &sizes[0]);
+	files[1] = make_aud(AUD_FORMAT_OLD, KIND_RAILS, samples, block_size, &sizes[1]);
+	files[2] = (unsigned char *)other;
+	sizes[2] = sizeof(other);
+	for (i = 0; i < MIX_ENTRIES; i++)
+		ids[i] = names[i] ? MIX_id(names[i]) : MIX_OTHER_ID;
+	if (!files[0] || !files[1]) {
+		fprintf(stderr, "Error: not enough memory for MIX archives\n");
+		free(files[0]);
+		free(files[1]);
+		return 1;
+	}
+	
+	for (ra = 0; ra <= 1; ra++) {
+		if (!(data = make_mix(ra, MIX_INTACT, ids, files, sizes, &size))) {
+			failed += mix_check(archive_names[ra], "built", 0, "not enough memory");
+			continue;
+		}
+		res = open_mix(&mix, data, size);
+		if (mix_check(archive_names[ra], "opened", (res == AUD_OK) && (mix.count == MIX_ENTRIES), mix.message)) {
+			failed++;
+		} else {
+			// The first entry by filename, the others by the hex ID a user would type
+			for (i = 0; i < MIX_ENTRIES; i++) {
+				snprintf(hex, sizeof(hex), "%08X", ids[i]);
+				entry = MIX_find(&mix, i ? strtoul(hex, NULL, 16) : MIX_id(names[i]));
+				snprintf(what, sizeof(what), "%s found%s", i ? hex : names[i], names[i] ? "" : ", not an AUD file");
+				res = entry && (entry->size == sizes[i]) && !memcmp(&mix.data[entry->offset], files[i], sizes[i]);
+				if (res && !names[i]) {
+					res = (AUD_open_memory(b->ctx[0], &mix.data[entry->offset], entry->size) == AUD_ERROR_FORMAT);
+					AUD_close(b->ctx[0]);
+				}
+				if (mix_check(archive_names[ra], what, res, NULL)) {
+					failed++;
+					continue;
+				}
+				for (t = 0; names[i] && (t < (int)(sizeof(checked) / sizeof(checked[0]))); t++) {
+					test_name(test, sizeof(test), &checked[t]);
+					snprintf(what, sizeof(what), "%s %s same as the stream", names[i], test);
+					checksum = mix_checksum(b, &checked[t], files[i], sizes[i]);
+					failed += mix_check(archive_names[ra], what, checksum && (mix_checksum(b, &checked[t], &mix.data[entry->offset], entry->size) == checksum), NULL);
+				}
+			}
+			failed += mix_check(archive_names[ra], "no entry for a missing name", !MIX_find(&mix, MIX_id("MISSING.AUD")), NULL);
+		}
+		MIX_close(&mix);
+		free(data);
+	}
+	
+	// Only Red Alert archives have flags that can say they're encrypted
+	
+	for (ra = 0; ra <= 1; ra++)
+		for (d = 0; d < (int)(sizeof(damaged) / sizeof(damaged[0])); d++) {
+			if (!ra && (damaged[d].damage == MIX_ENCRYPTED))
+				continue;
+			if (!(data = make_mix(ra, damaged[d].damage, ids, files, sizes, &size))) {
+				failed += mix_check(archive_names[ra], damaged[d].name, 0, "not enough memory");
+				continue;
+			}
+			res = open_mix(&mix, data, size);
+			failed += mix_check(archive_names[ra], damaged[d].name, res == damaged[d].expected, (res == AUD_OK) ? "opened" : mix.message);
+			MIX_close(&mix);
+			free(data);
+		}
+	
+	free(files[0]);
+	free(files[1]);
+	return failed;
+}
+
+
+
+/******************************** THE PROGRAM ********************************/
+
+void usage(char *argv0) {
+	fprintf(stderr, "Benchmarks audlib on synthetic AUD streams and checks its output\n");
+	fprintf(stderr, "Usage: %s [-n <samples>] [-k <blocksize>] [-r <repeats>] [-j <threads>]\n", argv0);
+	fprintf(stderr, "\t-n <samples>: samples per stream [default: 1000000]\n");
+	fprintf(stderr, "\t-k <blocksize>: ADPCM bytes per AUD block, 1..65535 [default: 1024]\n");
+	fprintf(stderr, "\t-r <repeats>: runs of each test, the best time is reported [default: 3]\n");
+	fprintf(stderr, "\t-j <threads>: threads for parallel decoding and trellis encoding [default: one per CPU core]\n");
+	fprintf(stderr, "\tOutput is compared with golden checksums only with default -n and -k\n");
+	fprintf(stderr, "\tMB/s is of AUD input, exit code is 1 if any check failed\n");
+	exit(0);
+}
+
+int main(int argc, char *argv[]) {
+	uint32_t samples = 1000000, block_size = 1024;
+	BENCH b;
+	int c, i, format, kind, failed = 0;
+	long cpus;
+	
+	b.repeats = 3;
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	b.threads = (cpus > 0) ? cpus : 1;
+	
+	while ((c = getopt(argc, argv, "hn:k:r:j:")) != -1)
+		switch (c) {
+			case 'n': samples = strtoul(optarg, NULL, 10); break;
+			case 'k': block_size = strtoul(optarg, NULL, 10); break;
+			case 'r': b.repeats = atoi(optarg); break;
+			case 'j': b.threads = atoi(optarg); break;
+			default: usage(argv[0]);
+		}
+	if ((samples < 1) || (block_size < 1) || (block_size > AUD_BLOCK_MAX) || (b.repeats < 1) || (b.threads < 1))
+		usage(argv[0]);
+	b.check_golden = (samples == 1000000) && (block_size == 1024);
+	
+	for (i = 0; i < AUD_LANES; i++) {
+		b.ctx[i] = malloc(sizeof(AUD_CONTEXT));
+		b.pcm[i] = malloc(BENCH_CHUNK * sizeof(short));
+		if (!b.ctx[i] || !b.pcm[i]) {
+			fprintf(stderr, "Error: not enough memory\n");
+			return 1;
+		}
+	}
+	b.pcm_all = malloc(((samples > BENCH_WINDOW) ? samples : BENCH_WINDOW) * sizeof(short));
+	b.buf = malloc(BENCH_CHUNK);
+	b.resampled = malloc(BENCH_RESAMPLED * sizeof(short));
+	b.encoded = malloc(AUD_encoded_size((samples < BENCH_ENCODE_SAMPLES) ? samples : BENCH_ENCODE_SAMPLES));
+	if (!b.pcm_all || !b.buf || !b.resampled || !b.encoded) {
+		fprintf(stderr, "Error: not enough memory\n");
+		return 1;
+	}
+	
+	// Tables first, the kernels rely on them
+	
+	c = ADPCM_check_tables();
+	printf("Packed tables: %s\n", c ? "MISMATCH" : "ok");
+	failed += c != 0;
+	
+	printf("%u samples per stream, %u bytes per AUD block, best of %d, %d threads\n", samples, block_size, b.repeats, b.threads);
+	printf("%-12s %-18s %-7s %10s %11s %10s  %s\n", "Stream", "Test", "I/O", "MB/s", "Msamples/s", "Checksum", "Check");
+	for (format = AUD_FORMAT_NEW; format <= AUD_FORMAT_OLD; format++)
+		for (kind = KIND_TONE; kind <= KIND_RAILS; kind++)
+			failed += bench_stream(&b, format, kind, samples, block_size);
+	failed += bench_mix(&b, samples, block_size);
+	
+	printf("%s\n", failed ? "FAILED" : "All checks passed");
+	return failed ? 1 : 0;
+}
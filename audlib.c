@@ -0,0 +1,3108 @@
+// audlib - Westwood AUD (IMA ADPCM) decoding and remuxing library used by aud2wav
+
+// The main difference between AUD and IMA-ADPCM-WAV is that AUD contains a continuous stream of ADPCM data,
+// decoder is never reinitialized, while WAV is divided into independently decodable blocks,
+// each block starts with a header containing one decoded sample and decoder state
+
+#define _FILE_OFFSET_BITS 64 // fseeko() / ftello() and mmap() of files over 2 GB on 32-bit systems
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <limits.h> // INT_MAX
+#include <math.h>   // resampling filter design, loudness
+#include <pthread.h>
+#include "audlib.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if !defined(_WIN32) && !defined(AUDLIB_NO_MMAP)
+#include <sys/mman.h> // mmap, madvise
+#include <sys/stat.h> // fstat
+#define AUDLIB_MMAP
+#endif
+
+#ifdef _WIN32
+#define fseeko _fseeki64
+#define ftello _ftelli64
+#endif
+
+
+
+/******************************** ADPCM decoding ********************************/
+
+// Lookup tables for algorithm #0
+
+// Original code from EA 2025 source code release
+// https://github.com/electronicarts/CnC_Remastered_Collection
+// #include "ADPCM.CPP" // not used, included only for reference
+#include "DTABLE.CPP" // long DiffTable[89 * 16]
+#include "ITABLE.CPP" // unsigned short IndexTable[89 * 16]
+
+// Lookup tables for algorithms #1, #2, #3
+
+unsigned short ADPCM_STEP_TABLE[89] = {
+	7,     8,     9,     10,    11,    12,     13,    14,    16,
+	17,    19,    21,    23,    25,    28,     31,    34,    37,
+	41,    45,    50,    55,    60,    66,     73,    80,    88,
+	97,    107,   118,   130,   143,   157,    173,   190,   209,
+	230,   253,   279,   307,   337,   371,    408,   449,   494,
+	544,   598,   658,   724,   796,   876,    963,   1060,  1166,
+	1282,  1411,  1552,  1707,  1878,  2066,   2272,  2499,  2749,
+	3024,  3327,  3660,  4026,  4428,  4871,   5358,  5894,  6484,
+	7132,  7845,  8630,  9493,  10442, 11487,  12635, 13899, 15289,
+	16818, 18500, 20350, 22385, 24623, 27086,  29794, 32767
+};
+char ADPCM_INDEX_ADJUST[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+void ADPCM_decode_sample(int use_algorithm, char *index, long *sample, unsigned char nibble) {
+	
+	int diff;
+	
+	if (use_algorithm == 0) { // Algorithm #0: original Westwood, uses large pre-calculated lookup tables
+		
+		int fastindex = (*index << 4) + nibble;
+		diff = DiffTable[fastindex];         // DTABLE.CPP
+		*index = IndexTable[fastindex] >> 4; // ITABLE.CPP
+		
+	} else {
+		
+		// Code common to algorithms #1, #2, #3
+		
+		int sign = nibble & 8;
+		int delta = nibble & 7;
+		
+		unsigned short step = ADPCM_STEP_TABLE[*index];
+		
+		switch (use_algorithm) {
+			case 2:  // Algorithm #2: slightly optimized, not sample-accurate, error accumulates
+				diff = ((delta * step) >> 2) + (step >> 3);
+				break;
+			
+			case 3:  // Algorithm #3: fully optimized, even worse
+				diff = ((delta * 2 + 1) * step) >> 3;
+				break;
+			
+			default: // Algorithm #1: using small lookup tables, result is identical to the original
+				diff = 0;
+				if (delta & 4) diff += step; step >>= 1;
+				if (delta & 2) diff += step; step >>= 1;
+				if (delta & 1) diff += step; step >>= 1;
+				diff += step;
+		}
+		
+		if (sign) diff = -diff;
+		
+		*index += ADPCM_INDEX_ADJUST[delta];
+		if (*index < 0) *index = 0;
+		if (*index > 88) *index = 88;
+		
+	} // algorithms #1, #2, #3
+	
+	*sample += diff;
+	if (*sample > 32767) *sample = 32767;
+	if (*sample < -32768) *sample = -32768;
+}
+
+// Block kernels: the same algorithms without per-nibble dispatch, state stays in registers,
+// each byte gives two samples like sosCODECDecompressData() in ADPCM.CPP
+
+static inline int clamp_sample(int sample) {
+	return (sample > 32767) ? 32767 : (sample < -32768) ? -32768 : sample;
+}
+
+static inline int clamp_index(int index) {
+	return (index > 88) ? 88 : (index < 0) ? 0 : index;
+}
+
+// Algorithm #0 tables repacked, built from DiffTable and IndexTable by init_tables():
+// ADPCM_PACKED: one entry per (index, nibble) = diff * 256 + next index, 5.7 KB instead of two tables
+// ADPCM_PACKED_BYTE: one entry per (index, byte) = (diff1 + diff2) * 256 + index after both nibbles,
+// valid only if the sample is at least ADPCM_PACKED_MARGIN[index] away from the rails (no clamping)
+static int32_t ADPCM_PACKED[89 * 16];
+static int32_t ADPCM_PACKED_BYTE[89 * 256];
+static int32_t ADPCM_PACKED_MARGIN[89];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void init_tables(void) {
+	int index, nibble, byte, next, diff1, diff2, margin;
+	
+	for (index = 0; index < 89; index++)
+		for (nibble = 0; nibble < 16; nibble++)
+			ADPCM_PACKED[(index << 4) | nibble] = DiffTable[(index << 4) | nibble] * 256 + (IndexTable[(index << 4) | nibble] >> 4);
+	
+	for (index = 0; index < 89; index++) {
+		margin = 0;
+		for (byte = 0; byte < 256; byte++) {
+			diff1 = DiffTable[(index << 4) | (byte & 0xF)];
+			next = IndexTable[(index << 4) | (byte & 0xF)] >> 4;
+			diff2 = DiffTable[(next << 4) | (byte >> 4)];
+			ADPCM_PACKED_BYTE[(index << 8) | byte] = (diff1 + diff2) * 256 + (IndexTable[(next << 4) | (byte >> 4)] >> 4);
+			if (abs(diff1) > margin) margin = abs(diff1);
+			if (abs(diff1 + diff2) > margin) margin = abs(diff1 + diff2);
+		}
+		ADPCM_PACKED_MARGIN[index] = margin;
+	}
+}
+
+// Diff is in the upper 24 bits, >> is an arithmetic shift on all supported compilers
+static inline void step_algo0(int *index, int *sample, int nibble) {
+	int32_t packed = ADPCM_PACKED[(*index << 4) | nibble];
+	*sample = clamp_sample(*sample + (packed >> 8));
+	*index = packed & 0xFF;
+}
+
+static inline void step_algo1(int *index, int *sample, int nibble) {
+	int step = ADPCM_STEP_TABLE[*index];
+	int diff = step >> 3;
+	if (nibble & 4) diff += step;
+	if (nibble & 2) diff += step >> 1;
+	if (nibble & 1) diff += step >> 2;
+	*sample = clamp_sample((nibble & 8) ? *sample - diff : *sample + diff);
+	*index = clamp_index(*index + ADPCM_INDEX_ADJUST[nibble & 7]);
+}
+
+static inline void step_algo2(int *index, int *sample, int nibble) {
+	int step = ADPCM_STEP_TABLE[*index];
+	int diff = (((nibble & 7) * step) >> 2) + (step >> 3);
+	*sample = clamp_sample((nibble & 8) ? *sample - diff : *sample + diff);
+	*index = clamp_index(*index + ADPCM_INDEX_ADJUST[nibble & 7]);
+}
+
+static inline void step_algo3(int *index, int *sample, int nibble) {
+	int step = ADPCM_STEP_TABLE[*index];
+	int diff = (((nibble & 7) * 2 + 1) * step) >> 3;
+	*sample = clamp_sample((nibble & 8) ? *sample - diff : *sample + diff);
+	*index = clamp_index(*index + ADPCM_INDEX_ADJUST[nibble & 7]);
+}
+
+#define ADPCM_KERNEL_BODY(step) \
+	int index = *adpcm_index; \
+	int sample = *adpcm_sample; \
+	unsigned char byte; \
+	\
+	if ((pos < end) && (pos & 1)) { \
+		step(&index, &sample, in[pos >> 1] >> 4); \
+		*pcm++ = sample; \
+		pos++; \
+	} \
+	for (; pos + 1 < end; pos += 2) { \
+		byte = in[pos >> 1]; \
+		step(&index, &sample, byte & 0xF); \
+		pcm[0] = sample; \
+		step(&index, &sample, byte >> 4); \
+		pcm[1] = sample; \
+		pcm += 2; \
+	} \
+	if (pos < end) { \
+		step(&index, &sample, in[pos >> 1] & 0xF); \
+		*pcm = sample; \
+	} \
+	*adpcm_index = index; \
+	*adpcm_sample = sample;
+
+static void kernel_algo0(const unsigned char *in, uint32_t pos, uint32_t end, short *pcm, char *adpcm_index, long *adpcm_sample) {
+	ADPCM_KERNEL_BODY(step_algo0)
+}
+
+static void kernel_algo1(const unsigned char *in, uint32_t pos, uint32_t end, short *pcm, char *adpcm_index, long *adpcm_sample) {
+	ADPCM_KERNEL_BODY(step_algo1)
+}
+
+static void kernel_algo2(const unsigned char *in, uint32_t pos, uint32_t end, short *pcm, char *adpcm_index, long *adpcm_sample) {
+	ADPCM_KERNEL_BODY(step_algo2)
+}
+
+static void kernel_algo3(const unsigned char *in, uint32_t pos, uint32_t end, short *pcm, char *adpcm_index, long *adpcm_sample) {
+	ADPCM_KERNEL_BODY(step_algo3)
+}
+
+// Decoder state after nibbles pos..end-1 with algorithm #0, without samples (for remuxing)
+// Takes a byte at once where clamping is impossible, nibble by nibble near the rails
+static void advance_algo0(const unsigned char *in, uint32_t pos, uint32_t end, char *adpcm_index, long *adpcm_sample) {
+	int index = *adpcm_index;
+	int sample = *adpcm_sample;
+	int32_t packed;
+	unsigned char byte;
+	
+	if ((pos < end) && (pos & 1))
+		step_algo0(&index, &sample, in[pos++ >> 1] >> 4);
+	for (; pos + 1 < end; pos += 2) {
+		byte = in[pos >> 1];
+		if ((sample >= -32768 + ADPCM_PACKED_MARGIN[index]) && (sample <= 32767 - ADPCM_PACKED_MARGIN[index])) {
+			packed = ADPCM_PACKED_BYTE[(index << 8) | byte];
+			sample += packed >> 8;
+			index = packed & 0xFF;
+		} else {
+			step_algo0(&index, &sample, byte & 0xF);
+			step_algo0(&index, &sample, byte >> 4);
+		}
+	}
+	if (pos < end)
+		step_algo0(&index, &sample, in[pos >> 1] & 0xF);
+	*adpcm_index = index;
+	*adpcm_sample = sample;
+}
+
+// Compares advance_algo0() over 1 or 2 nibbles of byte with the original decoder, returns 1 on mismatch
+static int check_state(int index, int sample, unsigned char byte, int nibbles) {
+	char index1 = index, index2 = index;
+	long sample1 = sample, sample2 = sample;
+	
+	ADPCM_decode_sample(0, &index1, &sample1, byte & 0xF);
+	if (nibbles == 2)
+		ADPCM_decode_sample(0, &index1, &sample1, byte >> 4);
+	advance_algo0(&byte, 0, nibbles, &index2, &sample2);
+	return (index1 != index2) || (sample1 != sample2);
+}
+
+int ADPCM_check_tables(void) {
+	int index, byte, sample, edge, d, mismatches = 0;
+	int edges[4];
+	
+	pthread_once(&tables_once, init_tables);
+	
+	for (index = 0; index < 89; index++) {
+		// The rails, and where the byte table starts to be used
+		edges[0] = -32768;
+		edges[1] = 32767;
+		edges[2] = -32768 + ADPCM_PACKED_MARGIN[index];
+		edges[3] = 32767 - ADPCM_PACKED_MARGIN[index];
+		
+		for (byte = 0; byte < 256; byte++) {
+			for (sample = -32768; sample <= 32767; sample += 61) {
+				mismatches += check_state(index, sample, byte, 1);
+				mismatches += check_state(index, sample, byte, 2);
+			}
+			for (edge = 0; edge < 4; edge++)
+				for (d = -4; d <= 4; d++) {
+					sample = edges[edge] + d;
+					if ((sample < -32768) || (sample > 32767)) continue;
+					mismatches += check_state(index, sample, byte, 1);
+					mismatches += check_state(index, sample, byte, 2);
+				}
+		}
+	}
+	return mismatches;
+}
+
+ADPCM_KERNEL ADPCM_kernel(int use_algorithm) {
+	pthread_once(&tables_once, init_tables);
+	switch (use_algorithm) {
+		case 0:  return kernel_algo0;
+		case 2:  return kernel_algo2;
+		case 3:  return kernel_algo3;
+		default: return kernel_algo1; // same as ADPCM_decode_sample()
+	}
+}
+
+
+
+/******************************** Serialization ********************************/
+
+// All headers are little-endian on disk, never read or written as structs
+
+static uint16_t get16(const unsigned char *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const unsigned char *p) {
+	return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static unsigned char *put16(unsigned char *p, uint16_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	return p + 2;
+}
+
+static unsigned char *put32(unsigned char *p, uint32_t v) {
+	p = put16(p, v);
+	return put16(p, v >> 16);
+}
+
+static uint64_t get64(const unsigned char *p) {
+	return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+static unsigned char *put64(unsigned char *p, uint64_t v) {
+	p = put32(p, v);
+	return put32(p, v >> 32);
+}
+
+static void get_block_header(AUD_BLOCK_HEADER *h, const unsigned char *p) {
+	h->encsize = get16(p);
+	h->decsize = get16(p + 2);
+	h->deaf = get16(p + 4);
+	h->zero = get16(p + 6);
+}
+
+// RIFF size of a header of size bytes (RF64 included) followed by datalen bytes
+static uint64_t riff_size(uint64_t datalen, uint32_t size) {
+	return (datalen == WAV_SIZE_UNKNOWN) ? WAV_SIZE_UNKNOWN : datalen + size - 8;
+}
+
+// Sizes of 0xFFFFFFFF and more need the ds64 chunk, 0xFFFFFFFF itself means "unknown" to readers
+static int needs_rf64(uint64_t riffsize) {
+	return (riffsize != WAV_SIZE_UNKNOWN) && (riffsize >= 0xFFFFFFFF);
+}
+
+void WAV_header_pcm(WAV_HEADER_PCM *h, uint32_t samplerate, uint64_t datalen) {
+	h->rf64 = needs_rf64(riff_size(datalen, WAV_HEADER_PCM_SIZE));
+	h->RIFF = h->rf64 ? 0x34364652 : 0x46464952;
+	h->riffsize = riff_size(datalen, WAV_HEADER_PCM_SIZE + (h->rf64 ? WAV_HEADER_DS64_SIZE : 0));
+	h->WAVE = 0x45564157;
+	h->fmt = 0x20746D66;
+	h->fmtlen = 16;
+	h->wFormatTag = 1;
+	h->nChannels = 1;
+	h->nSamplesPerSec = samplerate;
+	h->nAvgBytesPerSec = h->nSamplesPerSec * 2;
+	h->nBlockAlign = 2;
+	h->wBitsPerSample = 16;
+	h->data = 0x61746164;
+	h->datalen = datalen;
+}
+
+void WAV_header_adpcm(WAV_HEADER_ADPCM *h, uint32_t samplerate, uint32_t wav_blocksize, uint64_t num_samples, uint64_t datalen) {
+	h->rf64 = needs_rf64(riff_size(datalen, WAV_HEADER_ADPCM_SIZE)) || needs_rf64(num_samples);
+	h->RIFF = h->rf64 ? 0x34364652 : 0x46464952;
+	h->riffsize = riff_size(datalen, WAV_HEADER_ADPCM_SIZE + (h->rf64 ? WAV_HEADER_DS64_SIZE : 0));
+	h->WAVE = 0x45564157;
+	h->fmt = 0x20746D66;
+	h->fmtlen = 20;
+	h->wFormatTag = 0x11;
+	h->nChannels = 1;
+	h->nSamplesPerSec = samplerate;
+	h->nAvgBytesPerSec = samplerate * (wav_blocksize + 4) / (wav_blocksize * 2 + 1);
+	h->nBlockAlign = wav_blocksize + 4;
+	h->wBitsPerSample = 4;
+	h->cbSize = 2;
+	h->samplesPerBlock = wav_blocksize * 2 + 1;
+	h->fact = 0x74636166;
+	h->factlen = 4;
+	h->nSamples = num_samples;
+	h->data = 0x61746164;
+	h->datalen = datalen;
+}
+
+// "RF64" or "RIFF" and the WAVE form, with the ds64 chunk of RF64: RIFF size, data size, sample count, no table
+// riffsize is recomputed, so that a header can be made RF64 after it was filled
+static unsigned char *write_riff(unsigned char *buf, int rf64, uint64_t riffsize, uint32_t size, uint64_t datalen, uint64_t samples) {
+	if (!rf64) {
+		buf = put32(buf, 0x46464952);
+		buf = put32(buf, riffsize);
+		return put32(buf, 0x45564157);
+	}
+	buf = put32(buf, 0x34364652);
+	buf = put32(buf, 0xFFFFFFFF);
+	buf = put32(buf, 0x45564157);
+	buf = put32(buf, 0x34367364);
+	buf = put32(buf, WAV_HEADER_DS64_SIZE - 8);
+	buf = put64(buf, riff_size(datalen, size + WAV_HEADER_DS64_SIZE));
+	buf = put64(buf, datalen);
+	buf = put64(buf, samples);
+	return put32(buf, 0);
+}
+
+uint32_t WAV_write_header_pcm(const WAV_HEADER_PCM *h, unsigned char *buf) {
+	buf = write_riff(buf, h->rf64, h->riffsize, WAV_HEADER_PCM_SIZE, h->datalen, (h->datalen == WAV_SIZE_UNKNOWN) ? WAV_SIZE_UNKNOWN : h->datalen / 2);
+	buf = put32(buf, h->fmt);
+	buf = put32(buf, h->fmtlen);
+	buf = put16(buf, h->wFormatTag);
+	buf = put16(buf, h->nChannels);
+	buf = put32(buf, h->nSamplesPerSec);
+	buf = put32(buf, h->nAvgBytesPerSec);
+	buf = put16(buf, h->nBlockAlign);
+	buf = put16(buf, h->wBitsPerSample);
+	buf = put32(buf, h->data);
+	put32(buf, h->rf64 ? 0xFFFFFFFF : h->datalen);
+	return WAV_HEADER_PCM_SIZE + (h->rf64 ? WAV_HEADER_DS64_SIZE : 0);
+}
+
+uint32_t WAV_write_header_adpcm(const WAV_HEADER_ADPCM *h, unsigned char *buf) {
+	buf = write_riff(buf, h->rf64, h->riffsize, WAV_HEADER_ADPCM_SIZE, h->datalen, h->nSamples);
+	buf = put32(buf, h->fmt);
+	buf = put32(buf, h->fmtlen);
+	buf = put16(buf, h->wFormatTag);
+	buf = put16(buf, h->nChannels);
+	buf = put32(buf, h->nSamplesPerSec);
+	buf = put32(buf, h->nAvgBytesPerSec);
+	buf = put16(buf, h->nBlockAlign);
+	buf = put16(buf, h->wBitsPerSample);
+	buf = put16(buf, h->cbSize);
+	buf = put16(buf, h->samplesPerBlock);
+	buf = put32(buf, h->fact);
+	buf = put32(buf, h->factlen);
+	buf = put32(buf, h->rf64 ? 0xFFFFFFFF : h->nSamples);
+	buf = put32(buf, h->data);
+	put32(buf, h->rf64 ? 0xFFFFFFFF : h->datalen);
+	return WAV_HEADER_ADPCM_SIZE + (h->rf64 ? WAV_HEADER_DS64_SIZE : 0);
+}
+
+void WAV_write_block_header(const WAV_BLOCK_HEADER *h, unsigned char *buf) {
+	buf = put16(buf, h->sample);
+	buf[0] = h->index;
+	buf[1] = h->zero;
+}
+
+
+int WAV_read_header_pcm(WAV_HEADER_PCM *h, const unsigned char *buf, size_t size, uint32_t *data_offset) {
+	size_t pos = 12;
+	uint64_t len, datalen = WAV_SIZE_UNKNOWN;
+	uint32_t id;
+	int fmt = 0;
+	
+	memset(h, 0, sizeof(WAV_HEADER_PCM));
+	if ((size < 12) || ((get32(buf) != 0x46464952) && (get32(buf) != 0x34364652)) || (get32(buf + 8) != 0x45564157))
+		return AUD_ERROR_FORMAT;
+	h->RIFF = get32(buf);
+	h->riffsize = get32(buf + 4);
+	h->WAVE = get32(buf + 8);
+	h->rf64 = (h->RIFF == 0x34364652);
+	
+	// Chunks are word-aligned, other than ds64, fmt and data they are skipped
+	while (size - pos >= 8) {
+		id = get32(buf + pos);
+		len = get32(buf + pos + 4);
+		pos += 8;
+		if ((id == 0x34367364) && h->rf64 && (len >= 24) && (size - pos >= 24)) {
+			h->riffsize = get64(buf + pos);
+			datalen = get64(buf + pos + 8);
+		} else if ((id == 0x20746D66) && (len >= 16) && (size - pos >= 16)) {
+			h->fmt = id;
+			h->fmtlen = len;
+			h->wFormatTag = get16(buf + pos);
+			h->nChannels = get16(buf + pos + 2);
+			h->nSamplesPerSec = get32(buf + pos + 4);
+			h->nAvgBytesPerSec = get32(buf + pos + 8);
+			h->nBlockAlign = get16(buf + pos + 12);
+			h->wBitsPerSample = get16(buf + pos + 14);
+			fmt = 1;
+		} else if ((id == 0x61746164) && fmt) {
+			if (h->rf64 && (len == 0xFFFFFFFF))
+				len = datalen;
+			h->data = id;
+			h->datalen = (len > size - pos) ? size - pos : len; // streamed or cut short
+			*data_offset = pos;
+			return ((h->wFormatTag == 1) && (h->nChannels == 1) && (h->wBitsPerSample == 16)) ? AUD_OK : AUD_ERROR_UNSUPPORTED;
+		}
+		if (len > size - pos) break;
+		pos += len + (len & 1);
+	}
+	return AUD_ERROR_FORMAT;
+}
+
+
+/******************************** Input ********************************/
+
+static int set_error(AUD_CONTEXT *ctx, int error, const char *format, ...) {
+	va_list ap;
+	
+	va_start(ap, format);
+	vsnprintf(ctx->message, sizeof(ctx->message), format, ap);
+	va_end(ap);
+	ctx->error = error;
+	return error;
+}
+
+static size_t file_read(void *handle, void *buf, size_t size) {
+	return fread(buf, 1, size, (FILE *)handle);
+}
+
+static int file_seek(void *handle, uint64_t offset) {
+	return fseeko((FILE *)handle, offset, SEEK_SET);
+}
+
+static size_t memory_read(void *handle, void *buf, size_t size) {
+	AUD_MEMORY *m = handle;
+	
+	if (size > m->size - m->pos)
+		size = m->size - m->pos;
+	memcpy(buf, &m->data[m->pos], size);
+	m->pos += size;
+	return size;
+}
+
+static int memory_seek(void *handle, uint64_t offset) {
+	AUD_MEMORY *m = handle;
+	
+	if (offset > m->size) return -1;
+	m->pos = offset;
+	return 0;
+}
+
+// Reads from AUD input, serving the bytes already consumed by format detection first
+static size_t aud_read(AUD_CONTEXT *ctx, void *buf, size_t size) {
+	size_t n = 0;
+	
+	if (ctx->head_pos < ctx->head_len) {
+		n = ctx->head_len - ctx->head_pos;
+		if (n > size) n = size;
+		memcpy(buf, &ctx->head[ctx->head_pos], n);
+		ctx->head_pos += n;
+	}
+	if (n < size)
+		n += ctx->io.read(ctx->io.handle, (unsigned char *)buf + n, size - n);
+	ctx->in_offset += n;
+	return n;
+}
+
+// Reads next AUD block header and makes block point to its payload: straight into memory for
+// memory-backed input (zero-copy), or into in_buffer after reading it
+// Returns payload size, or -1 at the end of stream (clean end of file is not an error)
+static int read_block(AUD_CONTEXT *ctx) {
+	unsigned char buf[AUD_BLOCK_HEADER_SIZE];
+	AUD_BLOCK_HEADER *block_header = &ctx->block_header;
+	size_t reat;
+	
+	reat = aud_read(ctx, buf, AUD_BLOCK_HEADER_SIZE);
+	if (reat == 0) return -1; // end of file, OK
+	if (reat != AUD_BLOCK_HEADER_SIZE)
+		return set_error(ctx, AUD_ERROR_READ, "error while %s file, read %u bytes of header instead of %u", ctx->stage, (unsigned)reat, AUD_BLOCK_HEADER_SIZE), -1;
+	get_block_header(block_header, buf);
+	if ((block_header->deaf != 0xDEAF) || (block_header->zero != 0))
+		return set_error(ctx, AUD_ERROR_READ, "error while %s file, invalid header @ offset %llu", ctx->stage, (unsigned long long)ctx->in_offset - AUD_BLOCK_HEADER_SIZE), -1;
+	if (ctx->memory.data && (ctx->head_pos == ctx->head_len)) {
+		reat = ctx->memory.size - ctx->memory.pos;
+		if (reat > block_header->encsize) reat = block_header->encsize;
+		ctx->block = &ctx->memory.data[ctx->memory.pos];
+		ctx->memory.pos += reat;
+		ctx->in_offset += reat;
+	} else {
+		reat = aud_read(ctx, ctx->in_buffer, block_header->encsize);
+		ctx->block = ctx->in_buffer;
+	}
+	if (reat != block_header->encsize)
+		return set_error(ctx, AUD_ERROR_READ, "error while %s file, read %u bytes instead of %u", ctx->stage, (unsigned)reat, block_header->encsize), -1;
+	return block_header->encsize;
+}
+
+// Makes the next block current, returns 0 at the end of stream
+static int next_block(AUD_CONTEXT *ctx) {
+	int size;
+	
+	if (ctx->eof) return 0;
+	
+	// Don't go beyond the blocks counted by AUD_probe(), same as the first read-through, or the range
+	if (ctx->probed && (ctx->blocks_read == ctx->header.blocks))
+		size = -1;
+	else if (ctx->range_end && (ctx->bytes_read * 2 >= ctx->range_end))
+		size = -1;
+	else
+		size = read_block(ctx);
+	
+	if (size < 0) {
+		ctx->eof = 1;
+		if (!ctx->probed) {
+			// End of a single-pass stream, now we know the counts
+			ctx->header.blocks = ctx->blocks_read;
+			ctx->header.adpcm_bytes = ctx->bytes_read;
+			ctx->header.num_samples = ctx->bytes_read * 2;
+		}
+		return 0;
+	}
+	
+	if (!ctx->probed) {
+		if (ctx->blocks_read == 0)
+			ctx->header.first_block_size = size;
+		ctx->header.last_block_size = size;
+	}
+	ctx->block_size = size;
+	ctx->block_end = size * 2;
+	if (ctx->range_end && (ctx->bytes_read * 2 + ctx->block_end > ctx->range_end))
+		ctx->block_end = ctx->range_end - ctx->bytes_read * 2;
+	ctx->block_pos = 0;
+	ctx->blocks_read++;
+	ctx->bytes_read += size;
+	return 1;
+}
+
+// Returns number of nibbles left in the current block, moving to the next one if needed, 0 at the end
+static uint32_t nibbles_left(AUD_CONTEXT *ctx) {
+	
+	while (ctx->block_pos == ctx->block_end)
+		if (!next_block(ctx)) return 0;
+	return ctx->block_end - ctx->block_pos;
+}
+
+static inline unsigned char get_nibble(const unsigned char *in, uint32_t pos) {
+	return (in[pos >> 1] >> ((pos & 1) * 4)) & 0xF;
+}
+
+// out[i] = high nibble of in[i] | low nibble of in[i + 1], that is the nibble stream moved by one nibble
+static void shift_nibbles(unsigned char *out, const unsigned char *in, uint32_t bytes) {
+	uint32_t i = 0;
+#ifdef __SSE2__
+	__m128i lo = _mm_set1_epi8(0x0F), hi = _mm_set1_epi8((char)0xF0);
+	
+	for (; i + 16 <= bytes; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)&in[i]);
+		__m128i b = _mm_loadu_si128((const __m128i *)&in[i + 1]);
+		a = _mm_and_si128(_mm_srli_epi16(a, 4), lo);
+		b = _mm_and_si128(_mm_slli_epi16(b, 4), hi);
+		_mm_storeu_si128((__m128i *)&out[i], _mm_or_si128(a, b));
+	}
+#endif
+	for (; i < bytes; i++)
+		out[i] = (in[i] >> 4) | (in[i + 1] << 4);
+}
+
+// Copies n nibbles from nibble pos of in to nibble o of out, least significant nibble first
+// Whole bytes are copied, or shifted when pos and o differ in parity (every other WAV block, as it holds 2n+1 samples).
+// A byte is written whole even if it only gets its low nibble, the next call keeps that nibble, so out needn't be zeroed
+static void copy_nibbles(unsigned char *out, uint32_t o, const unsigned char *in, uint32_t pos, uint32_t n) {
+	uint32_t bytes;
+	
+	if (!n) return;
+	if (o & 1) {
+		out[o >> 1] = (out[o >> 1] & 0xF) | (get_nibble(in, pos) << 4);
+		o++;
+		pos++;
+		n--;
+	}
+	out += o >> 1;
+	bytes = n >> 1;
+	if (pos & 1)
+		shift_nibbles(out, &in[pos >> 1], bytes);
+	else
+		memcpy(out, &in[pos >> 1], bytes);
+	if (n & 1)
+		out[bytes] = get_nibble(in, pos + n - 1);
+}
+
+
+
+/******************************** Context ********************************/
+
+static int open_common(AUD_CONTEXT *ctx, const AUD_IO *io, int stream, uint64_t filesize) {
+	AUD_HEADER *h = &ctx->header;
+	const unsigned char *p;
+	AUD_BLOCK_HEADER block_header;
+	
+	ctx->io = *io;
+	ctx->stream = stream || !io->seek;
+	ctx->probed = 0;
+	ctx->analysis = NULL;
+	ctx->error = 0;
+	ctx->message[0] = 0;
+	memset(h, 0, sizeof(AUD_HEADER));
+	h->filesize = filesize;
+	
+	// Read enough bytes to detect either format, they will be served again by aud_read()
+	
+	ctx->head_len = io->read(io->handle, ctx->head, sizeof(ctx->head));
+	ctx->head_pos = 0;
+	ctx->in_offset = 0;
+	
+	// Try to read block header at position after NEW format header
+	
+	get_block_header(&block_header, &ctx->head[AUD_HEADER_NEW_SIZE]); // read block (bytes 12..19)
+	if ((ctx->head_len >= AUD_HEADER_NEW_SIZE + AUD_BLOCK_HEADER_SIZE) && (block_header.deaf == 0xDEAF) && (block_header.zero == 0)) {
+		
+		// Matched NEW format AUD
+		
+		p = ctx->head;
+		h->format = AUD_FORMAT_NEW;
+		h->first_block_offset = AUD_HEADER_NEW_SIZE;
+		h->samplerate = get16(p);
+		h->encsize = get16(p + 2) + (get16(p + 4) << 16);
+		h->decsize = get16(p + 6) + (get16(p + 8) << 16);
+		h->flags = p[10];
+		h->codec = p[11];
+	} else {
+		
+		// Try to read block header at position after OLD format header
+		
+		get_block_header(&block_header, &ctx->head[AUD_HEADER_OLD_SIZE]); // (bytes 8..15)
+		if ((ctx->head_len >= AUD_HEADER_OLD_SIZE + AUD_BLOCK_HEADER_SIZE) && (block_header.deaf == 0xDEAF) && (block_header.zero == 0)) {
+			
+			// Matched OLD format AUD
+			
+			p = ctx->head;
+			h->format = AUD_FORMAT_OLD;
+			h->first_block_offset = AUD_HEADER_OLD_SIZE;
+			h->samplerate = get16(p);
+			h->encsize = get16(p + 2) + (get16(p + 4) << 16);
+			h->decsize = 0;
+			h->flags = p[6];
+			h->codec = p[7];
+		} else
+			return set_error(ctx, AUD_ERROR_FORMAT, "unknown AUD format");
+	}
+	ctx->head_pos = ctx->in_offset = h->first_block_offset;
+	if (ctx->memory.data) {
+		// Memory-backed input doesn't need read ahead, blocks are accessed in place
+		ctx->memory.pos = h->first_block_offset;
+		ctx->head_pos = ctx->head_len;
+	}
+	h->num_samples = h->decsize / 2; // estimate until the stream is probed
+	
+	// Prepare decoder for the first block
+	
+	ctx->stage = ctx->stream ? "streaming" : "reading";
+	ctx->block_size = ctx->block_end = ctx->block_pos = 0;
+	ctx->blocks_read = ctx->bytes_read = 0;
+	ctx->eof = 0;
+	ctx->algorithm = 0;
+	ctx->kernel = ADPCM_kernel(0);
+	ctx->adpcm_index = 0;
+	ctx->adpcm_sample = 0;
+	memset(ctx->all_index, 0, sizeof(ctx->all_index));
+	memset(ctx->all_sample, 0, sizeof(ctx->all_sample));
+	ctx->remuxing = 0;
+	ctx->range_index = NULL;
+	ctx->range_start = ctx->range_end = 0;
+	
+	if (((h->flags & 3) != 2) || (h->codec != 99))
+		return set_error(ctx, AUD_ERROR_UNSUPPORTED, "Sorry, only mono 16-bit IMA ADPCM files are supported");
+	
+	return AUD_OK;
+}
+
+int AUD_open(AUD_CONTEXT *ctx, const AUD_IO *io, int stream) {
+	ctx->file = NULL;
+	ctx->memory.data = NULL;
+	ctx->map = NULL;
+	return open_common(ctx, io, stream, 0);
+}
+
+int AUD_open_file(AUD_CONTEXT *ctx, FILE *f, int stream) {
+	AUD_IO io = { file_read, file_seek, f };
+	int64_t filesize = 0;
+#ifdef AUDLIB_MMAP
+	struct stat st;
+	void *map;
+#endif
+	
+	ctx->file = f;
+	ctx->memory.data = NULL;
+	ctx->map = NULL;
+
+#ifdef AUDLIB_MMAP
+	// Regular files are mapped, so that blocks can be decoded in place without copying
+	
+	if ((fstat(fileno(f), &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0) && ((uint64_t)st.st_size <= SIZE_MAX) && (ftello(f) == 0)) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			ctx->map = map;
+			ctx->map_size = st.st_size;
+			ctx->memory.data = map;
+			ctx->memory.size = st.st_size;
+			ctx->memory.pos = 0;
+			io.read = memory_read;
+			io.seek = memory_seek;
+			io.handle = &ctx->memory;
+			return open_common(ctx, &io, stream, stream ? 0 : st.st_size);
+		}
+	}
+#endif
+	
+	// Fall back to buffered reads, non-seekable input (pipe) can only be converted in a single pass
+	
+	if ((fseeko(f, 0, SEEK_END) == 0) && ((filesize = ftello(f)) >= 0)) {
+		fseeko(f, 0, SEEK_SET);
+	} else {
+		filesize = 0;
+		io.seek = NULL;
+	}
+	
+	return open_common(ctx, &io, stream, stream ? 0 : filesize);
+}
+
+int AUD_open_memory(AUD_CONTEXT *ctx, const void *data, size_t size) {
+	AUD_IO io = { memory_read, memory_seek, &ctx->memory };
+	
+	ctx->memory.data = data;
+	ctx->memory.size = size;
+	ctx->memory.pos = 0;
+	ctx->file = NULL;
+	ctx->map = NULL;
+	return open_common(ctx, &io, 0, size);
+}
+
+// Jumps to the last checkpoint before range_start, then decodes the rest of the way without output
+static int seek_range(AUD_CONTEXT *ctx) {
+	const AUD_INDEX *index = ctx->range_index;
+	const AUD_CHECKPOINT *cp;
+	uint64_t lo = 0, hi = index->count, mid;
+	uint32_t skip, pos, n;
+	short pcm[256];
+	
+	if (index->algorithm != ((ctx->algorithm == 1) ? 0 : ctx->algorithm))
+		return set_error(ctx, AUD_ERROR_STATE, "index was built for algorithm #%d, not #%d", index->algorithm, ctx->algorithm);
+	
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (index->checkpoints[mid].sample <= ctx->range_start)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	cp = &index->checkpoints[lo];
+	if (ctx->io.seek(ctx->io.handle, cp->offset) != 0)
+		return set_error(ctx, AUD_ERROR_SEEK, "can't seek to the block @ offset %llu", (unsigned long long)cp->offset);
+	ctx->head_pos = ctx->head_len;
+	ctx->in_offset = cp->offset;
+	
+	ctx->block_size = ctx->block_end = ctx->block_pos = 0;
+	ctx->blocks_read = lo;
+	ctx->bytes_read = cp->sample / 2;
+	ctx->eof = 0;
+	ctx->adpcm_index = cp->adpcm_index;
+	ctx->adpcm_sample = cp->adpcm_sample;
+	ctx->remuxing = 0;
+	
+	skip = ctx->range_start - cp->sample;
+	if (!skip) return AUD_OK;
+	if (nibbles_left(ctx) < skip)
+		return set_error(ctx, AUD_ERROR_READ, "error while seeking, block @ offset %llu doesn't match the index", (unsigned long long)cp->offset);
+	if (ctx->algorithm <= 1)
+		advance_algo0(ctx->block, 0, skip, &ctx->adpcm_index, &ctx->adpcm_sample);
+	else for (pos = 0; pos < skip; pos += n) {
+		n = (skip - pos < 256) ? skip - pos : 256;
+		ctx->kernel(ctx->block, pos, pos + n, pcm, &ctx->adpcm_index, &ctx->adpcm_sample);
+	}
+	ctx->block_pos = skip;
+	return AUD_OK;
+}
+
+// Goes back to the first block (or the start of the range) and resets the decoder, keeps error and message
+static int rewind_stream(AUD_CONTEXT *ctx) {
+	
+	if (ctx->range_end)
+		return seek_range(ctx);
+	
+	if (ctx->in_offset != ctx->header.first_block_offset) {
+		if (ctx->stream)
+			return set_error(ctx, AUD_ERROR_SEEK, "can't read the stream again, input is not seekable");
+		if (ctx->io.seek(ctx->io.handle, ctx->header.first_block_offset) != 0)
+			return set_error(ctx, AUD_ERROR_SEEK, "can't seek to the first block");
+		ctx->head_pos = ctx->head_len;
+		ctx->in_offset = ctx->header.first_block_offset;
+	}
+	
+	ctx->block_size = ctx->block_end = ctx->block_pos = 0;
+	ctx->blocks_read = ctx->bytes_read = 0;
+	ctx->eof = 0;
+	ctx->adpcm_index = 0;
+	ctx->adpcm_sample = 0;
+	memset(ctx->all_index, 0, sizeof(ctx->all_index));
+	memset(ctx->all_sample, 0, sizeof(ctx->all_sample));
+	ctx->remuxing = 0;
+	return AUD_OK;
+}
+
+int AUD_rewind(AUD_CONTEXT *ctx, int algorithm) {
+	
+	if ((ctx->error == AUD_ERROR_FORMAT) || (ctx->error == AUD_ERROR_UNSUPPORTED))
+		return ctx->error;
+	
+	ctx->error = 0;
+	ctx->message[0] = 0;
+	ctx->algorithm = algorithm;
+	ctx->kernel = ADPCM_kernel(algorithm);
+	if (rewind_stream(ctx) != AUD_OK)
+		return ctx->error;
+	return AUD_OK;
+}
+
+int AUD_probe(AUD_CONTEXT *ctx) {
+	AUD_HEADER *h = &ctx->header;
+	int size, res;
+	
+	if (ctx->stream) return AUD_OK; // sample count estimated from header in open_common()
+	
+	ctx->range_index = NULL;
+	ctx->range_start = ctx->range_end = 0;
+	if ((res = AUD_rewind(ctx, 0)) != AUD_OK)
+		return res;
+	
+	// Analyze AUD stream (first read-through), want to count blocks and samples in advance
+	
+	ctx->stage = "analyzing";
+	h->blocks = 0;
+	h->adpcm_bytes = 0;
+	while ((size = read_block(ctx)) >= 0) {
+		if (h->blocks == 0)
+			h->first_block_size = size;
+		h->last_block_size = size;
+		
+		h->blocks++;
+		h->adpcm_bytes += size;
+	}
+	h->num_samples = h->adpcm_bytes * 2;
+	ctx->probed = 1;
+	ctx->stage = "reading";
+	
+	// The readable part of a broken stream will still be converted
+	
+	res = ctx->error ? AUD_WARNING : AUD_OK;
+	ctx->error = 0;
+	if (rewind_stream(ctx) != AUD_OK)
+		return ctx->error;
+	return res;
+}
+
+int AUD_probe_restore(AUD_CONTEXT *ctx, const AUD_HEADER *probed) {
+	AUD_HEADER *h = &ctx->header;
+	
+	if ((ctx->error == AUD_ERROR_FORMAT) || (ctx->error == AUD_ERROR_UNSUPPORTED))
+		return ctx->error;
+	if (ctx->stream)
+		return set_error(ctx, AUD_ERROR_SEEK, "a stored probe needs a seekable stream");
+	if ((probed->format != h->format) || (probed->filesize != h->filesize) || (probed->first_block_offset != h->first_block_offset)
+	 || (probed->encsize != h->encsize) || (probed->decsize != h->decsize) || (probed->samplerate != h->samplerate))
+		return set_error(ctx, AUD_ERROR_STATE, "stored probe doesn't match the stream");
+	
+	*h = *probed;
+	ctx->probed = 1;
+	ctx->range_index = NULL;
+	ctx->range_start = ctx->range_end = 0;
+	return AUD_rewind(ctx, 0);
+}
+
+int AUD_probe_headers(AUD_CONTEXT *ctx) {
+	AUD_HEADER *h = &ctx->header;
+	AUD_BLOCK_HEADER *block_header = &ctx->block_header;
+	unsigned char buf[AUD_BLOCK_HEADER_SIZE];
+	int supported = (ctx->error != AUD_ERROR_UNSUPPORTED);
+	int frame = ((h->flags & 1) ? 2 : 1) * ((h->flags & 2) ? 2 : 1); // bytes per decoded sample of all channels
+	uint64_t decoded = 0;
+	uint32_t reat;
+	int res;
+	
+	if (ctx->error == AUD_ERROR_FORMAT) return ctx->error;
+	if (ctx->stream)
+		return set_error(ctx, AUD_ERROR_SEEK, "can't skip over blocks, input is not seekable");
+	
+	ctx->error = 0;
+	ctx->message[0] = 0;
+	ctx->range_index = NULL;
+	ctx->range_start = ctx->range_end = 0;
+	if (rewind_stream(ctx) != AUD_OK)
+		return ctx->error;
+#ifdef AUDLIB_MMAP
+	if (ctx->map) // only the headers are touched, don't read the payloads ahead
+		madvise(ctx->map, ctx->map_size, MADV_RANDOM);
+#endif
+	
+	ctx->stage = "analyzing";
+	h->blocks = 0;
+	h->adpcm_bytes = 0;
+	while ((reat = aud_read(ctx, buf, AUD_BLOCK_HEADER_SIZE)) == AUD_BLOCK_HEADER_SIZE) {
+		get_block_header(block_header, buf);
+		if ((block_header->deaf != 0xDEAF) || (block_header->zero != 0)) {
+			set_error(ctx, AUD_ERROR_READ, "error while %s file, invalid header @ offset %llu", ctx->stage, (unsigned long long)ctx->in_offset - AUD_BLOCK_HEADER_SIZE);
+			break;
+		}
+		if (h->filesize && (block_header->encsize > h->filesize - ctx->in_offset)) {
+			set_error(ctx, AUD_ERROR_READ, "error while %s file, read %u bytes instead of %u", ctx->stage, (unsigned)(h->filesize - ctx->in_offset), block_header->encsize);
+			break;
+		}
+		
+		// Skip the payload, bytes left over from format detection included
+		ctx->in_offset += block_header->encsize;
+		ctx->head_pos = ctx->head_len;
+		if (ctx->memory.data)
+			ctx->memory.pos = ctx->in_offset;
+		else if (ctx->io.seek(ctx->io.handle, ctx->in_offset) != 0) {
+			set_error(ctx, AUD_ERROR_SEEK, "error while %s file, can't seek to offset %llu", ctx->stage, (unsigned long long)ctx->in_offset);
+			break;
+		}
+		
+		if (h->blocks == 0)
+			h->first_block_size = block_header->encsize;
+		h->last_block_size = block_header->encsize;
+		h->blocks++;
+		h->adpcm_bytes += block_header->encsize;
+		decoded += block_header->decsize;
+	}
+	if (reat && (reat != AUD_BLOCK_HEADER_SIZE) && !ctx->error)
+		set_error(ctx, AUD_ERROR_READ, "error while %s file, read %u bytes of header instead of %u", ctx->stage, reat, AUD_BLOCK_HEADER_SIZE);
+	h->num_samples = supported ? h->adpcm_bytes * 2 : decoded / frame;
+	ctx->probed = 1;
+	ctx->stage = "reading";
+#ifdef AUDLIB_MMAP
+	if (ctx->map)
+		madvise(ctx->map, ctx->map_size, MADV_SEQUENTIAL);
+#endif
+	
+	res = ctx->error ? AUD_WARNING : AUD_OK;
+	ctx->error = 0;
+	if (rewind_stream(ctx) != AUD_OK)
+		return ctx->error;
+	if (!supported)
+		return set_error(ctx, AUD_ERROR_UNSUPPORTED, "Sorry, only mono 16-bit IMA ADPCM files are supported");
+	return res;
+}
+
+long AUD_decode(AUD_CONTEXT *ctx, short *pcm, uint32_t max_samples) {
+	uint32_t n = 0, pos, end;
+	const unsigned char *in;
+	char adpcm_index = ctx->adpcm_index;
+	long adpcm_sample = ctx->adpcm_sample;
+	
+	if (ctx->error < 0) return ctx->error;
+	
+	while (n < max_samples) {
+		if (ctx->block_pos == ctx->block_end) {
+			if (!next_block(ctx)) break;
+			continue;
+		}
+		in = ctx->block;
+		pos = ctx->block_pos;
+		end = ctx->block_end;
+		if (end - pos > max_samples - n)
+			end = pos + (max_samples - n);
+		ctx->kernel(in, pos, end, &pcm[n], &adpcm_index, &adpcm_sample);
+		n += end - pos;
+		ctx->block_pos = end;
+	}
+	
+	ctx->adpcm_index = adpcm_index;
+	ctx->adpcm_sample = adpcm_sample;
+	if (ctx->analysis)
+		AUD_analyze(ctx->analysis, pcm, n);
+	return n;
+}
+
+long AUD_decode_all(AUD_CONTEXT *ctx, short **pcm, uint32_t max_samples) {
+	uint32_t n = 0, pos, end;
+	int a;
+	
+	if (ctx->error < 0) return ctx->error;
+	if (ctx->remuxing || ctx->range_end || ctx->algorithm)
+		return set_error(ctx, AUD_ERROR_STATE, "decoding with all algorithms needs the whole stream, rewound with AUD_rewind(ctx, 0)");
+	
+	// Every block is decoded by all algorithms while it's at hand, the input is read only once
+	
+	while (n < max_samples) {
+		if (ctx->block_pos == ctx->block_end) {
+			if (!next_block(ctx)) break;
+			continue;
+		}
+		pos = ctx->block_pos;
+		end = ctx->block_end;
+		if (end - pos > max_samples - n)
+			end = pos + (max_samples - n);
+		for (a = 0; a < ADPCM_ALGORITHMS; a++)
+			ADPCM_kernel(a)(ctx->block, pos, end, &pcm[a][n], &ctx->all_index[a], &ctx->all_sample[a]);
+		n += end - pos;
+		ctx->block_pos = end;
+	}
+	
+	ctx->adpcm_index = ctx->all_index[0];
+	ctx->adpcm_sample = ctx->all_sample[0];
+	return n;
+}
+
+void AUD_choose_blocksize(int blocksize, uint64_t num_samples, uint32_t *wav_blocksize, uint64_t *wav_blocks, uint64_t *wav_datalen) {
+	uint32_t i;
+	// These are used for finding optimal blocksize
+	uint64_t test_blocks;
+	uint32_t test_samples_per_block;
+	uint64_t test_datalen;
+	
+	*wav_datalen = UINT64_MAX;
+	
+	switch (blocksize) {
+		
+		case -1: // Find an ACM-compatible blocksize with smallest resulting file size, using bruteforce
+			for (i = 8; i <= 2760; i += 4) {
+				test_samples_per_block = (i - 4) * 2 + 1;
+				test_blocks = num_samples / test_samples_per_block;
+				if (num_samples % test_samples_per_block)
+					test_blocks++;
+				test_datalen = i * test_blocks;
+				if (test_datalen < *wav_datalen) {
+					*wav_blocksize = i - 4;
+					*wav_blocks = test_blocks;
+					*wav_datalen = test_datalen;
+				}
+			}
+			break;
+		
+		case -2: // Find any blocksize with smallest resulting file size, using bruteforce
+			for (i = 4; i <= 32771; i++) {
+				test_samples_per_block = (i - 4) * 2 + 1;
+				test_blocks = num_samples / test_samples_per_block;
+				if (num_samples % test_samples_per_block)
+					test_blocks++;
+				test_datalen = i * test_blocks;
+				if (test_datalen < *wav_datalen) {
+					*wav_blocksize = i - 4;
+					*wav_blocks = test_blocks;
+					*wav_datalen = test_datalen;
+				}
+			}
+			break;
+		
+		default: // Use default or user-specified blocksize
+			*wav_blocksize = blocksize - 4;
+			test_samples_per_block = *wav_blocksize * 2 + 1;
+			*wav_blocks = num_samples / test_samples_per_block;
+			if (num_samples % test_samples_per_block)
+				(*wav_blocks)++;
+			*wav_datalen = (uint64_t)blocksize * *wav_blocks;
+	}
+}
+
+int AUD_remux_begin(AUD_CONTEXT *ctx, int blocksize) {
+	int res;
+	
+	if (((blocksize < 4) || (blocksize > 32771)) && (blocksize != -1) && (blocksize != -2))
+		return set_error(ctx, AUD_ERROR_STATE, "invalid block size %d", blocksize);
+	
+	if ((res = AUD_rewind(ctx, 0)) != AUD_OK)
+		return res;
+	
+	ctx->wav_blocks_written = 0;
+	ctx->wav_block_len = 0;
+	ctx->wav_block_pos = 0;
+	ctx->remuxing = 1;
+	ctx->verify = 0;
+	
+	// Find optimal blocksize if needed
+	// Initialize variables: wav_blocksize, wav_blocks, wav_datalen
+	
+	if ((blocksize < 0) && !ctx->header.num_samples && !ctx->probed) {
+		AUD_choose_blocksize(512, 0, &ctx->wav_blocksize, &ctx->wav_blocks, &ctx->wav_datalen);
+		set_error(ctx, AUD_WARNING, "Sample count is unknown, can't find optimal block size, using 512");
+		ctx->error = 0;
+		return AUD_WARNING;
+	}
+	AUD_choose_blocksize(blocksize, ctx->range_end ? ctx->range_end - ctx->range_start : ctx->header.num_samples, &ctx->wav_blocksize, &ctx->wav_blocks, &ctx->wav_datalen);
+	return AUD_OK;
+}
+
+int AUD_remux_verify(AUD_CONTEXT *ctx, int verify) {
+	if (!ctx->remuxing || ctx->wav_blocks_written || ctx->wav_block_len)
+		return set_error(ctx, AUD_ERROR_STATE, "verification has to be set up right after AUD_remux_begin()");
+	ctx->verify = verify;
+	ctx->verifier.aud_index = ctx->adpcm_index;
+	ctx->verifier.aud_sample = ctx->adpcm_sample;
+	return AUD_OK;
+}
+
+// Checks the header of a remuxed WAV block, which starts the WAV decoder: its sample has to be the verifier's
+// own decoding of nibble pos of the stream. Returns 1 if it matches
+static int verify_header(AUD_VERIFY *v, const unsigned char *in, uint32_t pos, const unsigned char *block) {
+	short pcm[1];
+	
+	ADPCM_kernel(0)(in, pos, pos + 1, pcm, &v->aud_index, &v->aud_sample);
+	v->wav_sample = (int16_t)get16(block);
+	v->wav_index = block[2];
+	v->expected = v->aud_sample;
+	v->got = v->wav_sample;
+	return (v->wav_sample == v->aud_sample) && (block[2] <= 88);
+}
+
+// Decodes nibbles pos..pos+n-1 of the stream, and the same nibbles as copied to WAV block data at o,
+// each with its own decoder. Returns the number of matching samples, n if all of them match
+static uint32_t verify_nibbles(AUD_VERIFY *v, const unsigned char *in, uint32_t pos, const unsigned char *wav, uint32_t o, uint32_t n) {
+	short expected[256], got[256];
+	uint32_t i, j, m;
+	
+	for (i = 0; i < n; i += m) {
+		m = (n - i < 256) ? n - i : 256;
+		ADPCM_kernel(0)(in, pos + i, pos + i + m, expected, &v->aud_index, &v->aud_sample);
+		ADPCM_kernel(1)(wav, o + i, o + i + m, got, &v->wav_index, &v->wav_sample);
+		if (memcmp(expected, got, m * sizeof(short)) == 0) continue;
+		for (j = 0; expected[j] == got[j]; j++);
+		v->expected = expected[j];
+		v->got = got[j];
+		return i + j;
+	}
+	return n;
+}
+
+// sample: of the remuxed stream, where the check failed
+static int verify_failed(AUD_CONTEXT *ctx, const AUD_VERIFY *v, uint64_t sample) {
+	return set_error(ctx, AUD_ERROR_VERIFY, "remuxed data decodes to %d instead of %d at sample %llu (WAV block %llu)",
+	                 v->got, v->expected, (unsigned long long)sample, (unsigned long long)sample / (ctx->wav_blocksize * 2 + 1));
+}
+
+// Moves the decoder over nibbles pos..end-1 of the current block without keeping the samples,
+// they are decoded only when they are analyzed
+static void advance_block(AUD_CONTEXT *ctx, uint32_t pos, uint32_t end) {
+	short pcm[256];
+	uint32_t n;
+	
+	if (!ctx->analysis) {
+		advance_algo0(ctx->block, pos, end, &ctx->adpcm_index, &ctx->adpcm_sample);
+		return;
+	}
+	for (; pos < end; pos += n) {
+		n = (end - pos < 256) ? end - pos : 256;
+		ctx->kernel(ctx->block, pos, pos + n, pcm, &ctx->adpcm_index, &ctx->adpcm_sample);
+		AUD_analyze(ctx->analysis, pcm, n);
+	}
+}
+
+// Produces the next WAV block into block (header + wav_blocksize bytes), returns 0 at the end of stream, or error
+static int remux_block(AUD_CONTEXT *ctx, unsigned char *block) {
+	WAV_BLOCK_HEADER wav_block_header;
+	unsigned char *out = &block[WAV_BLOCK_HEADER_SIZE];
+	uint64_t first = ctx->wav_blocks_written * (ctx->wav_blocksize * 2 + 1); // sample of the header
+	short pcm[1];
+	uint32_t o, n, m;
+	
+	// First sample of the block goes into its header, along with decoder state
+	
+	if (!nibbles_left(ctx)) return 0;
+	ctx->kernel(ctx->block, ctx->block_pos, ctx->block_pos + 1, pcm, &ctx->adpcm_index, &ctx->adpcm_sample);
+	if (ctx->analysis)
+		AUD_analyze(ctx->analysis, pcm, 1);
+	wav_block_header.sample = ctx->adpcm_sample;
+	wav_block_header.index = ctx->adpcm_index;
+	wav_block_header.zero = 0;
+	WAV_write_block_header(&wav_block_header, block);
+	if (ctx->verify && !verify_header(&ctx->verifier, ctx->block, ctx->block_pos, block))
+		return verify_failed(ctx, &ctx->verifier, first);
+	ctx->block_pos++;
+	
+	// Then the nibbles are copied as they are, the decoder only needs to keep track of its state
+	
+	for (o = 0; o < ctx->wav_blocksize * 2; o += n) {
+		if (!(n = nibbles_left(ctx))) break;
+		if (n > ctx->wav_blocksize * 2 - o) n = ctx->wav_blocksize * 2 - o;
+		advance_block(ctx, ctx->block_pos, ctx->block_pos + n);
+		copy_nibbles(out, o, ctx->block, ctx->block_pos, n);
+		if (ctx->verify && ((m = verify_nibbles(&ctx->verifier, ctx->block, ctx->block_pos, out, o, n)) < n))
+			return verify_failed(ctx, &ctx->verifier, first + 1 + o + m);
+		ctx->block_pos += n;
+	}
+	if (o < ctx->wav_blocksize * 2) // last block is padded with zeros, a lone low nibble already has a zero high nibble
+		memset(&out[(o + 1) >> 1], 0, ctx->wav_blocksize - ((o + 1) >> 1));
+	
+	ctx->wav_blocks_written++;
+	return 1;
+}
+
+long AUD_remux(AUD_CONTEXT *ctx, unsigned char *buf, uint32_t size) {
+	uint32_t done = 0, n;
+	int res;
+	
+	if (ctx->error < 0) return ctx->error;
+	if (!ctx->remuxing)
+		return set_error(ctx, AUD_ERROR_STATE, "AUD_remux_begin() was not called");
+	
+	while (done < size) {
+		if (ctx->wav_block_pos == ctx->wav_block_len) {
+			// Whole blocks go straight to buf, only a block split between calls is assembled in wav_block
+			n = WAV_BLOCK_HEADER_SIZE + ctx->wav_blocksize;
+			if (size - done >= n) {
+				if ((res = remux_block(ctx, &buf[done])) <= 0) {
+					if (res < 0) return res;
+					break;
+				}
+				done += n;
+				continue;
+			}
+			if ((res = remux_block(ctx, ctx->wav_block)) <= 0) {
+				if (res < 0) return res;
+				break;
+			}
+			ctx->wav_block_len = n;
+			ctx->wav_block_pos = 0;
+		}
+		n = ctx->wav_block_len - ctx->wav_block_pos;
+		if (n > size - done) n = size - done;
+		memcpy(&buf[done], &ctx->wav_block[ctx->wav_block_pos], n);
+		ctx->wav_block_pos += n;
+		done += n;
+	}
+	return done;
+}
+
+int AUD_multi_begin(AUD_CONTEXT *ctx, AUD_OUTPUT *outputs, int count) {
+	AUD_OUTPUT *o;
+	uint64_t samples;
+	int i, res, unknown = 0;
+	
+	for (i = 0; i < count; i++)
+		if (outputs[i].blocksize && ((outputs[i].blocksize < 4) || (outputs[i].blocksize > 32771)) && (outputs[i].blocksize != -1) && (outputs[i].blocksize != -2))
+			return set_error(ctx, AUD_ERROR_STATE, "invalid block size %d", outputs[i].blocksize);
+	
+	if ((res = AUD_rewind(ctx, 0)) != AUD_OK)
+		return res;
+	
+	samples = ctx->range_end ? ctx->range_end - ctx->range_start : ctx->header.num_samples;
+	for (i = 0; i < count; i++) {
+		o = &outputs[i];
+		o->wav_blocksize = o->wav_blocks = o->wav_datalen = 0;
+		o->wav_blocks_written = 0;
+		o->wav_block_pos = 0;
+		o->len = 0;
+		if (!o->blocksize) continue;
+		if ((o->blocksize < 0) && !samples && !ctx->probed) {
+			AUD_choose_blocksize(512, 0, &o->wav_blocksize, &o->wav_blocks, &o->wav_datalen);
+			unknown = 1;
+		} else
+			AUD_choose_blocksize(o->blocksize, samples, &o->wav_blocksize, &o->wav_blocks, &o->wav_datalen);
+	}
+	if (unknown) {
+		set_error(ctx, AUD_WARNING, "Sample count is unknown, can't find optimal block size, using 512");
+		ctx->error = 0;
+		return AUD_WARNING;
+	}
+	return AUD_OK;
+}
+
+uint32_t AUD_multi_samples(const AUD_OUTPUT *output, uint32_t size) {
+	uint32_t blocks;
+	
+	if (!output->blocksize)
+		return size / 2;
+	blocks = size / (WAV_BLOCK_HEADER_SIZE + output->wav_blocksize);
+	return (blocks > 2) ? (blocks - 2) * (output->wav_blocksize * 2 + 1) : 0;
+}
+
+// Moves the assembled WAV block to the output buffer, padded with zeros at the end of stream
+static int multi_flush(AUD_CONTEXT *ctx, AUD_OUTPUT *o) {
+	uint32_t nibbles = o->wav_block_pos - 1, n = WAV_BLOCK_HEADER_SIZE + o->wav_blocksize;
+	
+	if (o->size - o->len < n)
+		return set_error(ctx, AUD_ERROR_STATE, "output buffer too small for a WAV block of %u bytes", n);
+	if (nibbles < o->wav_blocksize * 2) // a lone low nibble already has a zero high nibble
+		memset(&o->wav_block[WAV_BLOCK_HEADER_SIZE + ((nibbles + 1) >> 1)], 0, o->wav_blocksize - ((nibbles + 1) >> 1));
+	memcpy(&o->buf[o->len], o->wav_block, n);
+	o->len += n;
+	o->wav_blocks_written++;
+	o->wav_block_pos = 0;
+	return AUD_OK;
+}
+
+long AUD_decode_multi(AUD_CONTEXT *ctx, AUD_OUTPUT *outputs, int count, uint32_t max_samples) {
+	WAV_BLOCK_HEADER wav_block_header;
+	AUD_OUTPUT *o;
+	short *pcm = NULL;
+	uint32_t done = 0, n, left;
+	int i, end = 0;
+	
+	if (ctx->error < 0) return ctx->error;
+	if (ctx->remuxing || ctx->algorithm)
+		return set_error(ctx, AUD_ERROR_STATE, "AUD_multi_begin() was not called");
+	
+	for (i = 0; i < count; i++) {
+		outputs[i].len = 0;
+		if (!outputs[i].blocksize && !pcm)
+			pcm = (short *)outputs[i].buf;
+	}
+	
+	while (done < max_samples) {
+		if (!(n = nibbles_left(ctx))) {
+			end = 1;
+			break;
+		}
+		
+		// Up to the nearest end of a WAV block, the first sample of a block goes alone into its header
+		
+		if (n > max_samples - done) n = max_samples - done;
+		for (i = 0; i < count; i++) {
+			o = &outputs[i];
+			if (!o->blocksize) continue;
+			left = o->wav_block_pos ? o->wav_blocksize * 2 + 1 - o->wav_block_pos : 1;
+			if (n > left) n = left;
+		}
+		
+		// One decoder feeds all outputs, WAV data is copied from the stream as it is
+		
+		if (pcm) {
+			ctx->kernel(ctx->block, ctx->block_pos, ctx->block_pos + n, &pcm[done], &ctx->adpcm_index, &ctx->adpcm_sample);
+			if (ctx->analysis)
+				AUD_analyze(ctx->analysis, &pcm[done], n);
+		} else
+			advance_block(ctx, ctx->block_pos, ctx->block_pos + n);
+		for (i = 0; i < count; i++) {
+			o = &outputs[i];
+			if (!o->blocksize) continue;
+			if (!o->wav_block_pos) {
+				wav_block_header.sample = ctx->adpcm_sample;
+				wav_block_header.index = ctx->adpcm_index;
+				wav_block_header.zero = 0;
+				WAV_write_block_header(&wav_block_header, o->wav_block);
+			} else
+				copy_nibbles(&o->wav_block[WAV_BLOCK_HEADER_SIZE], o->wav_block_pos - 1, ctx->block, ctx->block_pos, n);
+			o->wav_block_pos += n;
+			if ((o->wav_block_pos == o->wav_blocksize * 2 + 1) && (multi_flush(ctx, o) != AUD_OK))
+				return ctx->error;
+		}
+		ctx->block_pos += n;
+		done += n;
+	}
+	
+	// The last blocks are cut short by the end of stream
+	
+	if (end)
+		for (i = 0; i < count; i++)
+			if (outputs[i].wav_block_pos && (multi_flush(ctx, &outputs[i]) != AUD_OK))
+				return ctx->error;
+	for (i = 0; i < count; i++)
+		if (!outputs[i].blocksize) {
+			if ((short *)outputs[i].buf != pcm)
+				memcpy(outputs[i].buf, pcm, done * 2);
+			outputs[i].len = done * 2;
+		}
+	return done;
+}
+
+
+
+/******************************** Seek index ********************************/
+
+// A checkpoint per block: the decoder state can't be derived from the block alone, the stream never resets it.
+// 20 bytes per block of usually 1..2 KB, the index can be kept in memory or next to the file.
+
+int AUD_index_build(AUD_CONTEXT *ctx, AUD_INDEX *index, int algorithm) {
+	AUD_HEADER *h = &ctx->header;
+	AUD_CHECKPOINT *cp;
+	short pcm[256];
+	uint32_t pos, n;
+	int res;
+	
+	index->count = 0;
+	index->checkpoints = NULL;
+	if (!ctx->probed)
+		return set_error(ctx, AUD_ERROR_STATE, "an index can only be built for a probed stream");
+	
+	ctx->range_index = NULL;
+	ctx->range_start = ctx->range_end = 0;
+	if ((res = AUD_rewind(ctx, algorithm)) != AUD_OK)
+		return res;
+	if (!(index->checkpoints = malloc((h->blocks + 1) * sizeof(AUD_CHECKPOINT))))
+		return set_error(ctx, AUD_ERROR_STATE, "not enough memory for an index of %llu blocks", (unsigned long long)h->blocks);
+	index->algorithm = (algorithm == 1) ? 0 : algorithm;
+	index->filesize = h->filesize;
+	index->blocks = h->blocks;
+	index->num_samples = h->num_samples;
+	
+	// Decoder state is recorded before each block is read, then the block is decoded without output
+	
+	ctx->stage = "indexing";
+	while (index->count < h->blocks) {
+		cp = &index->checkpoints[index->count];
+		cp->offset = ctx->in_offset;
+		cp->sample = ctx->bytes_read * 2;
+		cp->adpcm_sample = ctx->adpcm_sample;
+		cp->adpcm_index = ctx->adpcm_index;
+		cp->zero = 0;
+		if (!next_block(ctx)) break;
+		index->count++;
+		
+		if (algorithm <= 1)
+			advance_algo0(ctx->block, 0, ctx->block_end, &ctx->adpcm_index, &ctx->adpcm_sample);
+		else for (pos = 0; pos < ctx->block_end; pos += n) {
+			n = (ctx->block_end - pos < 256) ? ctx->block_end - pos : 256;
+			ctx->kernel(ctx->block, pos, pos + n, pcm, &ctx->adpcm_index, &ctx->adpcm_sample);
+		}
+		ctx->block_pos = ctx->block_end;
+	}
+	ctx->stage = "reading";
+	
+	if (ctx->error < 0) return ctx->error;
+	if (index->count != h->blocks)
+		return set_error(ctx, AUD_ERROR_READ, "stream ended after %llu of %llu blocks while indexing", (unsigned long long)index->count, (unsigned long long)h->blocks);
+	return AUD_rewind(ctx, algorithm);
+}
+
+int AUD_index_save(AUD_CONTEXT *ctx, const AUD_INDEX *index, FILE *f) {
+	unsigned char buf[AUD_INDEX_HEADER_SIZE], *p;
+	uint64_t i;
+	
+	memcpy(buf, "AUDX", 4);
+	buf[4] = AUD_INDEX_VERSION;
+	buf[5] = index->algorithm;
+	p = put16(&buf[6], 0);
+	p = put64(p, index->filesize);
+	p = put64(p, index->blocks);
+	p = put64(p, index->num_samples);
+	put64(p, index->count);
+	if (fwrite(buf, 1, AUD_INDEX_HEADER_SIZE, f) != AUD_INDEX_HEADER_SIZE)
+		return set_error(ctx, AUD_ERROR_WRITE, "error writing index header");
+	
+	for (i = 0; i < index->count; i++) {
+		const AUD_CHECKPOINT *cp = &index->checkpoints[i];
+		p = put64(buf, cp->offset);
+		p = put64(p, cp->sample);
+		p = put16(p, cp->adpcm_sample);
+		p[0] = cp->adpcm_index;
+		p[1] = 0;
+		if (fwrite(buf, 1, AUD_INDEX_CHECKPOINT_SIZE, f) != AUD_INDEX_CHECKPOINT_SIZE)
+			return set_error(ctx, AUD_ERROR_WRITE, "error writing index checkpoint %llu", (unsigned long long)i);
+	}
+	return AUD_OK;
+}
+
+int AUD_index_load(AUD_CONTEXT *ctx, AUD_INDEX *index, FILE *f) {
+	AUD_HEADER *h = &ctx->header;
+	unsigned char buf[AUD_INDEX_HEADER_SIZE];
+	AUD_CHECKPOINT *cp;
+	uint64_t i;
+	
+	index->count = 0;
+	index->checkpoints = NULL;
+	if (!ctx->probed)
+		return set_error(ctx, AUD_ERROR_STATE, "an index can only be loaded for a probed stream");
+	
+	if ((fread(buf, 1, AUD_INDEX_HEADER_SIZE, f) != AUD_INDEX_HEADER_SIZE) || memcmp(buf, "AUDX", 4) || (buf[4] != AUD_INDEX_VERSION))
+		return set_error(ctx, AUD_ERROR_STATE, "not an index file");
+	index->algorithm = buf[5];
+	index->filesize = get64(&buf[8]);
+	index->blocks = get64(&buf[16]);
+	index->num_samples = get64(&buf[24]);
+	i = get64(&buf[32]);
+	
+	// An index of a file that has changed since is useless, and positions from it can't be trusted
+	
+	if ((index->filesize != h->filesize) || (index->blocks != h->blocks) || (index->num_samples != h->num_samples) || (i != h->blocks) || (index->algorithm > 3))
+		return set_error(ctx, AUD_ERROR_STATE, "index doesn't match the stream");
+	if (!(index->checkpoints = malloc((h->blocks + 1) * sizeof(AUD_CHECKPOINT))))
+		return set_error(ctx, AUD_ERROR_STATE, "not enough memory for an index of %llu blocks", (unsigned long long)h->blocks);
+	
+	for (i = 0; i < index->blocks; i++) {
+		cp = &index->checkpoints[i];
+		if (fread(buf, 1, AUD_INDEX_CHECKPOINT_SIZE, f) != AUD_INDEX_CHECKPOINT_SIZE)
+			return set_error(ctx, AUD_ERROR_STATE, "index is truncated");
+		cp->offset = get64(buf);
+		cp->sample = get64(&buf[8]);
+		cp->adpcm_sample = get16(&buf[16]);
+		cp->adpcm_index = buf[18];
+		cp->zero = 0;
+		if ((cp->adpcm_index > 88) || (cp->sample & 1) || (cp->sample >= h->num_samples) || (cp->offset >= h->filesize) ||
+		    (i ? (cp->offset <= cp[-1].offset) || (cp->sample <= cp[-1].sample) : (cp->offset != h->first_block_offset) || cp->sample))
+			return set_error(ctx, AUD_ERROR_STATE, "index checkpoint %llu is invalid", (unsigned long long)i);
+	}
+	index->count = index->blocks;
+	return AUD_OK;
+}
+
+void AUD_index_free(AUD_INDEX *index) {
+	free(index->checkpoints);
+	index->checkpoints = NULL;
+	index->count = 0;
+}
+
+int AUD_set_range(AUD_CONTEXT *ctx, const AUD_INDEX *index, uint64_t start, uint64_t end) {
+	
+	ctx->range_index = NULL;
+	ctx->range_start = ctx->range_end = 0;
+	if (!index) return AUD_OK;
+	
+	if (!ctx->probed || ctx->stream)
+		return set_error(ctx, AUD_ERROR_SEEK, "a range needs a probed, seekable stream");
+	if ((index->blocks != ctx->header.blocks) || (index->count != index->blocks) || (index->num_samples != ctx->header.num_samples))
+		return set_error(ctx, AUD_ERROR_STATE, "index doesn't match the stream");
+	if (end > ctx->header.num_samples)
+		end = ctx->header.num_samples;
+	if (start >= end)
+		return set_error(ctx, AUD_ERROR_STATE, "range %llu..%llu is empty, stream has %llu samples",
+		                 (unsigned long long)start, (unsigned long long)end, (unsigned long long)ctx->header.num_samples);
+	
+	ctx->range_index = index;
+	ctx->range_start = start;
+	ctx->range_end = end;
+	return AUD_OK;
+}
+
+
+
+/******************************** Parallel decoding ********************************/
+
+// AUD is one continuous ADPCM stream, yet it can be decoded by several threads bit-exactly.
+// Every decoder step is a clamped add x -> min(hi, max(lo, x + add)), both for the step index (0..88)
+// and for the sample (16 bits), and a composition of clamped adds is again a clamped add.
+// So the stream is split into chunks, and:
+//   1. each chunk summarizes its index trajectory as one clamped add (in parallel)
+//   2. a scan over the summaries gives the exact index at the start of each chunk
+//   3. now that the indexes are known, each chunk summarizes its sample trajectory (in parallel)
+//   4. a scan gives the exact sample at the start of each chunk
+//   5. each chunk is decoded or remuxed from its exact starting state (in parallel)
+// Each call does this over the window of the stream its output buffer has room for, starting from the state
+// the previous window ended with, so memory doesn't grow with the length of the stream.
+
+#define PARALLEL_MAX_THREADS 64
+#define PARALLEL_MIN_CHUNK   65536 // nibbles, shorter chunks are not worth a thread
+
+typedef struct {
+	int64_t add;
+	int32_t lo, hi;
+} CLAMPED_ADD;
+
+// Payload of a block, an extra entry marks the end of the stream
+typedef struct {
+	const unsigned char *data;
+	uint64_t nibble; // stream position of its first nibble
+} BLOCK_REF;
+
+typedef struct {
+	const AUD_CONTEXT *ctx;
+	const BLOCK_REF *blocks;
+	uint64_t block;      // block containing begin
+	uint64_t begin, end; // nibbles, a remuxed chunk begins with a WAV block
+	uint64_t base;       // nibble of the window that starts the output
+	int pass;            // 1, 3 or 5, see above
+	CLAMPED_ADD map;     // summary of pass 1 or 3
+	char adpcm_index;    // decoder state at begin
+	long adpcm_sample;
+	short *pcm;          // output of the window
+	unsigned char *wav;
+	AUD_VERIFY verifier; // see AUD_remux_verify()
+	uint64_t mismatch;   // sample where verification failed, UINT64_MAX if it didn't
+} CHUNK;
+
+static int32_t clamp(int64_t x, int32_t lo, int32_t hi) {
+	return (x < lo) ? lo : (x > hi) ? hi : x;
+}
+
+// Appends a step x -> clamp(x + add, lo, hi) to f
+static void clamped_add_step(CLAMPED_ADD *f, int add, int32_t lo, int32_t hi) {
+	f->add += add;
+	f->lo = clamp((int64_t)f->lo + add, lo, hi);
+	f->hi = clamp((int64_t)f->hi + add, lo, hi);
+}
+
+static int32_t clamped_add_apply(const CLAMPED_ADD *f, int32_t x) {
+	return clamp(x + f->add, f->lo, f->hi);
+}
+
+// Difference added to the sample before clamping, and the index update
+static int nibble_diff(int algorithm, char *index, unsigned char nibble) {
+	// Start from the opposite rail, even the largest difference (61436) is then not clamped
+	long base = (nibble & 8) ? 32767 : -32768;
+	long sample = base;
+	
+	ADPCM_decode_sample(algorithm, index, &sample, nibble);
+	return sample - base;
+}
+
+static void *chunk_thread(void *arg) {
+	CHUNK *c = arg;
+	const BLOCK_REF *b = &c->blocks[c->block];
+	const unsigned char *in;
+	int algorithm = c->ctx->algorithm;
+	uint32_t wav_blocksize = c->ctx->wav_blocksize;
+	uint32_t spb = wav_blocksize * 2 + 1; // nibbles per WAV block
+	uint64_t pos, next;
+	uint32_t p, end, n, m, q = c->begin % spb;
+	unsigned char nibble, *out = NULL;
+	// Kept in locals, the compiler can't keep anything in registers across byte stores through pointers
+	CLAMPED_ADD map = c->map;
+	char adpcm_index = c->adpcm_index;
+	long adpcm_sample = c->adpcm_sample;
+	WAV_BLOCK_HEADER wav_block_header;
+	AUD_VERIFY *v = c->ctx->verify ? &c->verifier : NULL;
+	
+	if (v) {
+		v->aud_index = adpcm_index;
+		v->aud_sample = adpcm_sample;
+	}
+	c->mismatch = UINT64_MAX;
+	
+	// One AUD block at a time, nibbles p..end-1 of its payload are stream nibbles pos..next-1
+	
+	for (pos = c->begin; pos < c->end; pos = next) {
+		while (pos == b[1].nibble) b++;
+		next = (b[1].nibble < c->end) ? b[1].nibble : c->end;
+		in = b->data;
+		p = pos - b->nibble;
+		end = next - b->nibble;
+		
+		switch (c->pass) {
+			case 1:
+				for (; p < end; p++) {
+					nibble = (p & 1) ? (in[p >> 1] >> 4) : (in[p >> 1] & 0xF);
+					clamped_add_step(&map, ADPCM_INDEX_ADJUST[nibble & 7], 0, 88);
+				}
+				break;
+			
+			case 3:
+				for (; p < end; p++) {
+					nibble = (p & 1) ? (in[p >> 1] >> 4) : (in[p >> 1] & 0xF);
+					clamped_add_step(&map, nibble_diff(algorithm, &adpcm_index, nibble), -32768, 32767);
+				}
+				break;
+			
+			default:
+				if (!c->wav) {
+					c->ctx->kernel(in, p, end, &c->pcm[pos - c->base], &adpcm_index, &adpcm_sample);
+					break;
+				}
+				// Same as remux_block(), chunks start at WAV block boundaries
+				while (p < end) {
+					if (q == 0) {
+						out = &c->wav[((pos - c->base) / spb) * (WAV_BLOCK_HEADER_SIZE + wav_blocksize)];
+						ADPCM_decode_sample(algorithm, &adpcm_index, &adpcm_sample, get_nibble(in, p));
+						wav_block_header.sample = adpcm_sample;
+						wav_block_header.index = adpcm_index;
+						wav_block_header.zero = 0;
+						WAV_write_block_header(&wav_block_header, out);
+						if (v && !verify_header(v, in, p, out)) {
+							c->mismatch = pos;
+							return NULL;
+						}
+						p++;
+						pos++;
+						out += WAV_BLOCK_HEADER_SIZE;
+						q = 1;
+						continue;
+					}
+					n = (end - p < spb - q) ? end - p : spb - q;
+					advance_algo0(in, p, p + n, &adpcm_index, &adpcm_sample);
+					copy_nibbles(out, q - 1, in, p, n);
+					if (v && ((m = verify_nibbles(v, in, p, out, q - 1, n)) < n)) {
+						c->mismatch = pos + m;
+						return NULL;
+					}
+					p += n;
+					pos += n;
+					q += n;
+					if (q == spb) q = 0;
+				}
+		}
+	}
+	
+	// Only the last chunk of the stream can end within a WAV block, it's padded with zeros
+	if ((c->pass == 5) && c->wav && q)
+		memset(&out[q >> 1], 0, wav_blocksize - (q >> 1));
+	
+	c->map = map;
+	return NULL;
+}
+
+static void run_pass(CHUNK *chunks, int count, int pass) {
+	pthread_t threads[PARALLEL_MAX_THREADS];
+	char started[PARALLEL_MAX_THREADS];
+	int i;
+	
+	for (i = 0; i < count; i++)
+		chunks[i].pass = pass;
+	
+	// First chunk runs on the calling thread, and so does any chunk whose thread couldn't be started
+	
+	for (i = 1; i < count; i++)
+		started[i] = (pthread_create(&threads[i], NULL, chunk_thread, &chunks[i]) == 0);
+	chunk_thread(&chunks[0]);
+	for (i = 1; i < count; i++)
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			chunk_thread(&chunks[i]);
+}
+
+// Decodes (wav = NULL) or remuxes the next len nibbles of a probed memory-backed stream, fewer at its end,
+// a remuxed window starts at a WAV block boundary. The context moves past them as if they were decoded serially
+// Returns the number of nibbles, or -1 if they are too few to be split or there's not enough memory (nothing is read then)
+static int64_t decode_parallel(AUD_CONTEXT *ctx, short *pcm, unsigned char *wav, uint64_t len, int threads) {
+	AUD_HEADER *h = &ctx->header;
+	CHUNK chunks[PARALLEL_MAX_THREADS];
+	BLOCK_REF *blocks;
+	uint64_t i, b, base, units, max_blocks, done = 0;
+	uint32_t unit, n;
+	int count;
+	
+	// Nibbles left in the stream, the current block may be partly decoded
+	
+	base = ctx->bytes_read * 2 - ctx->block_size * 2 + ctx->block_pos;
+	if (len > h->adpcm_bytes * 2 - base)
+		len = h->adpcm_bytes * 2 - base;
+	
+	// Split the window evenly, remuxed chunks into whole WAV blocks
+	
+	unit = wav ? ctx->wav_blocksize * 2 + 1 : 1;
+	units = (len + unit - 1) / unit;
+	count = threads;
+	if (count > PARALLEL_MAX_THREADS) count = PARALLEL_MAX_THREADS;
+	if ((uint64_t)count > len / PARALLEL_MIN_CHUNK) count = len / PARALLEL_MIN_CHUNK;
+	if ((uint64_t)count > units) count = units;
+	if (count < 2)
+		return -1;
+	
+	// Locate the block payloads of the window, reading them as serial decoding does, the chain has been checked
+	// by AUD_probe(). Blocks hold at least 2 nibbles, and every one of them but the first and the last is whole
+	
+	max_blocks = h->blocks - ctx->blocks_read + 1;
+	if (max_blocks > len / 2 + 2)
+		max_blocks = len / 2 + 2;
+	if (!(blocks = malloc((max_blocks + 1) * sizeof(BLOCK_REF))))
+		return -1;
+	b = 0;
+	while (done < len) {
+		if (ctx->block_pos == ctx->block_end) {
+			if (!next_block(ctx)) break;
+			continue;
+		}
+		blocks[b].data = ctx->block;
+		blocks[b].nibble = ctx->bytes_read * 2 - ctx->block_size * 2;
+		b++;
+		n = ctx->block_end - ctx->block_pos;
+		if (n > len - done) n = len - done;
+		ctx->block_pos += n;
+		done += n;
+	}
+	blocks[b].data = NULL;
+	blocks[b].nibble = base + done;
+	if (done < len) { // a block that can't be read anymore ends the window, the error is returned by the next call
+		len = done;
+		units = (len + unit - 1) / unit;
+		if ((uint64_t)count > units) count = units;
+		if (!count) {
+			free(blocks);
+			return 0;
+		}
+	}
+	
+	max_blocks = b;
+	b = 0;
+	for (i = 0; i < (uint64_t)count; i++) {
+		CHUNK *c = &chunks[i];
+		c->ctx = ctx;
+		c->blocks = blocks;
+		c->base = base;
+		c->begin = base + units * i / count * unit;
+		c->end = (i + 1 == (uint64_t)count) ? base + len : base + units * (i + 1) / count * unit;
+		while ((b < max_blocks) && (blocks[b + 1].nibble <= c->begin)) b++;
+		c->block = b;
+		c->map.add = 0;
+		c->pcm = pcm;
+		c->wav = wav;
+	}
+	
+	// Exact index at the start of each chunk
+	
+	for (i = 0; i < (uint64_t)count; i++) {
+		chunks[i].map.lo = 0;
+		chunks[i].map.hi = 88;
+	}
+	run_pass(chunks, count, 1);
+	chunks[0].adpcm_index = ctx->adpcm_index;
+	for (i = 1; i < (uint64_t)count; i++)
+		chunks[i].adpcm_index = clamped_add_apply(&chunks[i - 1].map, chunks[i - 1].adpcm_index);
+	ctx->adpcm_index = clamped_add_apply(&chunks[count - 1].map, chunks[count - 1].adpcm_index);
+	
+	// Exact sample at the start of each chunk
+	
+	for (i = 0; i < (uint64_t)count; i++) {
+		chunks[i].map.add = 0;
+		chunks[i].map.lo = -32768;
+		chunks[i].map.hi = 32767;
+	}
+	run_pass(chunks, count, 3);
+	chunks[0].adpcm_sample = ctx->adpcm_sample;
+	for (i = 1; i < (uint64_t)count; i++)
+		chunks[i].adpcm_sample = clamped_add_apply(&chunks[i - 1].map, chunks[i - 1].adpcm_sample);
+	ctx->adpcm_sample = clamped_add_apply(&chunks[count - 1].map, chunks[count - 1].adpcm_sample);
+	
+	run_pass(chunks, count, 5);
+	free(blocks);
+	
+	// Chunks are in stream order, the first mismatch is the one to report
+	for (i = 0; i < (uint64_t)count; i++)
+		if (chunks[i].mismatch != UINT64_MAX) {
+			verify_failed(ctx, &chunks[i].verifier, chunks[i].mismatch);
+			break;
+		}
+	
+	// The verifier goes on from the same state as the remuxer, as in remux_block()
+	ctx->verifier.aud_index = ctx->adpcm_index;
+	ctx->verifier.aud_sample = ctx->adpcm_sample;
+	return len;
+}
+
+long AUD_decode_parallel(AUD_CONTEXT *ctx, short *pcm, uint32_t max_samples, int threads) {
+	int64_t n;
+	
+	if (ctx->error < 0) return ctx->error;
+	if ((threads < 2) || !ctx->probed || ctx->remuxing || !ctx->memory.data || (ctx->head_pos != ctx->head_len) || ctx->range_end
+	 || ((n = decode_parallel(ctx, pcm, NULL, max_samples, threads)) < 0))
+		return AUD_decode(ctx, pcm, max_samples);
+	if (ctx->analysis) // in order, after all chunks are done
+		AUD_analyze(ctx->analysis, pcm, n);
+	return n;
+}
+
+long AUD_remux_parallel(AUD_CONTEXT *ctx, unsigned char *buf, uint32_t size, int threads) {
+	uint32_t block = WAV_BLOCK_HEADER_SIZE + ctx->wav_blocksize;
+	uint64_t spb = ctx->wav_blocksize * 2 + 1;
+	int64_t n;
+	
+	if (ctx->error < 0) return ctx->error;
+	if ((threads < 2) || !ctx->probed || !ctx->remuxing || !ctx->memory.data || (ctx->head_pos != ctx->head_len) || ctx->range_end
+	 || ctx->analysis || (ctx->wav_block_pos != ctx->wav_block_len) || (size < block)
+	 || ((n = decode_parallel(ctx, NULL, buf, size / block * spb, threads)) < 0))
+		return AUD_remux(ctx, buf, size);
+	if (ctx->error < 0) return ctx->error; // verification failed
+	n = (n + spb - 1) / spb;
+	ctx->wav_blocks_written += n;
+	return n * block;
+}
+
+
+
+/******************************** Multi-stream decoding ********************************/
+
+// A single stream can't be vectorized, each sample depends on the previous one, but independent
+// streams can: every SIMD lane decodes a different stream with algorithm #0, in lockstep.
+// Lanes only run together within their current blocks, so a batch of steps ends when
+// any lane reaches the end of its block (or of its output), then that lane is refilled or retired.
+
+typedef struct {
+	const unsigned char *in[AUD_LANES]; // current block
+	uint32_t pos[AUD_LANES];            // nibble in block
+	short *out[AUD_LANES];              // NULL for idle lanes
+	int32_t index[AUD_LANES];
+	int32_t sample[AUD_LANES];
+} LANES;
+
+// Idle lanes decode silence from here
+static const unsigned char idle_block[AUD_BLOCK_MAX];
+
+#ifdef __AVX2__
+
+#define LANES_BATCH 64 // steps transposed at once
+
+// Decodes steps nibbles in every lane, gathers from DiffTable, index adjustment by permutation
+// Nibbles and samples are transposed through small buffers, lane by lane is much cheaper than step by step
+static void lanes_decode(LANES *l, uint32_t steps) {
+	int32_t nibbles[LANES_BATCH][AUD_LANES], samples[LANES_BATCH][AUD_LANES];
+	__m256i index = _mm256_loadu_si256((const __m256i *)l->index);
+	__m256i sample = _mm256_loadu_si256((const __m256i *)l->sample);
+	__m256i adjust = _mm256_setr_epi32(-1, -1, -1, -1, 2, 4, 6, 8); // ADPCM_INDEX_ADJUST, lane = nibble & 7
+	__m256i index_max = _mm256_set1_epi32(88);
+	__m256i sample_min = _mm256_set1_epi32(-32768);
+	__m256i sample_max = _mm256_set1_epi32(32767);
+	__m256i nibble, diff;
+	uint32_t done, batch, t, p;
+	int i;
+	
+	for (done = 0; done < steps; done += batch) {
+		batch = (steps - done < LANES_BATCH) ? steps - done : LANES_BATCH;
+		
+		for (i = 0; i < AUD_LANES; i++)
+			for (t = 0, p = l->pos[i] + done; t < batch; t++, p++)
+				nibbles[t][i] = (l->in[i][p >> 1] >> ((p & 1) * 4)) & 0xF;
+		
+		for (t = 0; t < batch; t++) {
+			nibble = _mm256_loadu_si256((const __m256i *)nibbles[t]);
+			// Low half of each DiffTable entry, long is 32 or 64 bits
+			diff = _mm256_i32gather_epi32((const int *)DiffTable, _mm256_add_epi32(_mm256_slli_epi32(index, 4), nibble), sizeof(DiffTable[0]));
+			sample = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(sample, diff), sample_min), sample_max);
+			index = _mm256_add_epi32(index, _mm256_permutevar8x32_epi32(adjust, nibble));
+			index = _mm256_min_epi32(_mm256_max_epi32(index, _mm256_setzero_si256()), index_max);
+			_mm256_storeu_si256((__m256i *)samples[t], sample);
+		}
+		
+		for (i = 0; i < AUD_LANES; i++)
+			if (l->out[i])
+				for (t = 0; t < batch; t++)
+					l->out[i][done + t] = samples[t][i];
+	}
+	_mm256_storeu_si256((__m256i *)l->index, index);
+	_mm256_storeu_si256((__m256i *)l->sample, sample);
+}
+
+#else
+
+// Same for compilers without AVX2, written so that they can vectorize the lanes on their own
+static void lanes_decode(LANES *l, uint32_t steps) {
+	uint32_t t, p;
+	int i, fastindex;
+	int32_t sample;
+	
+	for (t = 0; t < steps; t++)
+		for (i = 0; i < AUD_LANES; i++) {
+			p = l->pos[i] + t;
+			fastindex = (l->index[i] << 4) + ((l->in[i][p >> 1] >> ((p & 1) * 4)) & 0xF);
+			sample = l->sample[i] + DiffTable[fastindex];
+			l->sample[i] = (sample < -32768) ? -32768 : (sample > 32767) ? 32767 : sample;
+			l->index[i] = IndexTable[fastindex] >> 4;
+			if (l->out[i])
+				l->out[i][t] = l->sample[i];
+		}
+}
+
+#endif
+
+int AUD_decode_lanes(AUD_CONTEXT **ctx, int count, short **pcm, uint32_t max_samples, long *decoded) {
+	LANES l;
+	char active[AUD_LANES];
+	uint32_t steps, left;
+	int i, lanes, streams = 0;
+	AUD_CONTEXT *c;
+	
+	if (count > AUD_LANES)
+		return AUD_decode_lanes(ctx, AUD_LANES, pcm, max_samples, decoded)
+		     + AUD_decode_lanes(&ctx[AUD_LANES], count - AUD_LANES, &pcm[AUD_LANES], max_samples, &decoded[AUD_LANES]);
+	
+	for (i = 0; i < AUD_LANES; i++) {
+		active[i] = 0;
+		l.in[i] = idle_block;
+		l.pos[i] = 0;
+		l.out[i] = NULL;
+		l.index[i] = l.sample[i] = 0;
+		if (i >= count) continue;
+		
+		c = ctx[i];
+		decoded[i] = 0;
+		if (c->error < 0)
+			decoded[i] = c->error;
+		else if (c->algorithm >= 2)
+			decoded[i] = AUD_decode(c, pcm[i], max_samples); // no lanes for approximations, #1 is the same as #0
+		else {
+			active[i] = 1;
+			l.index[i] = c->adpcm_index;
+			l.sample[i] = c->adpcm_sample;
+		}
+	}
+	
+	while (1) {
+		
+		// Refill lanes that finished their blocks, same as AUD_decode()
+		
+		steps = UINT32_MAX;
+		lanes = 0;
+		for (i = 0; i < count; i++) {
+			if (!active[i]) continue;
+			c = ctx[i];
+			while ((decoded[i] < max_samples) && (c->block_pos == c->block_end))
+				if (!next_block(c)) break;
+			if ((decoded[i] == max_samples) || (c->block_pos == c->block_end)) {
+				// Retire the lane
+				active[i] = 0;
+				c->adpcm_index = l.index[i];
+				c->adpcm_sample = l.sample[i];
+				l.in[i] = idle_block;
+				l.pos[i] = 0;
+				l.out[i] = NULL;
+				continue;
+			}
+			l.in[i] = c->block;
+			l.pos[i] = c->block_pos;
+			l.out[i] = &pcm[i][decoded[i]];
+			left = c->block_end - c->block_pos;
+			if (left > max_samples - decoded[i])
+				left = max_samples - decoded[i];
+			if (left < steps)
+				steps = left;
+			lanes++;
+		}
+		if (!lanes) break;
+		
+		lanes_decode(&l, steps);
+		for (i = 0; i < count; i++)
+			if (active[i]) {
+				if (ctx[i]->analysis)
+					AUD_analyze(ctx[i]->analysis, l.out[i], steps);
+				ctx[i]->block_pos += steps;
+				decoded[i] += steps;
+			}
+	}
+	
+	for (i = 0; i < count; i++)
+		if (decoded[i] > 0)
+			streams++;
+	return streams;
+}
+
+void AUD_close(AUD_CONTEXT *ctx) {
+	// The input handle belongs to the caller, only our own mapping is released
+#ifdef AUDLIB_MMAP
+	if (ctx->map)
+		munmap(ctx->map, ctx->map_size);
+#endif
+	ctx->map = NULL;
+	ctx->memory.data = NULL;
+	ctx->file = NULL;
+	ctx->io.handle = NULL;
+	ctx->eof = 1;
+}
+
+
+
+/******************************** Encoding ********************************/
+
+// Nibbles are chosen against step_algo0() itself, so the error the encoder sees is exactly what every
+// algorithm #0 decoder plays. Greedy takes, sample by sample, the nibble that lands closest. Trellis keeps
+// the ENCODE_STATES cheapest decoder states (index, sample) by total squared error after every sample,
+// and writes ENCODE_SEGMENT samples of the cheapest path once it has searched ENCODE_LOOKAHEAD samples further.
+//
+// Trellis chunks are searched in parallel, each from the state a greedy pass reaches at its start.
+// Then, in stream order, each chunk is searched again from the state the previous one really ends with,
+// until one of the paths joins the chunk's own path: from there on both decode to the same samples.
+// Chunks have a fixed size, so the output doesn't depend on the number of threads.
+
+#define ENCODE_STATES        16        // at most 16, back pointers keep the state in a nibble
+#define ENCODE_SEGMENT       1024      // samples
+#define ENCODE_LOOKAHEAD     256
+#define ENCODE_WINDOW        (ENCODE_SEGMENT + ENCODE_LOOKAHEAD)
+#define ENCODE_CHUNK_SAMPLES (1 << 18) // even, so that no two chunks share a byte
+
+typedef struct {
+	int64_t cost;   // squared error of the path
+	int32_t sample; // decoder state after it
+	uint8_t index;
+	uint8_t from;   // state it continues, at the previous sample
+	uint8_t nibble;
+} ENCODE_NODE;
+
+typedef struct {
+	const short *pcm;
+	unsigned char *adpcm;          // nibbles of the whole stream
+	uint32_t begin, end;
+	int start_index, start_sample; // greedy state at begin, the chunk is searched from it
+	int end_index, end_sample;     // state its nibbles end with
+} ENCODE_CHUNK;
+
+typedef struct {
+	ENCODE_CHUNK *chunks;
+	int count, first, step; // chunks first, first + step, ...
+} ENCODE_JOB;
+
+static inline void set_nibble(unsigned char *out, uint32_t pos, int nibble) {
+	int shift = (pos & 1) * 4;
+	out[pos >> 1] = (out[pos >> 1] & (0xF0 >> shift)) | (nibble << shift);
+}
+
+// The nibble that decodes closest to target. Decoded samples grow with the magnitude, so the error
+// falls and then rises, and a clamped sample doesn't change any more
+static inline int greedy_nibble(int index, int sample, int target) {
+	int sign = (target < sample) ? 8 : 0;
+	const int32_t *packed = &ADPCM_PACKED[(index << 4) | sign];
+	int m, error, best_error = INT_MAX;
+	
+	for (m = 0; m < 8; m++) {
+		error = abs(target - clamp_sample(sample + (packed[m] >> 8)));
+		if (error >= best_error) break;
+		best_error = error;
+	}
+	return sign | (m - 1);
+}
+
+static void encode_greedy(const short *pcm, uint32_t pos, uint32_t end, unsigned char *adpcm, int *index, int *sample) {
+	int nibble;
+	
+	for (; pos < end; pos++) {
+		nibble = greedy_nibble(*index, *sample, pcm[pos]);
+		set_nibble(adpcm, pos, nibble);
+		step_algo0(index, sample, nibble);
+	}
+}
+
+// Adds a path to the states of the next sample, kept sorted by cost, one path per state
+static inline int trellis_insert(ENCODE_NODE *next, int count, const ENCODE_NODE *node) {
+	int i, j;
+	
+	if ((count == ENCODE_STATES) && (node->cost >= next[count - 1].cost)) return count;
+	for (i = 0; i < count; i++)
+		if ((next[i].sample == node->sample) && (next[i].index == node->index)) {
+			if (next[i].cost <= node->cost) return count;
+			memmove(&next[i], &next[i + 1], (count - i - 1) * sizeof(ENCODE_NODE));
+			count--;
+			break;
+		}
+	for (i = 0; (i < count) && (next[i].cost <= node->cost); i++);
+	j = (count == ENCODE_STATES) ? count - 1 : count;
+	memmove(&next[i + 1], &next[i], (j - i) * sizeof(ENCODE_NODE));
+	next[i] = *node;
+	return j + 1;
+}
+
+// Searches samples pos..end-1 (up to ENCODE_WINDOW of them) from state (*index, *sample) and writes nibbles of
+// the cheapest path: all of them if the search got to end, otherwise the first ENCODE_SEGMENT. The state moves past them.
+// With a plan (plan[t] = state the nibbles already in adpcm decode to after sample pos + t), the search stops
+// as soon as a path reaches the same state, *joined is then set and the path is written up to there
+// Returns number of samples written
+static uint32_t trellis_search(const short *pcm, uint32_t pos, uint32_t end, unsigned char *adpcm, int *index, int *sample,
+                               const ENCODE_NODE *plan, int *joined) {
+	unsigned char back[ENCODE_WINDOW][ENCODE_STATES];
+	unsigned char nibbles[ENCODE_WINDOW];
+	ENCODE_NODE nodes[2][ENCODE_STATES], *cur = nodes[0], *next = nodes[1], *swap, node;
+	const int32_t *packed;
+	uint32_t n, t, written;
+	int count = 1, next_count, k, j, m, lo, hi, sign, target, error, best = 0;
+	
+	n = end - pos;
+	if (n > ENCODE_WINDOW) n = ENCODE_WINDOW;
+	cur[0].cost = 0;
+	cur[0].sample = *sample;
+	cur[0].index = *index;
+	*joined = 0;
+	
+	for (t = 0; t < n; t++) {
+		target = pcm[pos + t];
+		next_count = 0;
+		for (k = 0; k < count; k++) {
+			// Magnitudes around the closest one, and the smallest step of the other sign
+			sign = (target < cur[k].sample) ? 8 : 0;
+			m = greedy_nibble(cur[k].index, cur[k].sample, target) & 7;
+			lo = (m > 0) ? m - 1 : 0;
+			hi = (m < 7) ? m + 1 : 7;
+			node.from = k;
+			for (j = (m == 0) ? -1 : lo; j <= hi; j++) {
+				node.nibble = (j < 0) ? sign ^ 8 : sign | j;
+				packed = &ADPCM_PACKED[(cur[k].index << 4) | node.nibble];
+				node.sample = clamp_sample(cur[k].sample + (*packed >> 8));
+				node.index = *packed & 0xFF;
+				error = target - node.sample;
+				node.cost = cur[k].cost + (int64_t)error * error;
+				next_count = trellis_insert(next, next_count, &node);
+			}
+		}
+		for (k = 0; k < next_count; k++)
+			back[t][k] = (next[k].from << 4) | next[k].nibble;
+		swap = cur;
+		cur = next;
+		next = swap;
+		count = next_count;
+		
+		if (plan) {
+			for (k = 0; k < count; k++)
+				if ((cur[k].sample == plan[t].sample) && (cur[k].index == plan[t].index))
+					break;
+			if (k < count) {
+				*joined = 1;
+				best = k;
+				n = t + 1;
+				break;
+			}
+		}
+	}
+	
+	// Trace the path back, states are sorted, so without a plan the cheapest one is first
+	
+	for (t = n; t-- > 0;) {
+		nibbles[t] = back[t][best] & 0xF;
+		best = back[t][best] >> 4;
+	}
+	written = (*joined || (pos + n == end)) ? n : ENCODE_SEGMENT;
+	for (t = 0; t < written; t++) {
+		set_nibble(adpcm, pos + t, nibbles[t]);
+		step_algo0(index, sample, nibbles[t]);
+	}
+	return written;
+}
+
+static void trellis_chunk(ENCODE_CHUNK *c) {
+	int index = c->start_index, sample = c->start_sample, joined;
+	uint32_t pos;
+	
+	for (pos = c->begin; pos < c->end;)
+		pos += trellis_search(c->pcm, pos, c->end, c->adpcm, &index, &sample, NULL, &joined);
+	c->end_index = index;
+	c->end_sample = sample;
+}
+
+// Searches the chunk again from the state the previous chunk ends with, until a path joins the chunk's own
+static void trellis_join(ENCODE_CHUNK *c, int index, int sample) {
+	ENCODE_NODE plan[ENCODE_WINDOW];
+	int plan_index = c->start_index, plan_sample = c->start_sample, joined;
+	uint32_t pos, n, t;
+	
+	for (pos = c->begin; (pos < c->end) && ((index != plan_index) || (sample != plan_sample)); pos += n) {
+		n = c->end - pos;
+		if (n > ENCODE_WINDOW) n = ENCODE_WINDOW;
+		for (t = 0; t < n; t++) {
+			step_algo0(&plan_index, &plan_sample, get_nibble(c->adpcm, pos + t));
+			plan[t].sample = plan_sample;
+			plan[t].index = plan_index;
+		}
+		n = trellis_search(c->pcm, pos, c->end, c->adpcm, &index, &sample, plan, &joined);
+		if (joined) return;
+		plan_index = plan[n - 1].index;
+		plan_sample = plan[n - 1].sample;
+	}
+	if (pos == c->end) {
+		c->end_index = index;
+		c->end_sample = sample;
+	}
+}
+
+static void *encode_thread(void *arg) {
+	ENCODE_JOB *job = arg;
+	int i;
+	
+	for (i = job->first; i < job->count; i += job->step)
+		trellis_chunk(&job->chunks[i]);
+	return NULL;
+}
+
+// Chunks are handled in batches of PARALLEL_MAX_THREADS, they are joined in order anyway
+static void encode_trellis(const short *pcm, uint32_t num_samples, unsigned char *adpcm, int threads, int *index, int *sample) {
+	ENCODE_CHUNK chunks[PARALLEL_MAX_THREADS];
+	ENCODE_JOB jobs[PARALLEL_MAX_THREADS];
+	pthread_t thread[PARALLEL_MAX_THREADS];
+	char started[PARALLEL_MAX_THREADS];
+	int greedy_index = *index, greedy_sample = *sample, count, i;
+	uint32_t pos;
+	
+	if (threads > PARALLEL_MAX_THREADS) threads = PARALLEL_MAX_THREADS;
+	if (threads < 1) threads = 1;
+	for (pos = 0; pos < num_samples; pos = chunks[count - 1].end) {
+		for (count = 0; (count < PARALLEL_MAX_THREADS) && (pos < num_samples); count++) {
+			ENCODE_CHUNK *c = &chunks[count];
+			c->pcm = pcm;
+			c->adpcm = adpcm;
+			c->begin = pos;
+			c->end = (num_samples - pos > ENCODE_CHUNK_SAMPLES) ? pos + ENCODE_CHUNK_SAMPLES : num_samples;
+			c->start_index = greedy_index;
+			c->start_sample = greedy_sample;
+			encode_greedy(pcm, c->begin, c->end, adpcm, &greedy_index, &greedy_sample);
+			pos = c->end;
+		}
+		
+		// First job runs on the calling thread, and so does any job whose thread couldn't be started
+		
+		for (i = 0; (i < threads) && (i < count); i++) {
+			jobs[i].chunks = chunks;
+			jobs[i].count = count;
+			jobs[i].first = i;
+			jobs[i].step = (threads < count) ? threads : count;
+		}
+		for (i = 1; i < jobs[0].step; i++)
+			started[i] = (pthread_create(&thread[i], NULL, encode_thread, &jobs[i]) == 0);
+		encode_thread(&jobs[0]);
+		for (i = 1; i < jobs[0].step; i++)
+			if (started[i])
+				pthread_join(thread[i], NULL);
+			else
+				encode_thread(&jobs[i]);
+		
+		for (i = 0; i < count; i++) {
+			trellis_join(&chunks[i], *index, *sample);
+			*index = chunks[i].end_index;
+			*sample = chunks[i].end_sample;
+		}
+	}
+}
+
+uint32_t AUD_encoded_size(uint32_t num_samples) {
+	uint32_t bytes = (num_samples + 1) / 2;
+	uint32_t blocks = (bytes + AUD_ENCODE_BLOCK_BYTES - 1) / AUD_ENCODE_BLOCK_BYTES;
+	
+	return AUD_HEADER_NEW_SIZE + blocks * AUD_BLOCK_HEADER_SIZE + bytes;
+}
+
+long AUD_encode(const short *pcm, uint32_t num_samples, uint16_t samplerate, int mode, int threads, unsigned char *buf) {
+	uint32_t size, bytes, n, i;
+	unsigned char *adpcm, *p;
+	int index = 0, sample = 0;
+	
+	if (!num_samples || (num_samples > AUD_ENCODE_MAX_SAMPLES) || ((mode != AUD_ENCODE_GREEDY) && (mode != AUD_ENCODE_TRELLIS)))
+		return AUD_ERROR_STATE;
+	pthread_once(&tables_once, init_tables);
+	
+	// Nibbles go to the end of buf, then blocks are moved down into place, each just ahead of the next one's data
+	
+	size = AUD_encoded_size(num_samples);
+	bytes = (num_samples + 1) / 2;
+	adpcm = buf + size - bytes;
+	if (mode == AUD_ENCODE_GREEDY)
+		encode_greedy(pcm, 0, num_samples, adpcm, &index, &sample);
+	else
+		encode_trellis(pcm, num_samples, adpcm, threads, &index, &sample);
+	if (num_samples & 1)
+		set_nibble(adpcm, num_samples, greedy_nibble(index, sample, pcm[num_samples - 1]));
+	
+	p = put16(buf, samplerate);
+	p = put32(p, size - AUD_HEADER_NEW_SIZE);
+	p = put32(p, bytes * 4);
+	*p++ = 2; // 16-bit mono
+	*p++ = 99;
+	for (i = 0; i < bytes; i += n) {
+		n = (bytes - i > AUD_ENCODE_BLOCK_BYTES) ? AUD_ENCODE_BLOCK_BYTES : bytes - i;
+		memmove(p + AUD_BLOCK_HEADER_SIZE, adpcm + i, n);
+		p = put16(p, n);
+		p = put16(p, n * 4);
+		p = put16(p, 0xDEAF);
+		p = put16(p, 0);
+		p += n;
+	}
+	return size;
+}
+
+
+
+/******************************** Resampling ********************************/
+
+// Output sample k is at input sample t = k * down / up, between i = floor(t) and i + 1, in phase p = k * down mod up.
+// It's the sum of input samples i - taps/2 + 1 .. i + taps/2 times phase p of the filter: a Kaiser-windowed sinc
+// taken at their distances from t, cut off at the lower of both Nyquist frequencies. Coefficients of each phase
+// add up to exactly 1.0, so DC passes unchanged, and when up is a multiple of down, input samples are kept as they are.
+// 14-bit coefficients alone would limit the output to about 75 dB SNR, so each one has 6 more bits in a second
+// coefficient, summed separately: both sums of products stay in 32 bits.
+
+#define RESAMPLE_SHIFT    14 // coefficient 1.0 of the high parts
+#define RESAMPLE_LO_SHIFT 6  // extra bits of the low parts
+#define RESAMPLE_PI    3.14159265358979323846
+
+static const struct {
+	uint32_t taps; // per phase, when upsampling
+	double beta;   // Kaiser window, stopband attenuation vs. transition width
+} resample_quality[] = {
+	{ 16, 5.0 }, // AUD_RESAMPLE_FAST
+	{ 32, 7.0 }, // AUD_RESAMPLE_GOOD
+	{ 64, 9.0 }, // AUD_RESAMPLE_BEST
+};
+
+// Modified Bessel function of the first kind, order 0, for the Kaiser window
+static double bessel_i0(double x) {
+	double sum = 1, term = 1;
+	int k;
+	
+	for (k = 1; term > sum * 1e-12; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+#ifdef __AVX2__
+
+static int32_t hsum_epi32(__m256i v) {
+	__m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+	return _mm_cvtsi128_si32(sum);
+}
+
+// Filter phase: taps high parts, then taps low parts. Returns the sum in units of 2^-(RESAMPLE_SHIFT + RESAMPLE_LO_SHIFT)
+static int64_t resample_dot(const int16_t *filter, const int16_t *x, uint32_t taps) {
+	__m256i hi = _mm256_setzero_si256(), lo = _mm256_setzero_si256(), v;
+	uint32_t m;
+	
+	for (m = 0; m < taps; m += 16) {
+		v = _mm256_loadu_si256((const __m256i *)&x[m]);
+		hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)&filter[m]), v));
+		lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)&filter[taps + m]), v));
+	}
+	return ((int64_t)hsum_epi32(hi) << RESAMPLE_LO_SHIFT) + hsum_epi32(lo);
+}
+
+#else
+
+// Same for compilers without AVX2, 16 independent sums of each part that they can vectorize on their own
+static int64_t resample_dot(const int16_t *filter, const int16_t *x, uint32_t taps) {
+	int32_t hi[16] = { 0 }, lo[16] = { 0 }, hi_sum = 0, lo_sum = 0;
+	uint32_t m;
+	int j;
+	
+	for (m = 0; m < taps; m += 16)
+		for (j = 0; j < 16; j++) {
+			hi[j] += filter[m + j] * x[m + j];
+			lo[j] += filter[taps + m + j] * x[m + j];
+		}
+	for (j = 0; j < 16; j++) {
+		hi_sum += hi[j];
+		lo_sum += lo[j];
+	}
+	return ((int64_t)hi_sum << RESAMPLE_LO_SHIFT) + lo_sum;
+}
+
+#endif
+
+uint64_t AUD_resampled_samples(const AUD_RESAMPLER *r, uint64_t num_samples) {
+	return (num_samples * r->up + r->down - 1) / r->down;
+}
+
+uint32_t AUD_resample_input(const AUD_RESAMPLER *r, uint32_t max_out) {
+	uint64_t n = (max_out < 2) ? 0 : (uint64_t)(max_out - 2) * r->down / r->up;
+	return (n > INT_MAX) ? INT_MAX : (uint32_t)n;
+}
+
+int AUD_resample_init(AUD_RESAMPLER *r, uint32_t in_rate, uint32_t out_rate, int quality) {
+	uint32_t a, b, p, m, half, peak, hi_abs, lo_abs;
+	double fc, beta, d, x, sum, *c;
+	int16_t *hi, *lo;
+	int32_t total;
+	
+	memset(r, 0, sizeof(AUD_RESAMPLER));
+	if ((quality < AUD_RESAMPLE_FAST) || (quality > AUD_RESAMPLE_BEST) || !in_rate || !out_rate) {
+		snprintf(r->message, sizeof(r->message), "Invalid resampling parameters");
+		return AUD_ERROR_STATE;
+	}
+	for (a = in_rate, b = out_rate; b; m = a % b, a = b, b = m); // GCD
+	r->in_rate = in_rate;
+	r->out_rate = out_rate;
+	r->up = out_rate / a;
+	r->down = in_rate / a;
+	if (r->up > AUD_RESAMPLE_PHASES_MAX) {
+		snprintf(r->message, sizeof(r->message), "Resampling %u Hz to %u Hz needs %u filter phases, at most %u are supported",
+		         in_rate, out_rate, r->up, AUD_RESAMPLE_PHASES_MAX);
+		return AUD_ERROR_STATE;
+	}
+	if (r->down > 16 * r->up) {
+		snprintf(r->message, sizeof(r->message), "Resampling %u Hz to %u Hz is more than 16 times down, not supported", in_rate, out_rate);
+		return AUD_ERROR_STATE;
+	}
+	
+	// Downsampling cuts off lower, the filter is as many times longer
+	r->taps = resample_quality[quality].taps;
+	if (r->down > r->up)
+		r->taps = (uint32_t)(((uint64_t)r->taps * r->down / r->up + 15) / 16 * 16);
+	fc = (r->down > r->up) ? 0.5 * r->up / r->down : 0.5; // cycles per input sample
+	beta = resample_quality[quality].beta;
+	half = r->taps / 2;
+	r->filter = malloc(r->up * r->taps * 2 * sizeof(int16_t));
+	r->history = calloc(AUD_RESAMPLE_CHUNK + r->taps, sizeof(int16_t));
+	c = malloc(r->taps * sizeof(double));
+	if (!r->filter || !r->history || !c) {
+		free(c);
+		snprintf(r->message, sizeof(r->message), "Not enough memory for the resampling filter");
+		return AUD_ERROR_STATE;
+	}
+	
+	for (p = 0; p < r->up; p++) {
+		sum = 0;
+		peak = 0;
+		for (m = 0; m < r->taps; m++) {
+			d = (double)p / r->up + half - 1 - m; // from output sample to input sample m of the window
+			x = d / half;
+			c[m] = (d == 0) ? 1 : sin(2 * RESAMPLE_PI * fc * d) / (2 * RESAMPLE_PI * fc * d);
+			c[m] *= bessel_i0(beta * sqrt((x * x < 1) ? 1 - x * x : 0)) / bessel_i0(beta);
+			sum += c[m];
+			if (fabs(c[m]) > fabs(c[peak])) peak = m;
+		}
+		hi = &r->filter[p * r->taps * 2];
+		lo = &hi[r->taps];
+		total = hi_abs = lo_abs = 0;
+		for (m = 0; m < r->taps; m++) {
+			x = c[m] / sum * (1 << (RESAMPLE_SHIFT + RESAMPLE_LO_SHIFT));
+			hi[m] = (int16_t)lround(x / (1 << RESAMPLE_LO_SHIFT));
+			lo[m] = (int16_t)lround(x - hi[m] * (1 << RESAMPLE_LO_SHIFT));
+			total += hi[m] * (1 << RESAMPLE_LO_SHIFT) + lo[m];
+		}
+		lo[peak] += (1 << (RESAMPLE_SHIFT + RESAMPLE_LO_SHIFT)) - total; // rounding errors
+		for (m = 0; m < r->taps; m++) {
+			hi_abs += abs(hi[m]);
+			lo_abs += abs(lo[m]);
+		}
+		if ((hi_abs > 0xFFFF) || (lo_abs > 0xFFFF)) { // a sum of products could overflow, not with these windows
+			free(c);
+			snprintf(r->message, sizeof(r->message), "Resampling filter of %u Hz to %u Hz is out of range", in_rate, out_rate);
+			return AUD_ERROR_STATE;
+		}
+	}
+	free(c);
+	
+	// The first output sample is at input sample 0, the ones before it are silent
+	r->held = half - 1;
+	return AUD_OK;
+}
+
+// Writes output samples while their windows have arrived, up to limit output samples in total
+static uint32_t resample_run(AUD_RESAMPLER *r, short *out, uint64_t limit) {
+	uint32_t pos = 0, n = 0;
+	int64_t acc;
+	
+	while ((pos + r->taps <= r->held) && (r->out_count + n < limit)) {
+		acc = resample_dot(&r->filter[r->phase * r->taps * 2], &r->history[pos], r->taps);
+		acc = (acc + (1 << (RESAMPLE_SHIFT + RESAMPLE_LO_SHIFT - 1))) >> (RESAMPLE_SHIFT + RESAMPLE_LO_SHIFT);
+		out[n++] = (acc < -32768) ? -32768 : (acc > 32767) ? 32767 : acc;
+		r->phase += r->down;
+		pos += r->phase / r->up;
+		r->phase %= r->up;
+	}
+	r->out_count += n;
+	
+	// Keep the window of the next output sample
+	if (pos >= r->held) {
+		r->skip += pos - r->held;
+		r->held = 0;
+	} else {
+		memmove(r->history, &r->history[pos], (r->held - pos) * sizeof(int16_t));
+		r->held -= pos;
+	}
+	return n;
+}
+
+uint32_t AUD_resample(AUD_RESAMPLER *r, const short *in, uint32_t n, short *out) {
+	uint32_t take, written = 0;
+	
+	while (n) {
+		if (r->skip) {
+			take = (n < r->skip) ? n : r->skip;
+			r->skip -= take;
+		} else {
+			take = AUD_RESAMPLE_CHUNK + r->taps - r->held;
+			if (take > n) take = n;
+			memcpy(&r->history[r->held], in, take * sizeof(int16_t));
+			r->held += take;
+		}
+		in += take;
+		n -= take;
+		r->in_count += take;
+		written += resample_run(r, &out[written], UINT64_MAX);
+	}
+	return written;
+}
+
+uint32_t AUD_resample_tail(const AUD_RESAMPLER *r) {
+	return (uint32_t)(AUD_resampled_samples(r, r->in_count) - r->out_count);
+}
+
+uint32_t AUD_resample_end(AUD_RESAMPLER *r, short *out) {
+	uint64_t end = AUD_resampled_samples(r, r->in_count);
+	uint32_t written = 0;
+	
+	while (r->out_count < end) {
+		r->skip = 0; // silence is skipped for free
+		memset(&r->history[r->held], 0, (AUD_RESAMPLE_CHUNK + r->taps - r->held) * sizeof(int16_t));
+		r->held = AUD_RESAMPLE_CHUNK + r->taps;
+		written += resample_run(r, &out[written], end);
+	}
+	return written;
+}
+
+void AUD_resample_free(AUD_RESAMPLER *r) {
+	free(r->filter);
+	free(r->history);
+	r->filter = NULL;
+	r->history = NULL;
+}
+
+
+
+/******************************** Analysis ********************************/
+
+// Samples are measured as they are, 1.0 of full scale is 32768. Peak, clipping and RMS are integer sums of each chunk,
+// eight samples at a time with SSE2. Loudness runs the samples through the K-weighting filter in doubles,
+// four at a time with AVX2, and keeps the sum of squares of every 100 ms: blocks of four of them are gated at the end.
+
+#define ANALYSIS_FULL_SCALE_SQ (32768.0 * 32768.0)
+#define ANALYSIS_STEPS_MIN 600 // one minute of steps, doubled as needed
+#define ANALYSIS_PI 3.14159265358979323846
+
+// Same sums one sample at a time, for the tail of a chunk and for compilers without SSE2
+static void analysis_levels_scalar(AUD_ANALYSIS *a, const short *pcm, uint32_t n) {
+	uint64_t sum_sq = 0, clipped = 0;
+	uint32_t i, peak = a->peak;
+	int32_t x;
+	
+	for (i = 0; i < n; i++) {
+		x = pcm[i];
+		if ((uint32_t)abs(x) > peak) peak = abs(x);
+		clipped += (x == 32767) || (x == -32768);
+		sum_sq += (uint32_t)(x * x);
+	}
+	a->peak = peak;
+	a->clipped += clipped;
+	a->sum_sq += sum_sq;
+}
+
+#ifdef __SSE2__
+
+static void analysis_levels(AUD_ANALYSIS *a, const short *pcm, uint32_t n) {
+	const __m128i top = _mm_set1_epi16(32767), bottom = _mm_set1_epi16(-32768), low = _mm_set1_epi64x(0xFFFFFFFF);
+	__m128i hi = _mm_setzero_si128(), lo = _mm_setzero_si128(), sq = _mm_setzero_si128(), clip, v, m;
+	int16_t max[8], min[8];
+	int32_t clips[4];
+	uint64_t sums[2];
+	uint32_t i = 0, end;
+	int j;
+	
+	while (n - i >= 8) {
+		// 16-bit clip counters, emptied every 32767 steps
+		end = (n - i) / 8 > 32767 ? i + 32767 * 8 : i + (n - i) / 8 * 8;
+		clip = _mm_setzero_si128();
+		for (; i < end; i += 8) {
+			v = _mm_loadu_si128((const __m128i *)&pcm[i]);
+			hi = _mm_max_epi16(hi, v);
+			lo = _mm_min_epi16(lo, v);
+			clip = _mm_sub_epi16(clip, _mm_or_si128(_mm_cmpeq_epi16(v, top), _mm_cmpeq_epi16(v, bottom)));
+			m = _mm_madd_epi16(v, v); // sums of two squares, up to 2^31: unsigned
+			sq = _mm_add_epi64(sq, _mm_add_epi64(_mm_and_si128(m, low), _mm_srli_epi64(m, 32)));
+		}
+		_mm_storeu_si128((__m128i *)clips, _mm_madd_epi16(clip, _mm_set1_epi16(1)));
+		a->clipped += (uint32_t)clips[0] + (uint32_t)clips[1] + (uint32_t)clips[2] + (uint32_t)clips[3];
+	}
+	_mm_storeu_si128((__m128i *)max, hi);
+	_mm_storeu_si128((__m128i *)min, lo);
+	_mm_storeu_si128((__m128i *)sums, sq);
+	for (j = 0; j < 8; j++) {
+		if ((uint32_t)max[j] > a->peak) a->peak = max[j];
+		if ((uint32_t)-min[j] > a->peak) a->peak = -min[j];
+	}
+	a->sum_sq += sums[0] + sums[1];
+	analysis_levels_scalar(a, &pcm[i], n - i);
+}
+
+#else
+
+static void analysis_levels(AUD_ANALYSIS *a, const short *pcm, uint32_t n) {
+	analysis_levels_scalar(a, pcm, n);
+}
+
+#endif
+
+// Ends a 100 ms step. The filter state is flushed to zero once it has decayed far below one sample step,
+// long silence would otherwise take it into denormals, which are slow
+static void analysis_step(AUD_ANALYSIS *a) {
+	double *steps;
+	int j;
+	
+	if (a->step_count == a->steps_size) {
+		a->steps_size = a->steps_size ? a->steps_size * 2 : ANALYSIS_STEPS_MIN;
+		if (!(steps = realloc(a->steps, a->steps_size * sizeof(double)))) {
+			free(a->steps);
+			a->steps = NULL;
+			a->step_len = a->step_count = 0; // not enough memory, loudness isn't measured
+			return;
+		}
+		a->steps = steps;
+	}
+	a->steps[a->step_count++] = a->step_sq;
+	a->step_sq = 0;
+	a->step_pos = 0;
+	for (j = 0; j < 8; j += 2)
+		if (fabs(a->state[j]) + fabs(a->state[j + 1]) < 1e-9)
+			a->state[j] = a->state[j + 1] = 0;
+}
+
+// Four outputs of one filter at once: output k is the sum over j <= k of r(k-j) w(j), plus p(k) y(-1) + q(k) y(-2).
+// w is the feed-forward part of each sample, r the impulse response of the feedback, y(-1) and y(-2) the last outputs
+// before them, and p, q how these two carry on. Each output is then a sum of the four inputs, the two inputs before
+// them and the two outputs before them: columns[s] gives the share of source s in outputs 0..3.
+static void analysis_columns(double (*columns)[4], const double *c) {
+	double r[4], p[4], q[4], sum;
+	int k, s, i, j;
+	
+	p[0] = -c[3];
+	q[0] = -c[4];
+	p[1] = -c[3] * p[0] - c[4];
+	q[1] = -c[3] * q[0];
+	for (k = 2; k < 4; k++) {
+		p[k] = -c[3] * p[k - 1] - c[4] * p[k - 2];
+		q[k] = -c[3] * q[k - 1] - c[4] * q[k - 2];
+	}
+	r[0] = 1;
+	for (k = 1; k < 4; k++)
+		r[k] = p[k - 1];
+	
+	for (k = 0; k < 4; k++) {
+		for (s = 0; s < 6; s++) {
+			i = (s < 4) ? s : 3 - s; // inputs 0..3, then -1 and -2
+			sum = 0;
+			for (j = 0; j <= k; j++)
+				if ((j - i >= 0) && (j - i <= 2))
+					sum += r[k - j] * c[j - i];
+			columns[s][k] = sum;
+		}
+		columns[6][k] = p[k];
+		columns[7][k] = q[k];
+	}
+}
+
+#ifdef __AVX2__
+
+// Four samples through one filter, h = broadcasts of the last two inputs and outputs before them, updated
+static inline __m256d analysis_filter4(const __m256d *col, __m256d in, __m256d *h) {
+	__m256d out, x;
+	
+	x = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(col[0], _mm256_permute4x64_pd(in, 0x00)), _mm256_mul_pd(col[1], _mm256_permute4x64_pd(in, 0x55))),
+	                  _mm256_add_pd(_mm256_mul_pd(col[2], _mm256_permute4x64_pd(in, 0xAA)), _mm256_mul_pd(col[3], _mm256_permute4x64_pd(in, 0xFF))));
+	x = _mm256_add_pd(x, _mm256_add_pd(_mm256_mul_pd(col[4], h[0]), _mm256_mul_pd(col[5], h[1])));
+	out = _mm256_add_pd(x, _mm256_add_pd(_mm256_mul_pd(col[6], h[2]), _mm256_mul_pd(col[7], h[3])));
+	h[0] = _mm256_permute4x64_pd(in, 0xFF);
+	h[1] = _mm256_permute4x64_pd(in, 0xAA);
+	h[2] = _mm256_permute4x64_pd(out, 0xFF);
+	h[3] = _mm256_permute4x64_pd(out, 0xAA);
+	return out;
+}
+
+// K-weighted squares of whole groups of four samples, returns how many samples were done
+static uint32_t analysis_weight4(AUD_ANALYSIS *a, const short *pcm, uint32_t n) {
+	__m256d col[2][8], h[2][4], x, sq = _mm256_setzero_pd();
+	double sums[4];
+	uint32_t i;
+	int f, s;
+	
+	for (f = 0; f < 2; f++) {
+		for (s = 0; s < 8; s++)
+			col[f][s] = _mm256_loadu_pd(a->columns[f][s]);
+		for (s = 0; s < 4; s++)
+			h[f][s] = _mm256_set1_pd(a->state[f * 4 + s]);
+	}
+	for (i = 0; i + 4 <= n; i += 4) {
+		x = _mm256_cvtepi32_pd(_mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i *)&pcm[i])));
+		x = analysis_filter4(col[1], analysis_filter4(col[0], x, h[0]), h[1]);
+		sq = _mm256_add_pd(sq, _mm256_mul_pd(x, x));
+	}
+	for (f = 0; f < 2; f++)
+		for (s = 0; s < 4; s++)
+			a->state[f * 4 + s] = _mm256_cvtsd_f64(h[f][s]);
+	_mm256_storeu_pd(sums, sq);
+	a->step_sq += (sums[0] + sums[1]) + (sums[2] + sums[3]);
+	return i;
+}
+
+#else
+
+static uint32_t analysis_weight4(AUD_ANALYSIS *a, const short *pcm, uint32_t n) {
+	(void)a; (void)pcm; (void)n;
+	return 0;
+}
+
+#endif
+
+// K-weighted squares: the high shelf and then the high pass, direct form, one sample after another
+// State and coefficients are copied, so that the compiler can keep them in registers
+static void analysis_weight(AUD_ANALYSIS *a, const short *pcm, uint32_t n) {
+	double c[2][5], x, y, z, sq = a->step_sq;
+	double x1 = a->state[0], x2 = a->state[1], y1 = a->state[2], y2 = a->state[3], z1 = a->state[6], z2 = a->state[7];
+	uint32_t i;
+	
+	memcpy(c, a->coef, sizeof(c));
+	for (i = 0; i < n; i++) {
+		x = pcm[i];
+		y = c[0][0] * x + c[0][1] * x1 + c[0][2] * x2 - c[0][4] * y2 - c[0][3] * y1;
+		z = c[1][0] * y + c[1][1] * y1 + c[1][2] * y2 - c[1][4] * z2 - c[1][3] * z1;
+		x2 = x1; x1 = x;
+		y2 = y1; y1 = y;
+		z2 = z1; z1 = z;
+		sq += z * z;
+	}
+	a->state[0] = x1; a->state[1] = x2;
+	a->state[2] = a->state[4] = y1; // the output of the shelf is the input of the high pass
+	a->state[3] = a->state[5] = y2;
+	a->state[6] = z1; a->state[7] = z2;
+	a->step_sq = sq;
+}
+
+// Loudness part of AUD_analyze(), in steps of 100 ms
+static void analysis_loudness(AUD_ANALYSIS *a, const short *pcm, uint32_t n) {
+	uint32_t m, done;
+	
+	while (n && a->step_len) {
+		m = a->step_len - a->step_pos;
+		if (m > n) m = n;
+		done = analysis_weight4(a, pcm, m);
+		analysis_weight(a, &pcm[done], m - done);
+		a->step_pos += m;
+		pcm += m;
+		n -= m;
+		if (a->step_pos == a->step_len)
+			analysis_step(a);
+	}
+}
+
+void AUD_analysis_init(AUD_ANALYSIS *a, uint32_t samplerate) {
+	double k, q, vh, vb, a0;
+	double *c;
+	
+	memset(a, 0, sizeof(AUD_ANALYSIS));
+	a->samplerate = samplerate;
+	if (samplerate < AUD_ANALYSIS_RATE_MIN)
+		return;
+	a->step_len = (samplerate + 5) / 10;
+	
+	// BS.1770 gives both filters at 48 kHz, these are the same analog prototypes at any rate
+	// High shelf, +4 dB above 1.7 kHz: the head
+	c = a->coef[0];
+	k = tan(ANALYSIS_PI * 1681.974450955533 / samplerate);
+	q = 0.7071752369554196;
+	vh = pow(10, 3.999843853973347 / 20);
+	vb = pow(vh, 0.4996667741545416);
+	a0 = 1 + k / q + k * k;
+	c[0] = (vh + vb * k / q + k * k) / a0;
+	c[1] = 2 * (k * k - vh) / a0;
+	c[2] = (vh - vb * k / q + k * k) / a0;
+	c[3] = 2 * (k * k - 1) / a0;
+	c[4] = (1 - k / q + k * k) / a0;
+	// High pass at 38 Hz
+	c = a->coef[1];
+	k = tan(ANALYSIS_PI * 38.13547087602444 / samplerate);
+	q = 0.5003270373238773;
+	a0 = 1 + k / q + k * k;
+	c[0] = 1;
+	c[1] = -2;
+	c[2] = 1;
+	c[3] = 2 * (k * k - 1) / a0;
+	c[4] = (1 - k / q + k * k) / a0;
+	
+	analysis_columns(a->columns[0], a->coef[0]);
+	analysis_columns(a->columns[1], a->coef[1]);
+}
+
+void AUD_analyze(AUD_ANALYSIS *a, const short *pcm, uint32_t n) {
+	a->samples += n;
+	analysis_levels(a, pcm, n);
+	analysis_loudness(a, pcm, n);
+}
+
+void AUD_analyze_stream(AUD_CONTEXT *ctx, AUD_ANALYSIS *a) {
+	ctx->analysis = a;
+}
+
+// Mean square of a block of four steps, relative to full scale
+static double analysis_block(const AUD_ANALYSIS *a, uint32_t j) {
+	return (a->steps[j - 3] + a->steps[j - 2] + a->steps[j - 1] + a->steps[j]) / (4.0 * a->step_len * ANALYSIS_FULL_SCALE_SQ);
+}
+
+void AUD_analysis_end(AUD_ANALYSIS *a) {
+	double absolute = pow(10, (-70 + 0.691) / 10), relative, sum = 0, block;
+	uint32_t j, count = 0;
+	
+	a->peak_db = a->peak ? 20 * log10(a->peak / 32768.0) : -INFINITY;
+	a->rms_db = a->sum_sq ? 10 * log10(a->sum_sq / (double)a->samples / ANALYSIS_FULL_SCALE_SQ) : -INFINITY;
+	a->loudness = a->step_len ? -INFINITY : NAN;
+	
+	// Blocks above -70 LUFS, then the ones of them less than 10 LU below their mean
+	for (j = 3; j < a->step_count; j++)
+		if ((block = analysis_block(a, j)) > absolute) {
+			sum += block;
+			count++;
+		}
+	if (!count) return;
+	relative = sum / count / 10;
+	sum = 0;
+	count = 0;
+	for (j = 3; j < a->step_count; j++)
+		if (((block = analysis_block(a, j)) > absolute) && (block > relative)) {
+			sum += block;
+			count++;
+		}
+	a->loudness = -0.691 + 10 * log10(sum / count);
+}
+
+void AUD_analysis_free(AUD_ANALYSIS *a) {
+	free(a->steps);
+	a->steps = NULL;
+	a->step_count = a->steps_size = 0;
+}
+
+
+/******************************** MIX archives ********************************/
+
+static int mix_error(MIX_ARCHIVE *mix, int error, const char *format, ...) {
+	va_list ap;
+	
+	va_start(ap, format);
+	vsnprintf(mix->message, sizeof(mix->message), format, ap);
+	va_end(ap);
+	return error;
+}
+
+static int compare_entries(const void *a, const void *b) {
+	uint32_t x = ((const MIX_ENTRY *)a)->id, y = ((const MIX_ENTRY *)b)->id;
+	return (x > y) - (x < y);
+}
+
+int MIX_open(MIX_ARCHIVE *mix, FILE *f) {
+	const unsigned char *p;
+	uint32_t i, header, body, body_size;
+	int64_t size;
+#ifdef AUDLIB_MMAP
+	struct stat st;
+	void *map;
+#endif
+	unsigned char *data;
+	
+	memset(mix, 0, sizeof(MIX_ARCHIVE));
+
+#ifdef AUDLIB_MMAP
+	// Mapped, so that entries are decoded in place without copying
+	
+	if ((fstat(fileno(f), &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0) && ((uint64_t)st.st_size <= SIZE_MAX)) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+		if (map != MAP_FAILED) {
+			mix->map = map;
+			mix->data = map;
+			mix->size = st.st_size;
+		}
+	}
+#endif
+	
+	// Fall back to reading the whole archive
+	
+	if (!mix->data) {
+		if ((fseeko(f, 0, SEEK_END) != 0) || ((size = ftello(f)) <= 0) || (fseeko(f, 0, SEEK_SET) != 0))
+			return mix_error(mix, AUD_ERROR_SEEK, "MIX archive has to be a regular file");
+		if (((uint64_t)size > SIZE_MAX) || !(data = malloc(size)))
+			return mix_error(mix, AUD_ERROR_READ, "not enough memory for the archive");
+		mix->data = data;
+		mix->size = fread(data, 1, size, f);
+	}
+	
+	// Tiberian Dawn archives start with the entry count, Red Alert ones with flags whose low word is zero
+	
+	p = mix->data;
+	if (mix->size < 4 + MIX_HEADER_SIZE)
+		return mix_error(mix, AUD_ERROR_FORMAT, "not a MIX archive");
+	header = 0;
+	if (get16(p) == 0) {
+		mix->flags = get32(p);
+		if (mix->flags & MIX_FLAG_ENCRYPTED)
+			return mix_error(mix, AUD_ERROR_UNSUPPORTED, "encrypted MIX archives are not supported");
+		if (mix->flags & ~(MIX_FLAG_CHECKSUM | MIX_FLAG_ENCRYPTED))
+			return mix_error(mix, AUD_ERROR_FORMAT, "not a MIX archive");
+		header = 4;
+	}
+	mix->count = get16(p + header);
+	body_size = get32(p + header + 2);
+	body = header + MIX_HEADER_SIZE + mix->count * MIX_ENTRY_SIZE;
+	if ((body > mix->size) || (body_size > mix->size - body))
+		return mix_error(mix, AUD_ERROR_FORMAT, "not a MIX archive, or truncated");
+	
+	// Entries, offsets made absolute
+	
+	if (!(mix->entries = malloc((mix->count + 1) * sizeof(MIX_ENTRY))))
+		return mix_error(mix, AUD_ERROR_READ, "not enough memory for the index");
+	for (i = 0; i < mix->count; i++) {
+		p = &mix->data[header + MIX_HEADER_SIZE + i * MIX_ENTRY_SIZE];
+		mix->entries[i].id = get32(p);
+		mix->entries[i].offset = get32(p + 4);
+		mix->entries[i].size = get32(p + 8);
+		if ((mix->entries[i].offset > body_size) || (mix->entries[i].size > body_size - mix->entries[i].offset))
+			return mix_error(mix, AUD_ERROR_FORMAT, "entry %08X is outside of the archive body", mix->entries[i].id);
+		mix->entries[i].offset += body;
+	}
+	
+	// Westwood sorted them as signed IDs, MIX_find() searches unsigned ones
+	qsort(mix->entries, mix->count, sizeof(MIX_ENTRY), compare_entries);
+	return AUD_OK;
+}
+
+// Uppercase name in little-endian 32-bit words, zero-padded, each added to the previous sum rotated left by 1
+uint32_t MIX_id(const char *name) {
+	uint32_t id = 0, word;
+	int i;
+	
+	while (*name) {
+		word = 0;
+		for (i = 0; i < 4; i++) {
+			unsigned char c = *name;
+			if (c) name++;
+			if ((c >= 'a') && (c <= 'z')) c -= 'a' - 'A';
+			word |= (uint32_t)c << (i * 8);
+		}
+		id = ((id << 1) | (id >> 31)) + word;
+	}
+	return id;
+}
+
+const MIX_ENTRY *MIX_find(const MIX_ARCHIVE *mix, uint32_t id) {
+	MIX_ENTRY key;
+	
+	key.id = id;
+	return mix->count ? bsearch(&key, mix->entries, mix->count, sizeof(MIX_ENTRY), compare_entries) : NULL;
+}
+
+void MIX_close(MIX_ARCHIVE *mix) {
+#ifdef AUDLIB_MMAP
+	if (mix->map)
+		munmap(mix->map, mix->size);
+	else
+#endif
+		free((void *)mix->data);
+	free(mix->entries);
+	mix->map = NULL;
+	mix->data = NULL;
+	mix->entries = NULL;
+	mix->count = 0;
+}
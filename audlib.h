@@ -0,0 +1,553 @@
+// audlib - Westwood AUD (IMA ADPCM) decoding and remuxing library used by aud2wav
+
+// All state lives in AUD_CONTEXT, there are no globals except constant lookup tables,
+// so any number of contexts can be used in parallel from different threads.
+//
+// Typical use:
+//   AUD_open_file(ctx, f, 0) -> AUD_probe(ctx) -> AUD_decode(ctx, pcm, n)... or
+//                                                 AUD_remux_begin(ctx, 512) -> AUD_remux(ctx, buf, size)...
+//   -> AUD_close(ctx)
+
+#ifndef AUDLIB_H
+#define AUDLIB_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+
+/******************************** Result codes ********************************/
+
+#define AUD_OK                0
+#define AUD_WARNING           1  // stream is usable, but something is wrong with it, see message
+#define AUD_ERROR_FORMAT     -1  // not an AUD file
+#define AUD_ERROR_UNSUPPORTED -2 // AUD file, but not mono 16-bit IMA ADPCM
+#define AUD_ERROR_READ       -3  // broken block chain or truncated file
+#define AUD_ERROR_SEEK       -4  // operation needs a seekable input
+#define AUD_ERROR_STATE      -5  // function called out of order, or invalid argument
+#define AUD_ERROR_WRITE      -6  // output could not be written
+#define AUD_ERROR_VERIFY     -7  // remuxed data doesn't decode to the same samples, see AUD_remux_verify()
+
+
+
+/******************************** AUD headers ********************************/
+
+#define AUD_HEADER_NEW_SIZE   12 // NEW AUD format header (bytes 0..11)
+#define AUD_HEADER_OLD_SIZE   8  // OLD AUD format header (bytes 0..7)
+#define AUD_BLOCK_HEADER_SIZE 8  // Block header, follows file header (NEW bytes 12..19, OLD bytes 8..15)
+#define AUD_BLOCK_MAX         65535
+
+#define AUD_FORMAT_NEW 1
+#define AUD_FORMAT_OLD 2
+
+// Version-independent pseudo header
+typedef struct {
+	int format; // AUD_FORMAT_NEW or AUD_FORMAT_OLD
+	uint16_t samplerate;
+	uint32_t encsize;
+	uint32_t decsize; // 0 if OLD format
+	uint8_t flags;    // bit0=stereo, bit1=16bit
+	uint8_t codec;    // 1=Westwood ADPCM, 99=IMA ADPCM
+	// Additional file info, filled by AUD_probe() or at the end of a single-pass conversion
+	uint64_t filesize; // 0 if not known
+	uint32_t first_block_offset;
+	uint32_t first_block_size;
+	uint32_t last_block_size;
+	uint64_t blocks;   // counts are 64-bit, encsize and decsize of a stream over 4 GB have wrapped around
+	uint64_t adpcm_bytes;
+	uint64_t num_samples; // estimated from decsize (or 0) until known
+} AUD_HEADER;
+
+typedef struct {
+	uint16_t encsize;
+	uint16_t decsize;
+	uint16_t deaf; // 0xDEAF
+	uint16_t zero; // 0x0000
+} AUD_BLOCK_HEADER;
+
+
+
+/******************************** WAV headers ********************************/
+
+#define WAV_HEADER_PCM_SIZE   44
+#define WAV_HEADER_ADPCM_SIZE 60
+#define WAV_HEADER_DS64_SIZE  36 // ds64 chunk of an RF64 file, between "WAVE" and fmt
+#define WAV_HEADER_MAX_SIZE   (WAV_HEADER_ADPCM_SIZE + WAV_HEADER_DS64_SIZE)
+#define WAV_BLOCK_HEADER_SIZE 4
+
+// Size fields of a streamed WAV whose length is not known in advance, written as 0xFFFFFFFF
+#define WAV_SIZE_UNKNOWN UINT64_MAX
+
+// Full header of a PCM .wav file
+// Sizes that don't fit 32 bits make it an RF64 (BW64) file: "RF64" instead of "RIFF", 0xFFFFFFFF in the
+// 32-bit size fields and a ds64 chunk with the real ones
+typedef struct {
+	uint32_t RIFF;
+	uint64_t riffsize;
+	uint32_t WAVE;
+	uint32_t fmt;
+	uint32_t fmtlen;
+	uint16_t wFormatTag; // 1=PCM
+	uint16_t nChannels;
+	uint32_t nSamplesPerSec;
+	uint32_t nAvgBytesPerSec;
+	uint16_t nBlockAlign;
+	uint16_t wBitsPerSample;
+	uint32_t data;
+	uint64_t datalen;
+	char rf64;
+} WAV_HEADER_PCM;
+
+// Full header of an IMA ADPCM .wav file, RF64 like the PCM one, also when only nSamples doesn't fit
+typedef struct {
+	uint32_t RIFF;
+	uint64_t riffsize;
+	uint32_t WAVE;
+	uint32_t fmt;
+	uint32_t fmtlen;
+	uint16_t wFormatTag; // 0x11=IMA ADPCM
+	uint16_t nChannels;
+	uint32_t nSamplesPerSec;
+	uint32_t nAvgBytesPerSec;
+	uint16_t nBlockAlign;
+	uint16_t wBitsPerSample;
+	uint16_t cbSize; // 2
+	uint16_t samplesPerBlock;
+	uint32_t fact;
+	uint32_t factlen;
+	uint64_t nSamples;
+	uint32_t data;
+	uint64_t datalen;
+	char rf64;
+} WAV_HEADER_ADPCM;
+
+// Header of each ADPCM block
+typedef struct {
+	int16_t sample; // PCM decoded sample
+	uint8_t index;  // decoder state initialization
+	uint8_t zero;
+} WAV_BLOCK_HEADER;
+
+// Fill header fields, datalen = WAV_SIZE_UNKNOWN if not known yet, rf64 is set if the sizes need it
+// A streamed file's header is patched at the end: set rf64 again if it started as RF64, the layout can't change
+void WAV_header_pcm(WAV_HEADER_PCM *h, uint32_t samplerate, uint64_t datalen);
+void WAV_header_adpcm(WAV_HEADER_ADPCM *h, uint32_t samplerate, uint32_t wav_blocksize, uint64_t num_samples, uint64_t datalen);
+
+// Serialize headers in little-endian byte order, buf must hold WAV_HEADER_MAX_SIZE bytes
+// Return the header size: WAV_HEADER_*_SIZE, plus WAV_HEADER_DS64_SIZE for RF64
+uint32_t WAV_write_header_pcm(const WAV_HEADER_PCM *h, unsigned char *buf);
+uint32_t WAV_write_header_adpcm(const WAV_HEADER_ADPCM *h, unsigned char *buf);
+void WAV_write_block_header(const WAV_BLOCK_HEADER *h, unsigned char *buf);
+
+// Parses the header of a .wav (or RF64) file of size bytes in buf, *data_offset gets the offset of its samples
+// datalen is clipped to the data actually present, for streamed files and files cut short
+// Returns AUD_OK, AUD_ERROR_FORMAT if fmt or data is missing, or AUD_ERROR_UNSUPPORTED if it is not mono 16-bit PCM
+int WAV_read_header_pcm(WAV_HEADER_PCM *h, const unsigned char *buf, size_t size, uint32_t *data_offset);
+
+
+
+/******************************** ADPCM decoding ********************************/
+
+#define ADPCM_ALGORITHMS 4
+
+extern unsigned short ADPCM_STEP_TABLE[89];
+extern char ADPCM_INDEX_ADJUST[8];
+
+// Decodes one nibble, algorithm 0..3 (see README)
+void ADPCM_decode_sample(int use_algorithm, char *index, long *sample, unsigned char nibble);
+
+// Decodes nibbles pos..end-1 of in (least significant nibble of each byte first) into pcm,
+// same result as ADPCM_decode_sample() for each of them
+typedef void (*ADPCM_KERNEL)(const unsigned char *in, uint32_t pos, uint32_t end, short *pcm, char *index, long *sample);
+
+// Block kernel for algorithm 0..3, chosen once per stream
+ADPCM_KERNEL ADPCM_kernel(int use_algorithm);
+
+// Checks the packed tables used by algorithm #0 kernels against DiffTable / IndexTable,
+// for every index, nibble and byte, across the sample range and at the rails
+// Returns number of mismatches, 0 if bit-exact
+int ADPCM_check_tables(void);
+
+
+
+/******************************** Context ********************************/
+
+// Round-trip check of remuxed data, see AUD_remux_verify()
+typedef struct {
+	char aud_index;  // the stream, decoded apart from the remuxer with algorithm #0
+	long aud_sample;
+	char wav_index;  // the WAV block being checked, decoded from its header with algorithm #1
+	long wav_sample;
+	short expected;  // at the first mismatch
+	short got;
+} AUD_VERIFY;
+
+// Input source, seek = NULL for non-seekable streams
+typedef struct {
+	size_t (*read)(void *handle, void *buf, size_t size);
+	int (*seek)(void *handle, uint64_t offset); // returns 0 on success
+	void *handle;
+} AUD_IO;
+
+// Byte blob source, used by AUD_open_memory()
+typedef struct {
+	const unsigned char *data;
+	size_t size;
+	size_t pos;
+} AUD_MEMORY;
+
+// Everything needed to decode one AUD stream. Caller allocates it (it's large, prefer heap),
+// fields are read-only for the caller
+typedef struct {
+	AUD_HEADER header;
+	char stream;   // single pass: input is not seekable or single pass was requested
+	char probed;   // block counts in header are exact
+	
+	// Input
+	AUD_IO io;
+	AUD_MEMORY memory; // memory-backed input: AUD_open_memory() or a mapped file
+	FILE *file;
+	void *map;         // mapping of a regular file opened by AUD_open_file()
+	size_t map_size;
+	unsigned char head[AUD_HEADER_NEW_SIZE + AUD_BLOCK_HEADER_SIZE]; // read ahead for format detection
+	uint32_t head_len;
+	uint32_t head_pos;
+	uint64_t in_offset; // current input position
+	const char *stage;  // what we are doing, for error messages
+	
+	// Current AUD block
+	AUD_BLOCK_HEADER block_header;
+	const unsigned char *block; // payload: in memory-backed input, or in_buffer
+	unsigned char in_buffer[AUD_BLOCK_MAX];
+	uint32_t block_size;  // bytes
+	uint32_t block_end;   // nibbles to be decoded, block_size * 2 unless the range ends within the block
+	uint32_t block_pos;   // nibbles already decoded
+	uint64_t blocks_read; // since AUD_rewind()
+	uint64_t bytes_read;
+	char eof;
+	
+	// Range, see AUD_set_range(), range_end = 0 for the whole stream
+	const struct AUD_INDEX *range_index;
+	uint64_t range_start;
+	uint64_t range_end;
+	
+	// Decoder state
+	int algorithm;
+	ADPCM_KERNEL kernel;
+	char adpcm_index;
+	long adpcm_sample;
+	char all_index[ADPCM_ALGORITHMS]; // states of every algorithm, see AUD_decode_all()
+	long all_sample[ADPCM_ALGORITHMS];
+	
+	// Remuxer state, see AUD_remux_begin()
+	char remuxing;
+	uint32_t wav_blocksize; // unlike "blocksize" this one does NOT include 4-byte header
+	uint64_t wav_blocks;
+	uint64_t wav_datalen;
+	uint64_t wav_blocks_written;
+	unsigned char wav_block[WAV_BLOCK_HEADER_SIZE + 32767];
+	uint32_t wav_block_len; // bytes assembled in wav_block
+	uint32_t wav_block_pos; // bytes of wav_block already returned to the caller
+	char verify;
+	AUD_VERIFY verifier;
+	
+	// Levels measured on the decoded samples, see AUD_analyze_stream(), NULL if not measured
+	struct AUD_ANALYSIS *analysis;
+	
+	// Last error or warning
+	int error;
+	char message[256];
+} AUD_CONTEXT;
+
+// Opens a stream and detects its format, reads only the first 20 bytes
+// stream = 1 requests single-pass operation even if the input is seekable
+// Regular files are memory-mapped (unless built with AUDLIB_NO_MMAP), pipes are read with fread()
+// Every successful or failed open must be followed by AUD_close()
+int AUD_open(AUD_CONTEXT *ctx, const AUD_IO *io, int stream);
+int AUD_open_file(AUD_CONTEXT *ctx, FILE *f, int stream);
+int AUD_open_memory(AUD_CONTEXT *ctx, const void *data, size_t size);
+
+// Counts blocks and samples (first read-through), or takes the estimate from the header in single-pass mode
+// Returns AUD_WARNING if the block chain is broken, header then describes the readable part
+int AUD_probe(AUD_CONTEXT *ctx);
+
+// Same as AUD_probe() with the header of an earlier AUD_probe() of the same data, nothing is read
+// A broken stream is then converted up to the same block, AUD_probe()'s warning is not repeated
+int AUD_probe_restore(AUD_CONTEXT *ctx, const AUD_HEADER *probed);
+// Same as AUD_probe() without reading the ADPCM data: walks the block headers and seeks over the payloads,
+// only the last block is checked against the file size. Needs seekable input. Also counts the blocks of
+// unsupported codecs, num_samples then comes from the decoded sizes in block headers, and returns AUD_ERROR_UNSUPPORTED
+int AUD_probe_headers(AUD_CONTEXT *ctx);
+
+// Resets decoder to the first block, with the given algorithm (0..3)
+// In single-pass mode possible only before anything has been decoded
+int AUD_rewind(AUD_CONTEXT *ctx, int algorithm);
+
+// Decodes up to max_samples samples, returns number of samples, 0 at the end of stream, or error
+// At the end of a single-pass stream header is updated with actual counts
+// A stream ending with a broken block is not an error, but ctx->error and message are set
+long AUD_decode(AUD_CONTEXT *ctx, short *pcm, uint32_t max_samples);
+
+// Same as AUD_decode() with each of the ADPCM_ALGORITHMS algorithms, in a single pass over the stream:
+// pcm[a] gets samples decoded by algorithm a, each algorithm keeps its own decoder state
+// Needs a stream rewound by AUD_rewind(ctx, 0) without a range, don't mix with AUD_decode()
+long AUD_decode_all(AUD_CONTEXT *ctx, short **pcm, uint32_t max_samples);
+
+// Prepares remuxing with WAV block size including header: 4..32771, -1 or -2 (see README)
+// Rewinds the stream, always uses algorithm #0
+int AUD_remux_begin(AUD_CONTEXT *ctx, int blocksize);
+
+// Produces WAV ADPCM data (without WAV header) into buf, returns bytes written, 0 at the end, or error
+long AUD_remux(AUD_CONTEXT *ctx, unsigned char *buf, uint32_t size);
+
+// Makes AUD_remux() and AUD_remux_parallel() check every WAV block they produce: it is decoded from its header
+// and compared with the stream, decoded separately in the same pass. Call after AUD_remux_begin()
+// The first mismatch stops remuxing with AUD_ERROR_VERIFY, the message tells where it is
+int AUD_remux_verify(AUD_CONTEXT *ctx, int verify);
+
+// One of the outputs of AUD_decode_multi(): PCM samples, or IMA ADPCM WAV data with its own block size
+typedef struct {
+	int blocksize; // as for AUD_remux_begin(), 0 for PCM
+	// WAV data, set up by AUD_multi_begin()
+	uint32_t wav_blocksize; // without 4-byte header, like in AUD_CONTEXT
+	uint64_t wav_blocks;
+	uint64_t wav_datalen;
+	uint64_t wav_blocks_written;
+	uint32_t wav_block_pos; // samples of the current block in wav_block, 0 before its header
+	unsigned char wav_block[WAV_BLOCK_HEADER_SIZE + 32767];
+	// Set by the caller before each AUD_decode_multi(), which sets len to the bytes it wrote
+	unsigned char *buf;
+	uint32_t size;
+	uint32_t len;
+} AUD_OUTPUT;
+
+// Prepares decoding into count outputs at once, all of them fed by one decoder (algorithm #0) in a single pass
+// Rewinds the stream and chooses the block size of each WAV output, returns AUD_WARNING like AUD_remux_begin()
+int AUD_multi_begin(AUD_CONTEXT *ctx, AUD_OUTPUT *outputs, int count);
+
+// Largest max_samples of AUD_decode_multi() that a buffer of size bytes has room for, 0 if it's too small
+uint32_t AUD_multi_samples(const AUD_OUTPUT *output, uint32_t size);
+
+// Decodes up to max_samples samples into every output: PCM samples, or the WAV blocks they complete, the last one
+// is padded at the end of stream. Returns number of samples, 0 at the end (the last blocks may still be written), or error
+long AUD_decode_multi(AUD_CONTEXT *ctx, AUD_OUTPUT *outputs, int count, uint32_t max_samples);
+
+// Same as AUD_decode() / AUD_remux() with up to threads threads, output is bit-exact and calls can be mixed with them
+// Each call splits the part of the stream that fits its buffer, so memory use is set by the caller, not by the stream
+// length; larger buffers give each thread more work (at least 65536 samples). AUD_remux_parallel() splits whole
+// WAV blocks. Only the whole of a probed memory-backed stream (AUD_open_memory() or a mapped file) is split,
+// other input, ranges, remuxing with analysis and buffers too small to split are decoded by one thread
+long AUD_decode_parallel(AUD_CONTEXT *ctx, short *pcm, uint32_t max_samples, int threads);
+long AUD_remux_parallel(AUD_CONTEXT *ctx, unsigned char *buf, uint32_t size, int threads);
+
+// Decodes up to max_samples samples of each of count streams at once, one SIMD lane per stream (AVX2 if enabled)
+// Same as AUD_decode() for each stream: pcm[i] gets samples of ctx[i], decoded[i] their number, 0 or error
+// Returns number of streams that produced samples, 0 when all of them have ended
+#define AUD_LANES 8
+int AUD_decode_lanes(AUD_CONTEXT **ctx, int count, short **pcm, uint32_t max_samples, long *decoded);
+
+// Seek index: decoder state at the start of every block, so that decoding can start anywhere
+// States depend on the algorithm, #0 and #1 share them, #2 and #3 need their own index
+typedef struct {
+	uint64_t offset; // of the block header
+	uint64_t sample; // first sample of the block
+	int16_t adpcm_sample;
+	uint8_t adpcm_index;
+	uint8_t zero;
+} AUD_CHECKPOINT;
+
+#define AUD_INDEX_VERSION         2  // 64-bit fields, version 1 files are rejected (and rebuilt by aud2wav)
+#define AUD_INDEX_HEADER_SIZE     40 // sidecar file: "AUDX", version, algorithm, filesize, blocks, num_samples, count
+#define AUD_INDEX_CHECKPOINT_SIZE 20 // followed by one of these per block
+
+typedef struct AUD_INDEX {
+	int algorithm;
+	uint64_t filesize; // of the stream it was built for, checked when it's loaded
+	uint64_t blocks;
+	uint64_t num_samples;
+	uint64_t count;
+	AUD_CHECKPOINT *checkpoints;
+} AUD_INDEX;
+
+// Builds the index of a probed stream with the given algorithm (one read-through, no output), clears the range
+// Every successful or failed build or load must be followed by AUD_index_free()
+int AUD_index_build(AUD_CONTEXT *ctx, AUD_INDEX *index, int algorithm);
+
+// Saves index as a sidecar file, or loads it back if it was built for the same probed stream
+int AUD_index_save(AUD_CONTEXT *ctx, const AUD_INDEX *index, FILE *f);
+int AUD_index_load(AUD_CONTEXT *ctx, AUD_INDEX *index, FILE *f);
+void AUD_index_free(AUD_INDEX *index);
+
+// Restricts decoding and remuxing of a probed stream to samples start..end-1 (end is clipped to the stream),
+// AUD_rewind() and AUD_remux_begin() then jump to the last checkpoint before start and decode from there
+// index must stay valid until the range is cleared with index = NULL, or the stream is closed
+// Parallel decoding of a range is done by one thread
+int AUD_set_range(AUD_CONTEXT *ctx, const AUD_INDEX *index, uint64_t start, uint64_t end);
+
+// Finds WAV block size with smallest resulting data size, or calculates data size for a fixed one
+void AUD_choose_blocksize(int blocksize, uint64_t num_samples, uint32_t *wav_blocksize, uint64_t *wav_blocks, uint64_t *wav_datalen);
+
+void AUD_close(AUD_CONTEXT *ctx);
+
+
+
+/******************************** Encoding ********************************/
+
+#define AUD_ENCODE_GREEDY  0 // for each sample the nibble that decodes closest to it, fast
+#define AUD_ENCODE_TRELLIS 1 // searches paths of nibbles for the smallest total squared error, see README
+
+#define AUD_ENCODE_BLOCK_BYTES 512        // ADPCM bytes per block
+#define AUD_ENCODE_MAX_SAMPLES 0x7FFFFFFF // decoded size must fit the header
+
+// Size of the NEW format AUD file AUD_encode() makes of num_samples samples
+uint32_t AUD_encoded_size(uint32_t num_samples);
+
+// Encodes mono 16-bit samples into a NEW format IMA ADPCM AUD file in buf, which must hold AUD_encoded_size() bytes
+// Nibbles are chosen against algorithm #0, the one the games use; an odd count gets one more sample, close to the last one
+// Trellis mode splits the stream into fixed chunks, searched by up to threads threads, the output doesn't depend on threads
+// Returns bytes written, or AUD_ERROR_STATE if mode or num_samples is invalid
+long AUD_encode(const short *pcm, uint32_t num_samples, uint16_t samplerate, int mode, int threads, unsigned char *buf);
+
+
+
+/******************************** Resampling ********************************/
+
+#define AUD_RESAMPLE_FAST 0 // 16 taps per phase, about 50 dB SNR up to 40% of the lower sample rate
+#define AUD_RESAMPLE_GOOD 1 // 32 taps per phase, about 78 dB
+#define AUD_RESAMPLE_BEST 2 // 64 taps per phase, about 90 dB, as good as 16-bit output gets
+
+#define AUD_RESAMPLE_PHASES_MAX 1024 // output rate / GCD of both rates, e.g. 320 for 22050 -> 48000
+#define AUD_RESAMPLE_CHUNK      4096 // input samples buffered at a time
+
+// Polyphase resampler of mono 16-bit samples by a rational ratio, streamed: samples are fed as they are decoded
+// Integer arithmetic, the output is the same with or without AVX2 and vectorization
+typedef struct {
+	uint32_t in_rate;
+	uint32_t out_rate;
+	uint32_t up;      // out_rate / GCD, output sample k is at input sample k * down / up
+	uint32_t down;    // in_rate / GCD
+	uint32_t taps;    // per phase, a multiple of 16, more when downsampling
+	int16_t *filter;  // up phases of taps coefficients and taps finer parts of them, 1.0 = 16384 and 64
+	int16_t *history; // input samples from the first one the next output sample needs, AUD_RESAMPLE_CHUNK + taps
+	uint32_t held;    // samples in history
+	uint32_t skip;    // input samples the next output sample doesn't need any more, when downsampling
+	uint32_t phase;   // of the next output sample, 0..up-1
+	uint64_t in_count;
+	uint64_t out_count;
+	char message[128];
+} AUD_RESAMPLER;
+
+// Number of output samples of num_samples input samples: the ones before the end of the last input sample
+uint64_t AUD_resampled_samples(const AUD_RESAMPLER *r, uint64_t num_samples);
+
+// Largest number of input samples AUD_resample() can take with room for max_out output samples
+uint32_t AUD_resample_input(const AUD_RESAMPLER *r, uint32_t max_out);
+
+// Returns AUD_OK, or AUD_ERROR_STATE if the rates or quality aren't supported (message says why)
+// Every successful or failed init must be followed by AUD_resample_free()
+int AUD_resample_init(AUD_RESAMPLER *r, uint32_t in_rate, uint32_t out_rate, int quality);
+
+// Resamples n samples, out must hold AUD_resampled_samples(r, n) + 1 samples. Returns number of samples written,
+// the last few output samples need input samples that come later
+uint32_t AUD_resample(AUD_RESAMPLER *r, const short *in, uint32_t n, short *out);
+
+// Number of output samples still to be written by AUD_resample_end()
+uint32_t AUD_resample_tail(const AUD_RESAMPLER *r);
+
+// Ends the stream, the input is silent after its last sample. Returns number of samples written
+uint32_t AUD_resample_end(AUD_RESAMPLER *r, short *out);
+
+void AUD_resample_free(AUD_RESAMPLER *r);
+
+
+
+/******************************** Analysis ********************************/
+
+#define AUD_ANALYSIS_RATE_MIN 8000 // loudness needs the K-weighting filter, whose high shelf starts at 1.7 kHz
+
+// Levels of a mono stream, measured on its samples as they are decoded: sample peak, clipping, RMS,
+// and integrated loudness as in EBU R128 / ITU-R BS.1770-4 (K-weighted, 400 ms blocks every 100 ms,
+// gated at -70 LUFS and then 10 LU below their mean). Peak, clipping and RMS are exact integer sums
+typedef struct AUD_ANALYSIS {
+	uint32_t samplerate;
+	uint64_t samples;
+	uint32_t peak;     // largest magnitude, 32768 for a -32768 sample
+	uint64_t clipped;  // samples on the rails of the decoder, 32767 or -32768
+	uint64_t sum_sq;   // squares of all samples
+	// K-weighting: a high shelf and a high pass, step_len = 0 if loudness isn't measured
+	double coef[2][5];  // b0, b1, b2, a1, a2 of each
+	double columns[2][8][4]; // of each, four samples at once with AVX2
+	double state[8];    // of each: last two input samples, last two output samples
+	uint32_t step_len; // samples per 100 ms
+	uint32_t step_pos; // samples in the current step
+	double step_sq;    // K-weighted squares of the current step
+	double *steps;     // of each complete step
+	uint32_t step_count;
+	uint32_t steps_size;
+	// Set by AUD_analysis_end()
+	double peak_db;    // dBFS, -INFINITY if silent
+	double rms_db;     // dBFS, a full scale square wave is 0
+	double loudness;   // LUFS, -INFINITY if shorter than 400 ms or quieter than the gate, NAN if not measured
+} AUD_ANALYSIS;
+
+// Loudness is measured only at AUD_ANALYSIS_RATE_MIN and above
+// Every init must be followed by AUD_analysis_free()
+void AUD_analysis_init(AUD_ANALYSIS *a, uint32_t samplerate);
+
+// Adds n samples, in stream order
+void AUD_analyze(AUD_ANALYSIS *a, const short *pcm, uint32_t n);
+
+// Makes AUD_decode(), AUD_remux(), AUD_decode_multi(), AUD_decode_lanes() and AUD_decode_parallel() add every sample
+// they produce to a, NULL stops it. Set it after rewinding, AUD_decode_all() doesn't feed it,
+// and AUD_remux_parallel() uses one thread: remuxing alone doesn't decode the samples
+void AUD_analyze_stream(AUD_CONTEXT *ctx, AUD_ANALYSIS *a);
+
+// Computes the levels from what was added so far
+void AUD_analysis_end(AUD_ANALYSIS *a);
+
+void AUD_analysis_free(AUD_ANALYSIS *a);
+
+
+
+/******************************** MIX archives ********************************/
+
+// Westwood MIX archive (Tiberian Dawn, Red Alert): an index of entries, sorted by the ID of their filenames, and a body
+// Red Alert archives start with a 32-bit flags word, encrypted ones (Blowfish-encrypted index) are not supported
+#define MIX_HEADER_SIZE     6 // entry count, body size
+#define MIX_ENTRY_SIZE      12
+#define MIX_FLAG_CHECKSUM   0x00010000 // SHA-1 of the body at the end of the archive
+#define MIX_FLAG_ENCRYPTED  0x00020000
+
+typedef struct {
+	uint32_t id;     // MIX_id() of the filename
+	uint32_t offset; // from the start of the archive (not of the body, as stored)
+	uint32_t size;
+} MIX_ENTRY;
+
+// Archive mapped or read into memory, entries are read in place by AUD_open_memory(), fields are read-only for the caller
+typedef struct {
+	const unsigned char *data;
+	size_t size;
+	void *map;    // mapping of the archive, NULL if it was read into data
+	uint32_t flags;
+	uint32_t count;
+	MIX_ENTRY *entries;
+	char message[256]; // why MIX_open() failed
+} MIX_ARCHIVE;
+
+// Maps a MIX archive (reads it into memory if it can't be mapped) and loads its index
+// Returns AUD_OK, AUD_ERROR_FORMAT (not a MIX archive, or a corrupt index), AUD_ERROR_UNSUPPORTED (encrypted),
+// AUD_ERROR_SEEK (not a regular file), or AUD_ERROR_READ (out of memory)
+// Every successful or failed open must be followed by MIX_close(), entries can be read until then
+int MIX_open(MIX_ARCHIVE *mix, FILE *f);
+
+// ID of an entry filename, case-insensitive
+uint32_t MIX_id(const char *name);
+
+// Entry with the given ID, NULL if there is none
+const MIX_ENTRY *MIX_find(const MIX_ARCHIVE *mix, uint32_t id);
+
+void MIX_close(MIX_ARCHIVE *mix);
+
+#endif